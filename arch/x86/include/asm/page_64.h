@@ -37,6 +37,9 @@ extern unsigned long __phys_addr_symbol(unsigned long);
 void clear_page(void *page);
 void copy_page(void *to, void *from);
 
+#define __HAVE_ARCH_COPY_PAGE_NOCACHE
+void copy_page_nocache(void *to, void *from, unsigned long len);
+
 #endif	/* !__ASSEMBLY__ */
 
 #ifdef CONFIG_X86_VSYSCALL_EMULATION
@@ -40,6 +40,7 @@ EXPORT_SYMBOL(_copy_to_user);
 EXPORT_SYMBOL_GPL(memcpy_mcsafe);
 
 EXPORT_SYMBOL(copy_page);
+EXPORT_SYMBOL(copy_page_nocache);
 EXPORT_SYMBOL(clear_page);
 
 EXPORT_SYMBOL(csum_partial);
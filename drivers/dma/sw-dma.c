@@ -0,0 +1,446 @@
+/*
+ * Software DMA engine: DMA_MEMCPY channels served by kernel threads
+ *
+ * Lets DMA_MEMCPY clients such as page migration (MIGRATE_DMA) and
+ * dmatest run on machines without a memcpy capable DMA controller. Each
+ * channel is backed by its own kernel thread that does the copies, so the
+ * work moves off the submitting CPU. The threads can be bound to reserved
+ * cores with the cpus= parameter, e.g. cores taken out of the scheduler
+ * with isolcpus=.
+ *
+ * One DMA device is registered per node that has CPUs to run the threads,
+ * so dev_to_node() of a channel tells where its copies are done.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/sched.h>
+#include <linux/device.h>
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/cpumask.h>
+#include <linux/wait.h>
+
+#include "virt-dma.h"
+
+#define DRIVER_NAME		"sw-dma"
+#define SW_DMA_MAX_CHANS	16
+
+static unsigned int chans_per_node = 4;
+module_param(chans_per_node, uint, S_IRUGO);
+MODULE_PARM_DESC(chans_per_node, "Number of channels on each node (default: 4)");
+
+static char *cpus = "";
+module_param(cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(cpus, "CPUs the channel threads are bound to, one channel per CPU in turn (default: any CPU of the node)");
+
+struct sw_dma_desc {
+	struct virt_dma_desc vd;
+	dma_addr_t dst;
+	dma_addr_t src;
+	size_t len;
+};
+
+struct sw_dma_chan {
+	struct virt_dma_chan vc;
+	struct task_struct *thread;
+	wait_queue_head_t wait;
+};
+
+struct sw_dma_dev {
+	struct dma_device dma;
+	int nr_chans;
+	struct sw_dma_chan chans[SW_DMA_MAX_CHANS];
+};
+
+static cpumask_var_t sw_dma_cpus;
+static struct platform_device *sw_dma_pdevs[MAX_NUMNODES];
+
+static inline struct sw_dma_chan *to_sw_chan(struct dma_chan *chan)
+{
+	return container_of(chan, struct sw_dma_chan, vc.chan);
+}
+
+static inline struct sw_dma_desc *to_sw_desc(struct virt_dma_desc *vd)
+{
+	return container_of(vd, struct sw_dma_desc, vd);
+}
+
+/*
+ * The copies are done by the CPU, so the DMA address handed in has to be
+ * the physical address. sw_dma_probe() makes sure no IOMMU translates for
+ * the device.
+ */
+static void *sw_dma_addr(struct device *dev, dma_addr_t addr)
+{
+	return phys_to_virt(dma_to_phys(dev, addr));
+}
+
+static bool sw_dma_has_work(struct sw_dma_chan *c)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+	ret = !list_empty(&c->vc.desc_issued);
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+
+	return ret;
+}
+
+static struct sw_dma_desc *sw_dma_next_desc(struct sw_dma_chan *c)
+{
+	struct virt_dma_desc *vd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+	vd = vchan_next_desc(&c->vc);
+	if (vd)
+		list_del(&vd->node);
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+
+	return vd ? to_sw_desc(vd) : NULL;
+}
+
+static int sw_dma_thread(void *data)
+{
+	struct sw_dma_chan *c = data;
+	struct device *dev = c->vc.chan.device->dev;
+	struct sw_dma_desc *d;
+	unsigned long flags;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(c->wait,
+				sw_dma_has_work(c) || kthread_should_stop());
+
+		while ((d = sw_dma_next_desc(c))) {
+			memcpy(sw_dma_addr(dev, d->dst), sw_dma_addr(dev, d->src),
+					d->len);
+
+			dma_descriptor_unmap(&d->vd.tx);
+
+			spin_lock_irqsave(&c->vc.lock, flags);
+			vchan_cookie_complete(&d->vd);
+			spin_unlock_irqrestore(&c->vc.lock, flags);
+
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+static struct dma_async_tx_descriptor *sw_dma_prep_memcpy(
+	struct dma_chan *chan, dma_addr_t dst, dma_addr_t src,
+	size_t len, unsigned long flags)
+{
+	struct sw_dma_chan *c = to_sw_chan(chan);
+	struct sw_dma_desc *d;
+
+	if (!len)
+		return NULL;
+
+	d = kzalloc(sizeof(*d), GFP_NOWAIT);
+	if (!d)
+		return NULL;
+
+	d->dst = dst;
+	d->src = src;
+	d->len = len;
+
+	return vchan_tx_prep(&c->vc, &d->vd, flags);
+}
+
+static void sw_dma_issue_pending(struct dma_chan *chan)
+{
+	struct sw_dma_chan *c = to_sw_chan(chan);
+	unsigned long flags;
+	bool issued;
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+	issued = vchan_issue_pending(&c->vc);
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+
+	if (issued)
+		wake_up(&c->wait);
+}
+
+static enum dma_status sw_dma_tx_status(struct dma_chan *chan,
+					dma_cookie_t cookie,
+					struct dma_tx_state *state)
+{
+	return dma_cookie_status(chan, cookie, state);
+}
+
+/* A copy the thread has already picked up runs to completion */
+static int sw_dma_terminate_all(struct dma_chan *chan)
+{
+	struct sw_dma_chan *c = to_sw_chan(chan);
+	unsigned long flags;
+	LIST_HEAD(head);
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+	vchan_get_all_descriptors(&c->vc, &head);
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+	vchan_dma_desc_free_list(&c->vc, &head);
+
+	return 0;
+}
+
+static void sw_dma_synchronize(struct dma_chan *chan)
+{
+	vchan_synchronize(&to_sw_chan(chan)->vc);
+}
+
+static void sw_dma_free_chan_resources(struct dma_chan *chan)
+{
+	vchan_free_chan_resources(&to_sw_chan(chan)->vc);
+}
+
+static void sw_dma_free_desc(struct virt_dma_desc *vd)
+{
+	kfree(to_sw_desc(vd));
+}
+
+static void sw_dma_stop_chans(struct sw_dma_dev *sd)
+{
+	int i;
+
+	for (i = 0; i < sd->nr_chans; ++i) {
+		struct sw_dma_chan *c = &sd->chans[i];
+
+		kthread_stop(c->thread);
+		tasklet_kill(&c->vc.task);
+		list_del(&c->vc.chan.device_node);
+	}
+	sd->nr_chans = 0;
+}
+
+/* Check that DMA addresses of the device are plain physical addresses  */
+static int sw_dma_check_mapping(struct device *dev)
+{
+	struct page *page;
+	dma_addr_t addr;
+	int ret = 0;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	addr = dma_map_page(dev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, addr)) {
+		ret = -EIO;
+		goto out;
+	}
+	if (dma_to_phys(dev, addr) != page_to_phys(page))
+		ret = -ENODEV;
+	dma_unmap_page(dev, addr, PAGE_SIZE, DMA_BIDIRECTIONAL);
+out:
+	__free_page(page);
+	return ret;
+}
+
+static int sw_dma_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	int nid = dev_to_node(dev);
+	struct sw_dma_dev *sd;
+	cpumask_var_t node_cpus;
+	int cpu = -1;
+	int i, ret;
+
+	ret = dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64));
+	if (ret)
+		return ret;
+
+	ret = sw_dma_check_mapping(dev);
+	if (ret) {
+		dev_err(dev, "DMA addresses are translated, cannot copy by CPU\n");
+		return ret;
+	}
+
+	if (!zalloc_cpumask_var(&node_cpus, GFP_KERNEL))
+		return -ENOMEM;
+	cpumask_and(node_cpus, cpumask_of_node(nid), sw_dma_cpus);
+	if (cpumask_empty(node_cpus)) {
+		ret = -ENODEV;
+		goto free_mask;
+	}
+
+	sd = devm_kzalloc(dev, sizeof(*sd), GFP_KERNEL);
+	if (!sd) {
+		ret = -ENOMEM;
+		goto free_mask;
+	}
+
+	INIT_LIST_HEAD(&sd->dma.channels);
+	dma_cap_set(DMA_MEMCPY, sd->dma.cap_mask);
+	sd->dma.dev = dev;
+	sd->dma.copy_align = DMAENGINE_ALIGN_1_BYTE;
+	sd->dma.device_free_chan_resources = sw_dma_free_chan_resources;
+	sd->dma.device_prep_dma_memcpy = sw_dma_prep_memcpy;
+	sd->dma.device_issue_pending = sw_dma_issue_pending;
+	sd->dma.device_tx_status = sw_dma_tx_status;
+	sd->dma.device_terminate_all = sw_dma_terminate_all;
+	sd->dma.device_synchronize = sw_dma_synchronize;
+
+	for (i = 0; i < min_t(int, chans_per_node, SW_DMA_MAX_CHANS); ++i) {
+		struct sw_dma_chan *c = &sd->chans[i];
+
+		c->vc.desc_free = sw_dma_free_desc;
+		vchan_init(&c->vc, &sd->dma);
+		init_waitqueue_head(&c->wait);
+
+		c->thread = kthread_create_on_node(sw_dma_thread, c, nid,
+					"swdma/%d:%d", nid, i);
+		if (IS_ERR(c->thread)) {
+			ret = PTR_ERR(c->thread);
+			list_del(&c->vc.chan.device_node);
+			goto stop_chans;
+		}
+
+		/*
+		 * With an explicit CPU list every channel owns one of the
+		 * CPUs, otherwise it may run anywhere on the node.
+		 */
+		if (cpus[0]) {
+			cpu = cpumask_next(cpu, node_cpus);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(node_cpus);
+			kthread_bind(c->thread, cpu);
+		} else
+			set_cpus_allowed_ptr(c->thread, node_cpus);
+
+		sd->nr_chans++;
+		wake_up_process(c->thread);
+	}
+
+	ret = dma_async_device_register(&sd->dma);
+	if (ret)
+		goto stop_chans;
+
+	platform_set_drvdata(pdev, sd);
+	free_cpumask_var(node_cpus);
+
+	dev_info(dev, "%d channels on node %d\n", sd->nr_chans, nid);
+
+	return 0;
+
+stop_chans:
+	sw_dma_stop_chans(sd);
+free_mask:
+	free_cpumask_var(node_cpus);
+	return ret;
+}
+
+static int sw_dma_remove(struct platform_device *pdev)
+{
+	struct sw_dma_dev *sd = platform_get_drvdata(pdev);
+
+	dma_async_device_unregister(&sd->dma);
+	sw_dma_stop_chans(sd);
+
+	return 0;
+}
+
+static struct platform_driver sw_dma_driver = {
+	.driver		= {
+		.name	= DRIVER_NAME,
+	},
+	.probe		= sw_dma_probe,
+	.remove		= sw_dma_remove,
+};
+
+static void sw_dma_del_devices(void)
+{
+	int nid;
+
+	for_each_node(nid) {
+		if (sw_dma_pdevs[nid]) {
+			platform_device_unregister(sw_dma_pdevs[nid]);
+			sw_dma_pdevs[nid] = NULL;
+		}
+	}
+}
+
+static int sw_dma_add_device(int nid)
+{
+	struct platform_device *pdev;
+	int ret;
+
+	pdev = platform_device_alloc(DRIVER_NAME, nid);
+	if (!pdev)
+		return -ENOMEM;
+
+	set_dev_node(&pdev->dev, nid);
+	pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+
+	ret = platform_device_add(pdev);
+	if (ret) {
+		platform_device_put(pdev);
+		return ret;
+	}
+
+	sw_dma_pdevs[nid] = pdev;
+	return 0;
+}
+
+static int __init sw_dma_init(void)
+{
+	int nid, ret;
+
+	if (!zalloc_cpumask_var(&sw_dma_cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	if (cpus[0]) {
+		ret = cpulist_parse(cpus, sw_dma_cpus);
+		if (ret) {
+			pr_err("%s: invalid cpus=%s\n", DRIVER_NAME, cpus);
+			goto free_mask;
+		}
+		cpumask_and(sw_dma_cpus, sw_dma_cpus, cpu_online_mask);
+	} else
+		cpumask_copy(sw_dma_cpus, cpu_online_mask);
+
+	ret = platform_driver_register(&sw_dma_driver);
+	if (ret)
+		goto free_mask;
+
+	for_each_node_state(nid, N_CPU) {
+		if (!cpumask_intersects(cpumask_of_node(nid), sw_dma_cpus))
+			continue;
+
+		ret = sw_dma_add_device(nid);
+		if (ret)
+			goto del_devices;
+	}
+
+	return 0;
+
+del_devices:
+	sw_dma_del_devices();
+	platform_driver_unregister(&sw_dma_driver);
+free_mask:
+	free_cpumask_var(sw_dma_cpus);
+	return ret;
+}
+module_init(sw_dma_init);
+
+static void __exit sw_dma_exit(void)
+{
+	sw_dma_del_devices();
+	platform_driver_unregister(&sw_dma_driver);
+	free_cpumask_var(sw_dma_cpus);
+}
+module_exit(sw_dma_exit);
+
+MODULE_DESCRIPTION("Software memcpy DMA engine");
+MODULE_LICENSE("GPL v2");
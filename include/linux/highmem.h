@@ -239,6 +239,29 @@ static inline void copy_user_highpage(struct page *to, struct page *from,
 int copy_page_dma(struct page *to, struct page *from, int nr_pages);
 int copy_page_mt(struct page *to, struct page *from, int nr_pages);
 
+#ifndef __HAVE_ARCH_COPY_PAGE_NOCACHE
+/*
+ * Copy @len bytes of page data, @len being a multiple of 64. Architectures
+ * can bypass the cache for the destination, for copies whose result is not
+ * going to be used by this CPU soon.
+ */
+static inline void copy_page_nocache(void *to, void *from, unsigned long len)
+{
+	memcpy(to, from, len);
+}
+#endif
+
+static inline void copy_highpage_nocache(struct page *to, struct page *from)
+{
+	char *vfrom, *vto;
+
+	vfrom = kmap_atomic(from);
+	vto = kmap_atomic(to);
+	copy_page_nocache(vto, vfrom, PAGE_SIZE);
+	kunmap_atomic(vto);
+	kunmap_atomic(vfrom);
+}
+
 static inline void copy_highpage(struct page *to, struct page *from)
 {
 	char *vfrom, *vto;
@@ -63,6 +63,8 @@ extern void hugetlb_cgroup_uncharge_cgroup(int idx, unsigned long nr_pages,
 extern void hugetlb_cgroup_file_init(void) __init;
 extern void hugetlb_cgroup_migrate(struct page *oldhpage,
 				   struct page *newhpage);
+extern void hugetlb_cgroup_exchange(struct page *hpage1,
+				    struct page *hpage2);
 
 #else
 static inline struct hugetlb_cgroup *hugetlb_cgroup_from_page(struct page *page)
@@ -115,5 +117,10 @@ static inline void hugetlb_cgroup_migrate(struct page *oldhpage,
 {
 }
 
+static inline void hugetlb_cgroup_exchange(struct page *hpage1,
+					   struct page *hpage2)
+{
+}
+
 #endif  /* CONFIG_MEM_RES_CTLR_HUGETLB */
 #endif
@@ -71,6 +71,12 @@ static inline int migrate_huge_page_move_mapping(struct address_space *mapping,
 
 #endif /* CONFIG_MIGRATION */
 
+/* In mm/exchange.c: fallback for targets with no free memory left */
+extern int exchange_page_to_node(struct page *page, int nid,
+		enum migrate_mode mode);
+extern int exchange_pages_to_nodes(struct list_head *from,
+		const nodemask_t *nodes, enum migrate_mode mode);
+
 #ifdef CONFIG_NUMA_BALANCING
 extern bool pmd_trans_migrating(pmd_t pmd);
 extern int migrate_misplaced_page(struct page *page,
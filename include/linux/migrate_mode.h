@@ -6,6 +6,9 @@
  *	on most operations but not ->writepage as the potential stall time
  *	is too significant
  * MIGRATE_SYNC will block when migrating pages
+ * MIGRATE_RDONLY copies a mapped page while it is mapped read-only, so
+ *	that only writers wait for the copy
+ * MIGRATE_NOCOPY tells migrate_page_copy() the data is already copied
  */
 enum migrate_mode {
 	MIGRATE_ASYNC		= 1<<0,
@@ -14,6 +17,8 @@ enum migrate_mode {
 	MIGRATE_DMA			= 1<<3,
 	MIGRATE_MT			= 1<<4,
 	MIGRATE_CONCUR		= 1<<5,
+	MIGRATE_RDONLY		= 1<<6,
+	MIGRATE_NOCOPY		= 1<<7,
 };
 
 #endif		/* MIGRATE_MODE_H_INCLUDED */
@@ -237,6 +237,13 @@ unsigned long page_address_in_vma(struct page *, struct vm_area_struct *);
  */
 int page_mkclean(struct page *);
 
+/*
+ * Write protects all the mappings of a page, private and anonymous ones
+ * included, and leaves their dirty bits alone. Returns false if a mapping
+ * could be made writable again without the page lock.
+ */
+bool page_wrprotect(struct page *);
+
 /*
  * called in munlock()/munmap() path to check for other vmas holding
  * the page mlocked.
@@ -294,6 +301,11 @@ static inline int page_mkclean(struct page *page)
 	return 0;
 }
 
+static inline bool page_wrprotect(struct page *page)
+{
+	return false;
+}
+
 
 #endif	/* CONFIG_MMU */
 
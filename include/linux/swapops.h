@@ -163,9 +163,12 @@ static inline int is_write_migration_entry(swp_entry_t entry)
 
 #endif
 
+enum ttu_flags;
+
 #ifdef CONFIG_ARCH_ENABLE_THP_MIGRATION
 extern int set_pmd_migration_entry(struct page *page,
-		struct mm_struct *mm, unsigned long address);
+		struct vm_area_struct *vma, unsigned long address,
+		enum ttu_flags flags);
 
 extern int remove_migration_pmd(struct page *new,
 		struct vm_area_struct *vma, unsigned long addr, void *old);
@@ -196,7 +199,8 @@ static inline int is_pmd_migration_entry(pmd_t pmd)
 }
 #else
 static inline int set_pmd_migration_entry(struct page *page,
-				struct mm_struct *mm, unsigned long address)
+				struct vm_area_struct *vma,
+				unsigned long address, enum ttu_flags flags)
 {
 	return 0;
 }
@@ -11,6 +11,13 @@
 #include <linux/workqueue.h>
 #include <linux/slab.h>
 #include <linux/freezer.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+
+#include "internal.h"
 
 #define NUM_AVAIL_DMA_CHAN 16
 
@@ -21,20 +28,219 @@ int limit_dma_chans = NUM_AVAIL_DMA_CHAN;
 int use_mt_copy = 0;
 int limit_mt_num = 8;
 
-struct dma_chan *copy_chan[NUM_AVAIL_DMA_CHAN] = {0};
-struct dma_device *copy_dev[NUM_AVAIL_DMA_CHAN] = {0};
+/* ======================== DMA channel pool ======================== */
+
+/*
+ * DMA channels used for page copy are cached in per-node pools, keyed by
+ * the node the DMA device sits on. A pool is filled from dmaengine the
+ * first time a copy needs it and grows up to limit_dma_chans as copies ask
+ * for more channels. Channels not used for DMA_CHAN_IDLE_TIMEOUT are handed
+ * back to dmaengine, unless use_all_dma_chans pins them.
+ *
+ * Devices without node affinity go to the extra pool at DMA_CHAN_NO_NODE.
+ */
+#define DMA_CHAN_IDLE_TIMEOUT		(10 * HZ)
+#define DMA_CHAN_REFILL_INTERVAL	(HZ)
+#define DMA_CHAN_NO_NODE		MAX_NUMNODES
+
+struct dma_chan_pool {
+	int nr_chans;
+	struct dma_chan *chans[NUM_AVAIL_DMA_CHAN];
+	/* copies currently holding channels of this pool */
+	int users;
+	unsigned int next_chan;
+	unsigned long last_used;
+	/* do not ask dmaengine again before this, it had nothing left */
+	unsigned long next_refill;
+};
+
+/* A set of channels lent to a single copy  */
+struct dma_chan_set {
+	struct dma_chan_pool *pool;
+	int nr_chans;
+	struct dma_chan *chans[NUM_AVAIL_DMA_CHAN];
+};
+
+static struct dma_chan_pool dma_chan_pools[MAX_NUMNODES + 1];
+/* protects the pool contents; nested inside dma_chan_pool_mutex */
+static DEFINE_SPINLOCK(dma_chan_pool_lock);
+/* serializes dmaengine requests and releases */
+static DEFINE_MUTEX(dma_chan_pool_mutex);
+
+static void dma_chan_pool_shrink(struct work_struct *work);
+static DECLARE_DELAYED_WORK(dma_chan_pool_shrink_work, dma_chan_pool_shrink);
+
+static int dma_chan_pool_idx(struct dma_chan *chan)
+{
+	int nid = dev_to_node(chan->device->dev);
+
+	if (nid < 0 || nid >= MAX_NUMNODES)
+		return DMA_CHAN_NO_NODE;
+	return nid;
+}
+
+static bool dma_chan_pool_filter(struct dma_chan *chan, void *param)
+{
+	return dma_chan_pool_idx(chan) == (long)param;
+}
+
+/* Request channels from dmaengine until the pool holds @want of them  */
+static void dma_chan_pool_fill(int idx, int want)
+{
+	struct dma_chan_pool *pool = &dma_chan_pools[idx];
+	dma_cap_mask_t copy_mask;
+	unsigned long flags;
+	bool grown = false;
+
+	dma_cap_zero(copy_mask);
+	dma_cap_set(DMA_MEMCPY, copy_mask);
+
+	want = min_t(int, want, NUM_AVAIL_DMA_CHAN);
+
+	mutex_lock(&dma_chan_pool_mutex);
+	while (pool->nr_chans < want) {
+		struct dma_chan *chan;
+
+		chan = dma_request_channel(copy_mask, dma_chan_pool_filter,
+					(void *)(long)idx);
+		if (!chan)
+			break;
+
+		spin_lock_irqsave(&dma_chan_pool_lock, flags);
+		pool->chans[pool->nr_chans++] = chan;
+		pool->last_used = jiffies;
+		spin_unlock_irqrestore(&dma_chan_pool_lock, flags);
+		grown = true;
+	}
+	if (pool->nr_chans < want)
+		pool->next_refill = jiffies + DMA_CHAN_REFILL_INTERVAL;
+	mutex_unlock(&dma_chan_pool_mutex);
+
+	if (grown)
+		schedule_delayed_work(&dma_chan_pool_shrink_work,
+					DMA_CHAN_IDLE_TIMEOUT);
+}
+
+static void dma_chan_pool_shrink(struct work_struct *work)
+{
+	bool busy = false;
+	int idx;
+
+	mutex_lock(&dma_chan_pool_mutex);
+	for (idx = 0; idx <= DMA_CHAN_NO_NODE; ++idx) {
+		struct dma_chan_pool *pool = &dma_chan_pools[idx];
+		struct dma_chan *chans[NUM_AVAIL_DMA_CHAN];
+		unsigned long flags;
+		int nr_chans = 0;
+		int i;
+
+		spin_lock_irqsave(&dma_chan_pool_lock, flags);
+		if (pool->nr_chans) {
+			if (pool->users || use_all_dma_chans ||
+			    time_before(jiffies, pool->last_used + DMA_CHAN_IDLE_TIMEOUT)) {
+				busy = true;
+			} else {
+				nr_chans = pool->nr_chans;
+				memcpy(chans, pool->chans, sizeof(chans));
+				pool->nr_chans = 0;
+			}
+		}
+		spin_unlock_irqrestore(&dma_chan_pool_lock, flags);
+
+		for (i = 0; i < nr_chans; ++i)
+			dma_release_channel(chans[i]);
+	}
+	mutex_unlock(&dma_chan_pool_mutex);
+
+	if (busy)
+		schedule_delayed_work(&dma_chan_pool_shrink_work,
+					DMA_CHAN_IDLE_TIMEOUT);
+}
+
+static int dma_chan_pool_try_get(int idx, int nr, struct dma_chan_set *set)
+{
+	struct dma_chan_pool *pool = &dma_chan_pools[idx];
+	unsigned long flags;
+	int i;
+
+	if (READ_ONCE(pool->nr_chans) < nr &&
+	    (!READ_ONCE(pool->next_refill) ||
+	     time_after_eq(jiffies, READ_ONCE(pool->next_refill))))
+		dma_chan_pool_fill(idx, nr);
+
+	spin_lock_irqsave(&dma_chan_pool_lock, flags);
+	nr = min(nr, pool->nr_chans);
+	for (i = 0; i < nr; ++i)
+		set->chans[i] = pool->chans[(pool->next_chan + i) % pool->nr_chans];
+	if (nr) {
+		pool->next_chan += nr;
+		pool->users++;
+	}
+	spin_unlock_irqrestore(&dma_chan_pool_lock, flags);
+
+	set->pool = pool;
+	set->nr_chans = nr;
+
+	return nr;
+}
+
+/*
+ * Lend up to @nr channels to a copy from @src_nid to @dst_nid. Channels
+ * local to the destination node are preferred, then the ones local to the
+ * source node, then devices without node affinity and at last whatever
+ * any other node has. Returns the number of channels in @set, which must
+ * be given back with dma_chan_set_put() if it is not zero.
+ */
+static int dma_chan_set_get(int dst_nid, int src_nid, int nr,
+			struct dma_chan_set *set)
+{
+	int nid;
+
+	nr = min3(nr, limit_dma_chans, NUM_AVAIL_DMA_CHAN);
+	if (nr <= 0)
+		return 0;
+
+	if (dma_chan_pool_try_get(dst_nid, nr, set))
+		return set->nr_chans;
+	if (src_nid != dst_nid && dma_chan_pool_try_get(src_nid, nr, set))
+		return set->nr_chans;
+	if (dma_chan_pool_try_get(DMA_CHAN_NO_NODE, nr, set))
+		return set->nr_chans;
+
+	for_each_online_node(nid) {
+		if (nid == dst_nid || nid == src_nid)
+			continue;
+		if (dma_chan_pool_try_get(nid, nr, set))
+			return set->nr_chans;
+	}
 
+	return 0;
+}
 
+/* Can be called from DMA completion callbacks  */
+static void dma_chan_set_put(struct dma_chan_set *set)
+{
+	unsigned long flags;
 
+	spin_lock_irqsave(&dma_chan_pool_lock, flags);
+	set->pool->users--;
+	set->pool->last_used = jiffies;
+	spin_unlock_irqrestore(&dma_chan_pool_lock, flags);
+}
 
 #ifdef CONFIG_PROC_SYSCTL
+/*
+ * Writing 1 fills the pools of every node up to limit_dma_chans and keeps
+ * the channels cached for as long as the knob stays at 1; writing 0 lets
+ * them go once they have been idle for DMA_CHAN_IDLE_TIMEOUT. The pools
+ * grow and shrink on their own either way.
+ */
 int sysctl_dma_page_migration(struct ctl_table *table, int write,
 				 void __user *buffer, size_t *lenp,
 				 loff_t *ppos)
 {
 	int err = 0;
 	int use_all_dma_chans_prior_val = use_all_dma_chans;
-	dma_cap_mask_t copy_mask;
 
 	if (write && !capable(CAP_SYS_ADMIN))
 		return -EPERM;
@@ -46,88 +252,132 @@ int sysctl_dma_page_migration(struct ctl_table *table, int write,
 	if (write) {
 		/* Grab all DMA channels  */
 		if (use_all_dma_chans_prior_val == 0 && use_all_dma_chans == 1) {
-			int i;
-
-			dma_cap_zero(copy_mask);
-			dma_cap_set(DMA_MEMCPY, copy_mask);
+			int nid;
 
-			dmaengine_get();
-			for (i = 0; i < NUM_AVAIL_DMA_CHAN; ++i) {
-				if (!copy_chan[i]) {
-					copy_chan[i] = dma_request_channel(copy_mask, NULL, NULL);
-				}
-				if (!copy_chan[i]) {
-					pr_err("%s: cannot grab channel: %d\n", __func__, i);
-					continue;
-				}
+			for_each_online_node(nid)
+				dma_chan_pool_fill(nid, limit_dma_chans);
+			dma_chan_pool_fill(DMA_CHAN_NO_NODE, limit_dma_chans);
+		} 
+		/* Release all DMA channels once they are idle  */
+		else if (use_all_dma_chans_prior_val == 1 && use_all_dma_chans == 0) {
+			mod_delayed_work(system_wq, &dma_chan_pool_shrink_work,
+						DMA_CHAN_IDLE_TIMEOUT);
+		}
+	}
+	return err;
+}
 
-				copy_dev[i] = copy_chan[i]->device;
+#endif
 
-				if (!copy_dev[i]) {
-					pr_err("%s: no device: %d\n", __func__, i);
-					continue;
-				}
-			}
+/* ======================== page list partitioning ======================== */
 
-		} 
-		/* Release all DMA channels  */
-		else if (use_all_dma_chans_prior_val == 1 && use_all_dma_chans == 0) {
-			int i;
+/*
+ * List copies split the data, not the list: the pages are seen as one
+ * stream of bytes and cut into ranges of about the same size, one per
+ * worker or channel. A huge page is spread over several ranges and many
+ * base pages end up in one, so all of them finish at about the same time
+ * whatever the mix of page sizes.
+ *
+ * Ranges are a multiple of PAGE_SIZE, or of COPY_WORK_ALIGN when the whole
+ * list is smaller than a page per range. The exchange kernels need the
+ * latter to be a multiple of 64.
+ */
+#define COPY_WORK_ALIGN		64
 
-			for (i = 0; i < NUM_AVAIL_DMA_CHAN; ++i) {
-				if (copy_chan[i]) {
-					dma_release_channel(copy_chan[i]);
-					copy_chan[i] = NULL;
-					copy_dev[i] = NULL;
-				}
-			}
+struct page_list_pos {
+	int idx;
+	unsigned long offset;
+};
 
-			dmaengine_put();
-		}
+static unsigned long page_list_bytes(struct page **to, struct page **from,
+			int nr_pages)
+{
+	unsigned long total = 0;
+	int i;
 
-		if (err)
-			use_all_dma_chans = use_all_dma_chans_prior_val;
+	for (i = 0; i < nr_pages; ++i) {
+		BUG_ON(migrate_nr_pages(from[i]) != migrate_nr_pages(to[i]));
+		total += PAGE_SIZE * migrate_nr_pages(from[i]);
 	}
-	return err;
+
+	return total;
 }
 
-#endif
+static unsigned long page_list_chunk(unsigned long total, int nr_parts,
+			unsigned long min_align)
+{
+	unsigned long chunk = DIV_ROUND_UP(total, nr_parts);
+
+	return round_up(chunk, chunk >= PAGE_SIZE ? PAGE_SIZE : min_align);
+}
+
+/* What is left of the page at pos */
+static unsigned long page_list_seg(struct page **pages,
+			struct page_list_pos *pos)
+{
+	return PAGE_SIZE * migrate_nr_pages(pages[pos->idx]) - pos->offset;
+}
+
+static void page_list_advance(struct page **pages, struct page_list_pos *pos,
+			unsigned long len)
+{
+	while (len) {
+		unsigned long seg = min(len, page_list_seg(pages, pos));
+
+		pos->offset += seg;
+		len -= seg;
+		if (!page_list_seg(pages, pos)) {
+			pos->idx++;
+			pos->offset = 0;
+		}
+	}
+}
 
 /* ======================== DMA copy page ======================== */
 
+/*
+ * Map len bytes at offset of from and to into unmap->addr[0] and addr[1].
+ * The counts only cover what is mapped, so that dmaengine_unmap_put()
+ * stays right when one of the mappings fails.
+ */
+static int dma_map_copy_pages(struct device *dev,
+			struct dmaengine_unmap_data *unmap, struct page *to,
+			struct page *from, unsigned long offset, size_t len)
+{
+	unmap->len = len;
+
+	unmap->addr[0] = dma_map_page(dev, from, offset, len, DMA_TO_DEVICE);
+	if (dma_mapping_error(dev, unmap->addr[0]))
+		return -ENOMEM;
+	unmap->to_cnt = 1;
+
+	unmap->addr[1] = dma_map_page(dev, to, offset, len, DMA_FROM_DEVICE);
+	if (dma_mapping_error(dev, unmap->addr[1]))
+		return -ENOMEM;
+	unmap->from_cnt = 1;
+
+	return 0;
+}
+
 static int copy_page_dma_once(struct page *to, struct page *from, int nr_pages)
 {
-	static struct dma_chan *copy_chan = NULL;
-	struct dma_device *device = NULL;
+	struct dma_chan_set chans;
+	struct dma_chan *copy_chan;
+	struct dma_device *device;
 	struct dma_async_tx_descriptor *tx = NULL;
 	dma_cookie_t cookie;
 	enum dma_ctrl_flags flags = 0;
 	struct dmaengine_unmap_data *unmap = NULL;
-	dma_cap_mask_t mask;
 	int ret_val = 0;
 
-	
-	dma_cap_zero(mask);
-	dma_cap_set(DMA_MEMCPY, mask);
-
-	dmaengine_get();
-
-	copy_chan = dma_request_channel(mask, NULL, NULL);
-
-	if (!copy_chan) {
+	if (!dma_chan_set_get(page_to_nid(to), page_to_nid(from), 1, &chans)) {
 		pr_err("%s: cannot get a channel\n", __func__);
-		ret_val = -1;
-		goto no_chan;
+		return -1;
 	}
 
+	copy_chan = chans.chans[0];
 	device = copy_chan->device;
 
-	if (!device) {
-		pr_err("%s: cannot get a device\n", __func__);
-		ret_val = -2;
-		goto release;
-	}
-		
 	unmap = dmaengine_get_unmap_data(device->dev, 2, GFP_NOWAIT);
 
 	if (!unmap) {
@@ -136,13 +386,12 @@ static int copy_page_dma_once(struct page *to, struct page *from, int nr_pages)
 		goto release;
 	}
 
-	unmap->to_cnt = 1;
-	unmap->addr[0] = dma_map_page(device->dev, from, 0, PAGE_SIZE*nr_pages,
-					  DMA_TO_DEVICE);
-	unmap->from_cnt = 1;
-	unmap->addr[1] = dma_map_page(device->dev, to, 0, PAGE_SIZE*nr_pages,
-					  DMA_FROM_DEVICE);
-	unmap->len = PAGE_SIZE*nr_pages;
+	if (dma_map_copy_pages(device->dev, unmap, to, from, 0,
+				PAGE_SIZE*nr_pages)) {
+		pr_err("%s: cannot map pages\n", __func__);
+		ret_val = -7;
+		goto unmap_dma;
+	}
 
 	tx = device->device_prep_dma_memcpy(copy_chan, 
 						unmap->addr[1],
@@ -171,45 +420,41 @@ static int copy_page_dma_once(struct page *to, struct page *from, int nr_pages)
 unmap_dma:
 	dmaengine_unmap_put(unmap);
 release:
-	if (copy_chan) {
-		dma_release_channel(copy_chan);
-	}
-no_chan:
-	dmaengine_put();
+	dma_chan_set_put(&chans);
 
 	return ret_val;
 }
 
 static int copy_page_dma_always(struct page *to, struct page *from, int nr_pages)
 {
+	struct dma_chan_set chans;
 	struct dma_async_tx_descriptor *tx[NUM_AVAIL_DMA_CHAN] = {0};
 	dma_cookie_t cookie[NUM_AVAIL_DMA_CHAN];
 	enum dma_ctrl_flags flags[NUM_AVAIL_DMA_CHAN] = {0};
 	struct dmaengine_unmap_data *unmap[NUM_AVAIL_DMA_CHAN] = {0};
 	int ret_val = 0;
-	int total_available_chans = NUM_AVAIL_DMA_CHAN;
+	int total_available_chans;
 	int i;
 	size_t page_offset;
 
-	for (i = 0; i < NUM_AVAIL_DMA_CHAN; ++i) {
-		if (!copy_chan[i]) {
-			total_available_chans = i;
-		}
-	}
-	if (total_available_chans != NUM_AVAIL_DMA_CHAN) {
-		pr_err("%d channels are missing", NUM_AVAIL_DMA_CHAN - total_available_chans);
+	total_available_chans = dma_chan_set_get(page_to_nid(to),
+				page_to_nid(from), limit_dma_chans, &chans);
+	if (!total_available_chans) {
+		pr_err("%s: cannot get a channel\n", __func__);
+		return -1;
 	}
 
-	total_available_chans = min_t(int, total_available_chans, limit_dma_chans);
-
 	/* round down to closest 2^x value  */
 	total_available_chans = 1<<ilog2(total_available_chans);
 
-	if ((nr_pages != 1) && (nr_pages % total_available_chans != 0))
-		return -5;
+	if ((nr_pages != 1) && (nr_pages % total_available_chans != 0)) {
+		ret_val = -5;
+		goto release;
+	}
 	
 	for (i = 0; i < total_available_chans; ++i) {
-		unmap[i] = dmaengine_get_unmap_data(copy_dev[i]->dev, 2, GFP_NOWAIT);
+		unmap[i] = dmaengine_get_unmap_data(chans.chans[i]->device->dev,
+						2, GFP_NOWAIT);
 		if (!unmap[i]) {
 			pr_err("%s: no unmap data at chan %d\n", __func__, i);
 			ret_val = -3;
@@ -218,39 +463,31 @@ static int copy_page_dma_always(struct page *to, struct page *from, int nr_pages
 	}
 
 	for (i = 0; i < total_available_chans; ++i) {
+		struct device *dev = chans.chans[i]->device->dev;
+
 		if (nr_pages == 1) {
 			page_offset = PAGE_SIZE / total_available_chans;
 
-			unmap[i]->to_cnt = 1;
-			unmap[i]->addr[0] = dma_map_page(copy_dev[i]->dev, from, page_offset*i,
-							  page_offset,
-							  DMA_TO_DEVICE);
-			unmap[i]->from_cnt = 1;
-			unmap[i]->addr[1] = dma_map_page(copy_dev[i]->dev, to, page_offset*i,
-							  page_offset,
-							  DMA_FROM_DEVICE);
-			unmap[i]->len = page_offset;
+			ret_val = dma_map_copy_pages(dev, unmap[i], to, from,
+						page_offset*i, page_offset);
 		} else {
 			page_offset = nr_pages / total_available_chans;
 
-			unmap[i]->to_cnt = 1;
-			unmap[i]->addr[0] = dma_map_page(copy_dev[i]->dev, 
-								from + page_offset*i, 
-								0,
-								PAGE_SIZE*page_offset,
-								DMA_TO_DEVICE);
-			unmap[i]->from_cnt = 1;
-			unmap[i]->addr[1] = dma_map_page(copy_dev[i]->dev, 
-								to + page_offset*i, 
-								0,
-								PAGE_SIZE*page_offset,
-								DMA_FROM_DEVICE);
-			unmap[i]->len = PAGE_SIZE*page_offset;
+			ret_val = dma_map_copy_pages(dev, unmap[i],
+						nth_page(to, page_offset*i),
+						nth_page(from, page_offset*i), 0,
+						PAGE_SIZE*page_offset);
+		}
+		if (ret_val) {
+			pr_err("%s: cannot map pages at chan %d\n", __func__, i);
+			ret_val = -7;
+			goto unmap_dma;
 		}
 	}
 
 	for (i = 0; i < total_available_chans; ++i) {
-		tx[i] = copy_dev[i]->device_prep_dma_memcpy(copy_chan[i], 
+		tx[i] = chans.chans[i]->device->device_prep_dma_memcpy(
+							chans.chans[i],
 							unmap[i]->addr[1],
 							unmap[i]->addr[0], 
 							unmap[i]->len,
@@ -271,11 +508,11 @@ static int copy_page_dma_always(struct page *to, struct page *from, int nr_pages
 			goto unmap_dma;
 		}
 					
-		dma_async_issue_pending(copy_chan[i]);
+		dma_async_issue_pending(chans.chans[i]);
 	}
 
 	for (i = 0; i < total_available_chans; ++i) {
-		if (dma_sync_wait(copy_chan[i], cookie[i]) != DMA_COMPLETE) {
+		if (dma_sync_wait(chans.chans[i], cookie[i]) != DMA_COMPLETE) {
 			ret_val = -6;
 			pr_err("%s: dma does not complete at chan %d\n", __func__, i);
 		}
@@ -287,6 +524,8 @@ unmap_dma:
 		if (unmap[i])
 			dmaengine_unmap_put(unmap[i]);
 	}
+release:
+	dma_chan_set_put(&chans);
 
 	return ret_val;
 }
@@ -295,8 +534,8 @@ unmap_dma:
 
 int copy_page_dma(struct page *to, struct page *from, int nr_pages)
 {
-	BUG_ON(hpage_nr_pages(from) != nr_pages);
-	BUG_ON(hpage_nr_pages(to) != nr_pages);
+	BUG_ON(migrate_nr_pages(from) != nr_pages);
+	BUG_ON(migrate_nr_pages(to) != nr_pages);
 
 	if (!use_all_dma_chans) {
 		return copy_page_dma_once(to, from, nr_pages);
@@ -305,441 +544,1690 @@ int copy_page_dma(struct page *to, struct page *from, int nr_pages)
 	return copy_page_dma_always(to, from, nr_pages);
 }
 
-/* 
- * Use DMA copy a list of pages to a new location
- *
- * Just put each page into individual DMA channel.
+/*
+ * Asynchronous DMA copy of a list of pages.
  *
- * */
-int copy_page_lists_dma_always(struct page **to, struct page **from, int nr_pages)
+ * Each channel copies one range of the list, see page_list_chunk(), with
+ * one transfer per page or piece of a page in its range. Every transfer
+ * gets its own unmap data, so the list length is not limited by the size
+ * of the dmaengine unmap pools. Only the last transfer on each channel
+ * raises an interrupt; once every channel has signalled, the caller
+ * supplied done() is invoked, possibly from the DMA completion tasklet.
+ */
+struct dma_copy_ctx;
+
+struct dma_copy_chan_ctx {
+	struct dma_copy_ctx *ctx;
+	struct dma_chan *chan;
+	dma_cookie_t cookie;
+};
+
+struct dma_copy_ctx {
+	/* armed channels plus one reference held by the submitter */
+	atomic_t pending;
+	int err;
+
+	dma_copy_done_t done;
+	void *arg;
+
+	/* one per transfer: at most a page, plus a split one per channel */
+	int nr_unmap;
+	struct dmaengine_unmap_data **unmap;
+	struct dma_chan_set chan_set;
+	struct dma_copy_chan_ctx chans[NUM_AVAIL_DMA_CHAN];
+};
+
+static void copy_page_lists_dma_finish(struct dma_copy_ctx *ctx)
 {
-	struct dma_async_tx_descriptor **tx = NULL;
-	dma_cookie_t *cookie = NULL;
-	enum dma_ctrl_flags flags[NUM_AVAIL_DMA_CHAN] = {0};
-	struct dmaengine_unmap_data *unmap[NUM_AVAIL_DMA_CHAN] = {0};
-	int ret_val = 0;
-	int total_available_chans = NUM_AVAIL_DMA_CHAN;
 	int i;
 
-	for (i = 0; i < NUM_AVAIL_DMA_CHAN; ++i) {
-		if (!copy_chan[i]) {
-			total_available_chans = i;
-		}
-	}
-	if (total_available_chans != NUM_AVAIL_DMA_CHAN) {
-		pr_err("%d channels are missing\n", NUM_AVAIL_DMA_CHAN - total_available_chans);
-	}
-	if (limit_dma_chans < total_available_chans)
-		total_available_chans = limit_dma_chans;
+	for (i = 0; i < ctx->nr_unmap; ++i)
+		dmaengine_unmap_put(ctx->unmap[i]);
 
-	/* round down to closest 2^x value  */
-	total_available_chans = 1<<ilog2(total_available_chans);
+	ctx->done(ctx->arg, ctx->err);
 
-	total_available_chans = min_t(int, total_available_chans, nr_pages);
+	dma_chan_set_put(&ctx->chan_set);
+	kfree(ctx->unmap);
+	kfree(ctx);
+}
 
+static void copy_page_lists_dma_chan_done(void *param)
+{
+	struct dma_copy_chan_ctx *chan_ctx = param;
+	struct dma_copy_ctx *ctx = chan_ctx->ctx;
 
-	tx = kzalloc(sizeof(struct dma_async_tx_descriptor*)*nr_pages, GFP_KERNEL);
-	if (!tx) {
-		ret_val = -ENOMEM;
-		goto out;
-	}
-	cookie = kzalloc(sizeof(dma_cookie_t)*nr_pages, GFP_KERNEL);
-	if (!cookie) {
-		ret_val = -ENOMEM;
-		goto out_free_tx;
-	}
+	if (dma_async_is_tx_complete(chan_ctx->chan, chan_ctx->cookie,
+				NULL, NULL) != DMA_COMPLETE)
+		WRITE_ONCE(ctx->err, -EIO);
 
-	
-	for (i = 0; i < total_available_chans; ++i) {
-		int num_xfer_per_dev = nr_pages / total_available_chans;
-		
-		if (i < (nr_pages % total_available_chans))
-			num_xfer_per_dev += 1;
+	if (atomic_dec_and_test(&ctx->pending))
+		copy_page_lists_dma_finish(ctx);
+}
 
-		unmap[i] = dmaengine_get_unmap_data(copy_dev[i]->dev, 
-						2*num_xfer_per_dev, GFP_NOWAIT);
-		if (!unmap[i]) {
-			pr_err("%s: no unmap data at chan %d\n", __func__, i);
-			ret_val = -ENODEV;
-			goto unmap_dma;
-		}
+/*
+ * Returns 0 if done() has been or will be called, with the result of the
+ * copy. On a negative return nothing was submitted and done() is not
+ * called. At most nr_chans channels are used.
+ */
+static int __copy_page_lists_dma_async(struct page **to, struct page **from,
+			int nr_pages, int nr_chans, dma_copy_done_t done, void *arg)
+{
+	struct page_list_pos pos = { 0, 0 };
+	struct dma_copy_ctx *ctx;
+	unsigned long total, chunk;
+	int total_available_chans;
+	int nr_ranges;
+	int i;
+
+	if (nr_pages <= 0)
+		return -EINVAL;
+
+	total = page_list_bytes(to, from, nr_pages);
+
+	ctx = kzalloc(sizeof(struct dma_copy_ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->unmap = kcalloc(nr_pages + NUM_AVAIL_DMA_CHAN,
+				sizeof(struct dmaengine_unmap_data *), GFP_KERNEL);
+	if (!ctx->unmap) {
+		kfree(ctx);
+		return -ENOMEM;
 	}
 
-	for (i = 0; i < total_available_chans; ++i) {
-		int num_xfer_per_dev = nr_pages / total_available_chans;
-		int xfer_idx;
-		
-		if (i < (nr_pages % total_available_chans))
-			num_xfer_per_dev += 1;
-
-		unmap[i]->to_cnt = num_xfer_per_dev;
-		unmap[i]->from_cnt = num_xfer_per_dev;
-		unmap[i]->len = hpage_nr_pages(from[i]) * PAGE_SIZE; 
-
-		for (xfer_idx = 0; xfer_idx < num_xfer_per_dev; ++xfer_idx) {
-			int page_idx = i + xfer_idx * total_available_chans;
-			size_t page_len = hpage_nr_pages(from[page_idx]) * PAGE_SIZE;
-
-			BUG_ON(page_len != hpage_nr_pages(to[page_idx]) * PAGE_SIZE);
-			BUG_ON(unmap[i]->len != page_len);
-
-			unmap[i]->addr[xfer_idx] = 
-				 dma_map_page(copy_dev[i]->dev, from[page_idx], 
-							  0,
-							  page_len,
-							  DMA_TO_DEVICE);
-
-			unmap[i]->addr[xfer_idx+num_xfer_per_dev] = 
-				 dma_map_page(copy_dev[i]->dev, to[page_idx], 
-							  0,
-							  page_len,
-							  DMA_FROM_DEVICE);
-		}
+	total_available_chans = dma_chan_set_get(page_to_nid(to[0]),
+				page_to_nid(from[0]),
+				min_t(unsigned long, nr_chans, total >> PAGE_SHIFT),
+				&ctx->chan_set);
+	if (!total_available_chans) {
+		kfree(ctx->unmap);
+		kfree(ctx);
+		return -ENODEV;
 	}
 
-	for (i = 0; i < total_available_chans; ++i) {
-		int num_xfer_per_dev = nr_pages / total_available_chans;
-		int xfer_idx;
-		
-		if (i < (nr_pages % total_available_chans))
-			num_xfer_per_dev += 1;
-
-		for (xfer_idx = 0; xfer_idx < num_xfer_per_dev; ++xfer_idx) {
-			int page_idx = i + xfer_idx * total_available_chans;
-
-			tx[page_idx] = copy_dev[i]->device_prep_dma_memcpy(copy_chan[i], 
-								unmap[i]->addr[xfer_idx + num_xfer_per_dev],
-								unmap[i]->addr[xfer_idx], 
-								unmap[i]->len,
-								flags[i]);
-			if (!tx[page_idx]) {
-				pr_err("%s: no tx descriptor at chan %d xfer %d\n", 
-					   __func__, i, xfer_idx);
-				ret_val = -ENODEV;
-				goto unmap_dma;
+	atomic_set(&ctx->pending, 1);
+	ctx->done = done;
+	ctx->arg = arg;
+
+	chunk = page_list_chunk(total, total_available_chans, PAGE_SIZE);
+	nr_ranges = DIV_ROUND_UP(total, chunk);
+
+	for (i = 0; i < nr_ranges && !ctx->err; ++i) {
+		struct dma_copy_chan_ctx *chan_ctx = &ctx->chans[i];
+		struct dma_chan *chan = ctx->chan_set.chans[i];
+		struct device *dev = chan->device->dev;
+		unsigned long len = min(chunk, total);
+		dma_cookie_t cookie = 0;
+		bool submitted = false, armed = false;
+
+		chan_ctx->ctx = ctx;
+		chan_ctx->chan = chan;
+		total -= len;
+
+		while (len) {
+			unsigned long seg = min(len, page_list_seg(from, &pos));
+			bool last = seg == len;
+			struct page *to_page = nth_page(to[pos.idx],
+						pos.offset >> PAGE_SHIFT);
+			struct page *from_page = nth_page(from[pos.idx],
+						pos.offset >> PAGE_SHIFT);
+			struct dmaengine_unmap_data *unmap;
+			struct dma_async_tx_descriptor *tx;
+
+			unmap = dmaengine_get_unmap_data(dev, 2, GFP_NOWAIT);
+			if (!unmap) {
+				pr_err("%s: no unmap data at chan %d\n", __func__, i);
+				ctx->err = -ENOMEM;
+				break;
 			}
+			ctx->unmap[ctx->nr_unmap++] = unmap;
 
-			cookie[page_idx] = tx[page_idx]->tx_submit(tx[page_idx]);
+			if (dma_map_copy_pages(dev, unmap, to_page, from_page,
+						offset_in_page(pos.offset), seg)) {
+				pr_err("%s: cannot map pages at chan %d\n", __func__, i);
+				ctx->err = -ENOMEM;
+				break;
+			}
 
-			if (dma_submit_error(cookie[page_idx])) {
-				pr_err("%s: submission error at chan %d xfer %d\n",
-					   __func__, i, xfer_idx);
-				ret_val = -ENODEV;
-				goto unmap_dma;
+			tx = chan->device->device_prep_dma_memcpy(chan,
+						unmap->addr[1], unmap->addr[0],
+						unmap->len,
+						last ? DMA_PREP_INTERRUPT : 0);
+			if (!tx) {
+				pr_err("%s: no tx descriptor at chan %d\n", __func__, i);
+				ctx->err = -ENODEV;
+				break;
 			}
-		}
 
-		dma_async_issue_pending(copy_chan[i]);
-	}
+			if (last) {
+				tx->callback = copy_page_lists_dma_chan_done;
+				tx->callback_param = chan_ctx;
+				atomic_inc(&ctx->pending);
+			}
 
-	for (i = 0; i < total_available_chans; ++i) {
-		int num_xfer_per_dev = nr_pages / total_available_chans;
-		int xfer_idx;
-		
-		if (i < (nr_pages % total_available_chans))
-			num_xfer_per_dev += 1;
-
-		for (xfer_idx = 0; xfer_idx < num_xfer_per_dev; ++xfer_idx) {
-			int page_idx = i + xfer_idx * total_available_chans;
-
-			if (dma_sync_wait(copy_chan[i], cookie[page_idx]) != DMA_COMPLETE) {
-				ret_val = -6;
-				pr_err("%s: dma does not complete at chan %d, xfer %d\n",
-					   __func__, i, xfer_idx);
+			cookie = tx->tx_submit(tx);
+			if (dma_submit_error(cookie)) {
+				pr_err("%s: submission error at chan %d\n", __func__, i);
+				if (last)
+					atomic_dec(&ctx->pending);
+				ctx->err = -ENODEV;
+				break;
 			}
+			chan_ctx->cookie = cookie;
+			submitted = true;
+			armed = last;
+
+			page_list_advance(from, &pos, seg);
+			len -= seg;
 		}
-	}
 
-unmap_dma:
-	for (i = 0; i < total_available_chans; ++i) {
-		if (unmap[i])
-			dmaengine_unmap_put(unmap[i]);
+		if (submitted)
+			dma_async_issue_pending(chan);
+
+		/*
+		 * Without an armed callback nobody tells us when the transfers
+		 * already queued on this channel are done, so wait for them
+		 * before the unmap data can be released.
+		 */
+		if (submitted && !armed)
+			dma_sync_wait(chan, cookie);
 	}
 
-	kfree(cookie);
-out_free_tx:
-	kfree(tx);
-out:
+	if (atomic_dec_and_test(&ctx->pending))
+		copy_page_lists_dma_finish(ctx);
 
-	return ret_val;
+	return 0;
 }
-/* ======================== multi-threaded copy page ======================== */
 
-struct copy_page_info {
-	struct work_struct copy_page_work;
-	char *to;
-	char *from;
-	unsigned long chunk_size;
-};
-
-static void copy_page_routine(char *vto, char *vfrom, 
-	unsigned long chunk_size)
+int copy_page_lists_dma_async(struct page **to, struct page **from,
+			int nr_pages, dma_copy_done_t done, void *arg)
 {
-	memcpy(vto, vfrom, chunk_size);
+	return __copy_page_lists_dma_async(to, from, nr_pages, nr_pages,
+				done, arg);
 }
 
-static void copy_page_work_queue_thread(struct work_struct *work)
+struct dma_copy_waiter {
+	struct completion done;
+	int err;
+};
+
+static void copy_page_lists_dma_wake(void *arg, int err)
 {
-	struct copy_page_info *my_work = (struct copy_page_info*)work;
+	struct dma_copy_waiter *waiter = arg;
 
-	copy_page_routine(my_work->to,
-					  my_work->from,
-					  my_work->chunk_size);
+	waiter->err = err;
+	complete(&waiter->done);
 }
 
-int copy_page_mt(struct page *to, struct page *from, int nr_pages)
+static int copy_page_lists_dma_wait(struct page **to, struct page **from,
+			int nr_pages, int nr_chans)
 {
-	int total_mt_num = limit_mt_num;
-	int to_node = page_to_nid(to);
-	int i;
-	struct copy_page_info *work_items;
-	char *vto, *vfrom;
-	unsigned long chunk_size;
-	const struct cpumask *per_node_cpumask = cpumask_of_node(to_node);
-	int cpu_id_list[32] = {0};
-	int cpu;
-
-	if (!use_mt_copy)
-		return -1;
+	struct dma_copy_waiter waiter;
+	int ret_val;
 
-	work_items = kzalloc(sizeof(struct copy_page_info)*total_mt_num, 
-						 GFP_KERNEL);
-	if (!work_items)
-		return -ENOMEM;
+	init_completion(&waiter.done);
 
-	i = 0;
-	for_each_cpu(cpu, per_node_cpumask) {
-		if (i >= total_mt_num)
-			break;
-		cpu_id_list[i] = cpu;
-		++i;
-	}
+	ret_val = __copy_page_lists_dma_async(to, from, nr_pages, nr_chans,
+				copy_page_lists_dma_wake, &waiter);
+	if (ret_val)
+		return ret_val;
 
-	/* XXX: assume no highmem  */
-	vfrom = kmap_atomic(from);
-	vto = kmap_atomic(to);
-	chunk_size = PAGE_SIZE*nr_pages / total_mt_num;
+	wait_for_completion(&waiter.done);
 
-	for (i = 0; i < total_mt_num; ++i) {
-		INIT_WORK((struct work_struct *)&work_items[i], copy_page_work_queue_thread);
+	return waiter.err;
+}
 
-		work_items[i].to = vto + i * chunk_size;
-		work_items[i].from = vfrom + i * chunk_size;
-		work_items[i].chunk_size = chunk_size;
+/*
+ * Use DMA copy a list of pages to a new location
+ *
+ * Just put each page into individual DMA channel.
+ *
+ * */
+int copy_page_lists_dma_always(struct page **to, struct page **from, int nr_pages)
+{
+	return copy_page_lists_dma_wait(to, from, nr_pages, nr_pages);
+}
 
-		queue_work_on(cpu_id_list[i], 
-					  system_highpri_wq, 
-					  (struct work_struct *)&work_items[i]);
-	}
+/* ======================== copy worker threads ======================== */
 
-	/* Wait until it finishes  */
-	flush_workqueue(system_highpri_wq);
+/*
+ * Multi-threaded copy and exchange are served by a pool of kernel threads
+ * per NUMA node instead of the shared system_highpri_wq, so a caller only
+ * waits for its own chunks and never for unrelated high priority work.
+ * Work descriptors are preallocated per node; a request falls back to
+ * kmalloc() only when the preallocated descriptors run out.
+ */
+#define MAX_COPY_WORKERS_PER_NODE 32
+#define NR_COPY_WORKS_PER_NODE (4 * MAX_COPY_WORKERS_PER_NODE)
 
-	kunmap_atomic(vto);
-	kunmap_atomic(vfrom);
+typedef void (*copy_routine_t)(char *vto, char *vfrom,
+			unsigned long chunk_size);
 
-	kfree(work_items);
+struct copy_request {
+	atomic_t pending;
+	struct completion done;
+};
 
-	return 0;
-}
+/*
+ * A copy_work copies (or exchanges) len bytes of pages to[first],
+ * to[first + 1], ... taken as one stream, starting offset bytes into
+ * to[first]. See page_list_chunk().
+ */
+struct copy_work {
+	struct list_head list;
+	struct copy_request *req;
+	copy_routine_t routine;
 
-int copy_page_lists_mt(struct page **to, struct page **from, int nr_pages) 
-{
-	int err = 0;
-	int total_mt_num = limit_mt_num;
-	int to_node = page_to_nid(*to);
-	int i;
-	struct copy_page_info *work_items;
-	int nr_pages_per_page = hpage_nr_pages(*from);
-	const struct cpumask *per_node_cpumask = cpumask_of_node(to_node);
-	int cpu_id_list[32] = {0};
-	int cpu;
+	struct page **to;
+	struct page **from;
+	int first;
 
-	if (!use_mt_copy)
-		return -1;
+	unsigned long offset;
+	unsigned long len;
 
-	work_items = kzalloc(sizeof(struct copy_page_info)*nr_pages, 
-						 GFP_KERNEL);
-	if (!work_items)
-		return -ENOMEM;
+	bool preallocated;
+};
 
-	total_mt_num = min_t(int, nr_pages, total_mt_num);
+struct copy_worker_pool;
 
-	i = 0;
-	for_each_cpu(cpu, per_node_cpumask) {
-		if (i >= total_mt_num)
-			break;
-		cpu_id_list[i] = cpu;
-		++i;
-	}
+struct copy_worker {
+	struct copy_worker_pool *pool;
+	struct task_struct *task;
+	spinlock_t lock;
+	struct list_head work_list;
+	wait_queue_head_t wait;
+};
 
-	for (i = 0; i < nr_pages; ++i) {
-		int thread_idx = i % total_mt_num;
+struct copy_worker_pool {
+	int nid;
+	int nr_workers;
+	struct copy_worker workers[MAX_COPY_WORKERS_PER_NODE];
 
-		INIT_WORK((struct work_struct *)&work_items[i], 
-				  copy_page_work_queue_thread);
+	spinlock_t free_lock;
+	struct list_head free_works;
+	struct copy_work works[NR_COPY_WORKS_PER_NODE];
+};
 
-		/* XXX: assume no highmem  */
-		work_items[i].to = kmap_atomic(to[i]);
-		work_items[i].from = kmap_atomic(from[i]);
-		work_items[i].chunk_size = PAGE_SIZE * hpage_nr_pages(from[i]);
+static struct copy_worker_pool *copy_worker_pools[MAX_NUMNODES];
 
-		BUG_ON(nr_pages_per_page != hpage_nr_pages(from[i]));
-		BUG_ON(nr_pages_per_page != hpage_nr_pages(to[i]));
+static struct copy_worker_pool *copy_worker_pool_of(int nid)
+{
+	struct copy_worker_pool *pool = copy_worker_pools[nid];
 
+	/* memory-only nodes borrow the workers of the local node */
+	if (!pool)
+		pool = copy_worker_pools[numa_node_id()];
 
-		queue_work_on(cpu_id_list[thread_idx], 
-					  system_highpri_wq, 
-					  (struct work_struct *)&work_items[i]);
-	}
+	return pool;
+}
 
-	/* Wait until it finishes  */
-	flush_workqueue(system_highpri_wq);
+static struct copy_work *get_copy_work(struct copy_worker_pool *pool)
+{
+	struct copy_work *work = NULL;
 
-	for (i = 0; i < nr_pages; ++i) {
-			kunmap_atomic(work_items[i].to);
-			kunmap_atomic(work_items[i].from);
+	spin_lock_irq(&pool->free_lock);
+	if (!list_empty(&pool->free_works)) {
+		work = list_first_entry(&pool->free_works, struct copy_work, list);
+		list_del(&work->list);
 	}
+	spin_unlock_irq(&pool->free_lock);
 
-	kfree(work_items);
+	if (!work) {
+		work = kmalloc(sizeof(struct copy_work), GFP_KERNEL);
+		if (!work)
+			return NULL;
+		work->preallocated = false;
+	}
 
-	return err;
+	return work;
 }
 
-/* ====================== multi-threaded exchange page ====================== */
-static void exchange_page_routine(char *to, char *from, unsigned long chunk_size)
+static void put_copy_work(struct copy_worker_pool *pool,
+			struct copy_work *work)
 {
-	u64 tmp;
-	int i;
+	unsigned long flags;
 
-	for (i = 0; i < chunk_size; i += sizeof(tmp)) {
-		tmp = *((u64*)(from + i));
-		*((u64*)(from + i)) = *((u64*)(to + i));
-		*((u64*)(to + i)) = tmp;
+	if (!work->preallocated) {
+		kfree(work);
+		return;
 	}
+
+	spin_lock_irqsave(&pool->free_lock, flags);
+	list_add(&work->list, &pool->free_works);
+	spin_unlock_irqrestore(&pool->free_lock, flags);
+}
+
+static void copy_request_init(struct copy_request *req, int nr_works)
+{
+	atomic_set(&req->pending, nr_works);
+	init_completion(&req->done);
 }
 
-static void exchange_page_work_queue_thread(struct work_struct *work)
+/*
+ * The most a worker processes with preemption disabled. A chunk of a
+ * gigantic page is cut into pieces of this size with a rescheduling point
+ * in between.
+ */
+#define COPY_WORK_PIECE_SIZE	(PAGE_SIZE << (MAX_ORDER - 1))
+
+static void copy_work_run_one(struct copy_work *work, struct page *to,
+			struct page *from, unsigned long offset,
+			unsigned long chunk_size)
 {
-	struct copy_page_info *my_work = (struct copy_page_info*)work;
+	while (chunk_size) {
+		unsigned long size = min_t(unsigned long, chunk_size,
+					COPY_WORK_PIECE_SIZE);
+		char *vto, *vfrom;
 
-	exchange_page_routine(my_work->to,
-					  my_work->from,
-					  my_work->chunk_size);
+		/* XXX: assume no highmem  */
+		vto = kmap_atomic(nth_page(to, offset >> PAGE_SHIFT));
+		vfrom = kmap_atomic(nth_page(from, offset >> PAGE_SHIFT));
+
+		work->routine(vto + offset_in_page(offset),
+					  vfrom + offset_in_page(offset), size);
+
+		kunmap_atomic(vfrom);
+		kunmap_atomic(vto);
+
+		offset += size;
+		chunk_size -= size;
+		if (chunk_size)
+			cond_resched();
+	}
 }
 
-int exchange_page_mt(struct page *to, struct page *from, int nr_pages)
+static void copy_work_run(struct copy_work *work)
+{
+	struct page_list_pos pos = { work->first, work->offset };
+	unsigned long len = work->len;
+
+	while (len) {
+		unsigned long seg = min(len, page_list_seg(work->from, &pos));
+
+		copy_work_run_one(work, work->to[pos.idx], work->from[pos.idx],
+					pos.offset, seg);
+		page_list_advance(work->from, &pos, seg);
+		len -= seg;
+	}
+}
+
+static void copy_work_done(struct copy_worker_pool *pool,
+			struct copy_work *work)
+{
+	struct copy_request *req = work->req;
+
+	put_copy_work(pool, work);
+
+	if (atomic_dec_and_test(&req->pending))
+		complete(&req->done);
+}
+
+static void queue_copy_work(struct copy_worker_pool *pool, int worker_idx,
+			struct copy_work *work)
+{
+	struct copy_worker *worker = &pool->workers[worker_idx % pool->nr_workers];
+	unsigned long flags;
+
+	spin_lock_irqsave(&worker->lock, flags);
+	list_add_tail(&work->list, &worker->work_list);
+	spin_unlock_irqrestore(&worker->lock, flags);
+
+	wake_up(&worker->wait);
+}
+
+static int copy_worker_thread(void *data)
+{
+	struct copy_worker *worker = data;
+	struct copy_worker_pool *pool = worker->pool;
+
+	set_user_nice(current, MIN_NICE);
+
+	while (!kthread_should_stop()) {
+		struct copy_work *work = NULL;
+
+		wait_event_interruptible(worker->wait,
+				!list_empty_careful(&worker->work_list) ||
+				kthread_should_stop());
+
+		spin_lock_irq(&worker->lock);
+		if (!list_empty(&worker->work_list)) {
+			work = list_first_entry(&worker->work_list,
+						struct copy_work, list);
+			list_del(&work->list);
+		}
+		spin_unlock_irq(&worker->lock);
+
+		if (!work)
+			continue;
+
+		copy_work_run(work);
+		copy_work_done(pool, work);
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Hand out one descriptor per worker. If no descriptor can be had, the
+ * chunk is processed by the caller itself, so a request always completes.
+ */
+static void submit_copy_work(struct copy_worker_pool *pool, int worker_idx,
+			struct copy_work *template)
+{
+	struct copy_work *work = get_copy_work(pool);
+
+	if (!work) {
+		copy_work_run(template);
+		if (atomic_dec_and_test(&template->req->pending))
+			complete(&template->req->done);
+		return;
+	}
+
+	work->req = template->req;
+	work->routine = template->routine;
+	work->to = template->to;
+	work->from = template->from;
+	work->first = template->first;
+	work->offset = template->offset;
+	work->len = template->len;
+
+	queue_copy_work(pool, worker_idx, work);
+}
+
+static int __init copy_worker_pool_init(int nid)
 {
-	int total_mt_num = limit_mt_num;
-	int to_node = page_to_nid(to);
+	const struct cpumask *node_cpumask = cpumask_of_node(nid);
+	struct copy_worker_pool *pool;
+	int nr_workers;
 	int i;
-	struct copy_page_info *work_items;
-	char *vto, *vfrom;
-	unsigned long chunk_size;
-	const struct cpumask *per_node_cpumask = cpumask_of_node(to_node);
-	int cpu_id_list[32] = {0};
-	int cpu;
 
-	if (!use_mt_copy)
-		return -1;
+	nr_workers = min_t(int, cpumask_weight(node_cpumask),
+				MAX_COPY_WORKERS_PER_NODE);
+	if (!nr_workers)
+		return 0;
 
-	work_items = kzalloc(sizeof(struct copy_page_info)*total_mt_num, 
-						 GFP_KERNEL);
-	if (!work_items)
+	pool = kzalloc_node(sizeof(struct copy_worker_pool), GFP_KERNEL, nid);
+	if (!pool)
 		return -ENOMEM;
 
-	i = 0;
-	for_each_cpu(cpu, per_node_cpumask) {
-		if (i >= total_mt_num)
+	pool->nid = nid;
+	spin_lock_init(&pool->free_lock);
+	INIT_LIST_HEAD(&pool->free_works);
+	for (i = 0; i < NR_COPY_WORKS_PER_NODE; ++i) {
+		pool->works[i].preallocated = true;
+		list_add_tail(&pool->works[i].list, &pool->free_works);
+	}
+
+	for (i = 0; i < nr_workers; ++i) {
+		struct copy_worker *worker = &pool->workers[i];
+
+		worker->pool = pool;
+		spin_lock_init(&worker->lock);
+		INIT_LIST_HEAD(&worker->work_list);
+		init_waitqueue_head(&worker->wait);
+	}
+
+	for (i = 0; i < nr_workers; ++i) {
+		struct task_struct *task;
+
+		task = kthread_create_on_node(copy_worker_thread,
+					&pool->workers[i], nid,
+					"kmigcopy/%d:%d", nid, i);
+		if (IS_ERR(task)) {
+			pr_err("%s: cannot create copy worker %d on node %d\n",
+				   __func__, i, nid);
 			break;
-		cpu_id_list[i] = cpu;
-		++i;
+		}
+		set_cpus_allowed_ptr(task, node_cpumask);
+		pool->workers[i].task = task;
+		pool->nr_workers = i + 1;
+	}
+
+	if (!pool->nr_workers) {
+		kfree(pool);
+		return -ENOMEM;
 	}
 
-	/* XXX: assume no highmem  */
-	vfrom = kmap_atomic(from);
-	vto = kmap_atomic(to);
-	chunk_size = PAGE_SIZE*nr_pages / total_mt_num;
+	for (i = 0; i < pool->nr_workers; ++i)
+		wake_up_process(pool->workers[i].task);
+
+	copy_worker_pools[nid] = pool;
 
-	for (i = 0; i < total_mt_num; ++i) {
-		INIT_WORK((struct work_struct *)&work_items[i], exchange_page_work_queue_thread);
+	return 0;
+}
+
+static int __init copy_page_workers_init(void)
+{
+	int nid;
 
-		work_items[i].to = vto + i * chunk_size;
-		work_items[i].from = vfrom + i * chunk_size;
-		work_items[i].chunk_size = chunk_size;
+	for_each_node_state(nid, N_CPU)
+		if (copy_worker_pool_init(nid))
+			pr_err("%s: no copy workers on node %d\n", __func__, nid);
+
+	return 0;
+}
+late_initcall(copy_page_workers_init);
+
+/* ======================== multi-threaded copy page ======================== */
+
+static void copy_page_routine(char *vto, char *vfrom,
+	unsigned long chunk_size)
+{
+	if (chunk_size >= COPY_NOCACHE_MIN_PAGES * PAGE_SIZE)
+		copy_page_nocache(vto, vfrom, chunk_size);
+	else
+		memcpy(vto, vfrom, chunk_size);
+}
 
-		queue_work_on(cpu_id_list[i], 
-					  system_highpri_wq, 
-					  (struct work_struct *)&work_items[i]);
+/*
+ * Split a list of pages into up to total_mt_num ranges of the same size,
+ * see page_list_chunk(), and process them in parallel on the workers of
+ * the node of the first destination page. Pages may be of different
+ * sizes, as long as each one matches its counterpart.
+ */
+static int process_page_lists_mt(struct page **to, struct page **from,
+			int nr_pages, int total_mt_num, copy_routine_t routine)
+{
+	struct copy_worker_pool *pool = copy_worker_pool_of(page_to_nid(*to));
+	struct page_list_pos pos = { 0, 0 };
+	unsigned long total, chunk;
+	struct copy_request req;
+	struct copy_work template;
+	int i, nr_works;
+
+	if (!use_mt_copy)
+		return -1;
+
+	if (!pool)
+		return -ENODEV;
+
+	total_mt_num = min_t(int, pool->nr_workers, total_mt_num);
+	if (total_mt_num <= 0)
+		return -ENODEV;
+
+	total = page_list_bytes(to, from, nr_pages);
+	chunk = page_list_chunk(total, total_mt_num, COPY_WORK_ALIGN);
+	nr_works = DIV_ROUND_UP(total, chunk);
+
+	copy_request_init(&req, nr_works);
+
+	template.req = &req;
+	template.routine = routine;
+	template.to = to;
+	template.from = from;
+
+	for (i = 0; i < nr_works; ++i) {
+		template.first = pos.idx;
+		template.offset = pos.offset;
+		template.len = min(chunk, total);
+
+		submit_copy_work(pool, i, &template);
+
+		page_list_advance(from, &pos, template.len);
+		total -= template.len;
 	}
 
 	/* Wait until it finishes  */
-	flush_workqueue(system_highpri_wq);
+	wait_for_completion(&req.done);
+
+	return 0;
+}
+
+int copy_page_mt(struct page *to, struct page *from, int nr_pages)
+{
+	BUG_ON(migrate_nr_pages(from) != nr_pages);
+
+	return process_page_lists_mt(&to, &from, 1, limit_mt_num,
+				copy_page_routine);
+}
+
+int copy_page_lists_mt(struct page **to, struct page **from, int nr_pages)
+{
+	return process_page_lists_mt(to, from, nr_pages, limit_mt_num,
+				copy_page_routine);
+}
 
-	kunmap_atomic(vto);
-	kunmap_atomic(vfrom);
+/* ======================== other work on the copy workers ================= */
 
-	kfree(work_items);
+/*
+ * How many workers a copy can usefully use at once on node nid, 0 if the
+ * copy workers are not to be used. Migration also sizes its unmap and
+ * remap lanes with it.
+ */
+int copy_workers_nr(int nid)
+{
+	struct copy_worker_pool *pool = copy_worker_pool_of(nid);
+
+	if (!use_mt_copy || !pool)
+		return 0;
+
+	return max_t(int, min_t(int, limit_mt_num, pool->nr_workers), 0);
+}
+
+/* ======================== copy method selection ======================== */
+
+/*
+ * Which of the serial, multi-threaded and DMA copies is fastest, and with
+ * how many workers or channels, depends on the amount of data, the two
+ * nodes and what else is using them: for a single 4K page, setting up a
+ * DMA transfer costs more than the copy itself. So the throughput of each
+ * method and degree of parallelism is kept per node pair and size class,
+ * and refined with every copy made through copy_page_lists_auto(). Each
+ * copy goes to the method with the best estimate, except every
+ * COPY_EXPLORE_RATE-th one, which tries a random method so that the
+ * estimates of the others follow the load too.
+ *
+ * A node pair is measured the first time a copy between its nodes asks
+ * for it, from a work item, and only for a few degrees: the others are
+ * filled in by exploring. Copies between the two nodes are left to the
+ * caller until then.
+ *
+ * Size classes are log2 of the number of base pages in the copy.
+ */
+#define COPY_SIZE_CLASSES	12
+#define COPY_DEGREES		6	/* 1 .. 32 workers or channels */
+#define COPY_EXPLORE_RATE	64
+#define COPY_BENCH_ORDER	min(9, MAX_ORDER - 1)
+#define COPY_BENCH_RUNS		2
+
+int adaptive_page_copy = 1;
+
+enum copy_method {
+	COPY_METHOD_SERIAL,
+	COPY_METHOD_MT,
+	COPY_METHOD_DMA,
+	NR_COPY_METHODS,
+};
+
+static const char * const copy_method_names[NR_COPY_METHODS] = {
+	"serial", "mt", "dma",
+};
+
+struct copy_choice {
+	enum copy_method method;
+	int degree;	/* log2 of the workers or channels */
+};
+
+enum copy_model_state {
+	COPY_MODEL_NEW,
+	COPY_MODEL_QUEUED,	/* waiting for copy_calibrate_work */
+	COPY_MODEL_READY,
+};
+
+struct copy_rate_model {
+	/* MB/s, 0 until measured */
+	unsigned int rate[COPY_SIZE_CLASSES][NR_COPY_METHODS][COPY_DEGREES];
+	int state;
+};
+
+/* nr_node_ids * nr_node_ids models, indexed by destination then source */
+static struct copy_rate_model *copy_rate_models;
+
+static struct copy_rate_model *copy_rate_model_of(int dst_nid, int src_nid)
+{
+	if (!copy_rate_models)
+		return NULL;
+	return &copy_rate_models[dst_nid * nr_node_ids + src_nid];
+}
+
+static int copy_size_class(unsigned long nr_base_pages)
+{
+	return min_t(int, ilog2(nr_base_pages), COPY_SIZE_CLASSES - 1);
+}
+
+/* The estimate of the closest size class that has been measured */
+static unsigned int copy_rate_estimate(struct copy_rate_model *model,
+			int class, enum copy_method method, int degree)
+{
+	int d;
+
+	for (d = 0; d < COPY_SIZE_CLASSES; ++d) {
+		unsigned int rate = 0;
+
+		if (class - d >= 0)
+			rate = READ_ONCE(model->rate[class - d][method][degree]);
+		if (!rate && class + d < COPY_SIZE_CLASSES)
+			rate = READ_ONCE(model->rate[class + d][method][degree]);
+		if (rate)
+			return rate;
+	}
 
 	return 0;
 }
 
-int exchange_page_lists_mt(struct page **to, struct page **from, int nr_pages) 
+static void copy_rate_update(struct copy_rate_model *model, int class,
+			const struct copy_choice *choice, unsigned long bytes,
+			u64 ns)
 {
-	int err = 0;
-	int total_mt_num = limit_mt_num;
-	int to_node = page_to_nid(*to);
+	unsigned int *rate = &model->rate[class][choice->method][choice->degree];
+	unsigned int sample, old;
+
+	if (!ns)
+		ns = 1;
+	sample = div64_u64((u64)bytes * NSEC_PER_SEC, ns << 20);
+	if (!sample)
+		sample = 1;
+
+	/* EWMA with weight 1/8, racy updates only lose a sample */
+	old = READ_ONCE(*rate);
+	WRITE_ONCE(*rate, old ? (old * 7 + sample) / 8 : sample);
+}
+
+/*
+ * The largest degree each method can use for a copy of nr_base_pages: the
+ * workers split pages further, but a DMA channel takes at least a page.
+ * -1 if the method cannot be used.
+ */
+static void copy_degree_limits(int dst_nid, unsigned long nr_base_pages,
+			int max_degree[NR_COPY_METHODS])
+{
+	struct copy_worker_pool *pool = copy_worker_pool_of(dst_nid);
+	int nr;
+
+	max_degree[COPY_METHOD_SERIAL] = 0;
+
+	nr = 0;
+	if (use_mt_copy && pool)
+		nr = min_t(int, limit_mt_num, pool->nr_workers);
+	max_degree[COPY_METHOD_MT] = nr > 0 ?
+		min_t(int, ilog2(nr), COPY_DEGREES - 1) : -1;
+
+	nr = min_t(unsigned long, nr_base_pages,
+			min(limit_dma_chans, NUM_AVAIL_DMA_CHAN));
+	max_degree[COPY_METHOD_DMA] = nr > 0 ?
+		min_t(int, ilog2(nr), COPY_DEGREES - 1) : -1;
+}
+
+static void copy_method_select(struct copy_rate_model *model, int class,
+			int max_degree[NR_COPY_METHODS],
+			struct copy_choice *choice)
+{
+	unsigned int best = 0;
+	int method, degree;
+
+	choice->method = COPY_METHOD_SERIAL;
+	choice->degree = 0;
+
+	if (!(prandom_u32() % COPY_EXPLORE_RATE)) {
+		method = prandom_u32() % NR_COPY_METHODS;
+		if (max_degree[method] >= 0) {
+			choice->method = method;
+			choice->degree = prandom_u32() % (max_degree[method] + 1);
+		}
+		return;
+	}
+
+	for (method = 0; method < NR_COPY_METHODS; ++method)
+		for (degree = 0; degree <= max_degree[method]; ++degree) {
+			unsigned int rate = copy_rate_estimate(model, class,
+						method, degree);
+
+			if (rate > best) {
+				best = rate;
+				choice->method = method;
+				choice->degree = degree;
+			}
+		}
+}
+
+static void copy_page_lists_serial(struct page **to, struct page **from,
+			int nr_pages)
+{
+	int i, j;
+
+	for (i = 0; i < nr_pages; ++i) {
+		int nr = migrate_nr_pages(from[i]);
+
+		for (j = 0; j < nr; ++j) {
+			cond_resched();
+			if (nr >= COPY_NOCACHE_MIN_PAGES)
+				copy_highpage_nocache(to[i] + j, from[i] + j);
+			else
+				copy_highpage(to[i] + j, from[i] + j);
+		}
+	}
+}
+
+static int copy_page_lists_method(struct page **to, struct page **from,
+			int nr_pages, const struct copy_choice *choice)
+{
+	switch (choice->method) {
+	case COPY_METHOD_MT:
+		return process_page_lists_mt(to, from, nr_pages,
+					1 << choice->degree, copy_page_routine);
+	case COPY_METHOD_DMA:
+		return copy_page_lists_dma_wait(to, from, nr_pages,
+					1 << choice->degree);
+	default:
+		copy_page_lists_serial(to, from, nr_pages);
+		return 0;
+	}
+}
+
+static void copy_method_calibrate_work(struct work_struct *work);
+static DECLARE_WORK(copy_calibrate_work, copy_method_calibrate_work);
+
+/*
+ * Copy a list of pages with the method expected to be the fastest, and
+ * learn from how long it took. Pages may be of different sizes, as long as
+ * each one matches its counterpart. Returns non-zero without copying
+ * anything when the selector is off or not calibrated yet, or for gigantic
+ * pages, which the caller copies the way it always did.
+ */
+int copy_page_lists_auto(struct page **to, struct page **from, int nr_pages)
+{
+	int max_degree[NR_COPY_METHODS];
+	struct copy_rate_model *model;
+	struct copy_choice choice;
+	unsigned long nr_base_pages = 0;
+	int class, i, rc;
+	u64 start;
+
+	if (!adaptive_page_copy || nr_pages <= 0)
+		return -EINVAL;
+
+	model = copy_rate_model_of(page_to_nid(to[0]), page_to_nid(from[0]));
+	if (!model)
+		return -ENODEV;
+
+	if (smp_load_acquire(&model->state) != COPY_MODEL_READY) {
+		if (cmpxchg(&model->state, COPY_MODEL_NEW,
+				COPY_MODEL_QUEUED) == COPY_MODEL_NEW)
+			queue_work(system_long_wq, &copy_calibrate_work);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < nr_pages; ++i) {
+		BUG_ON(migrate_nr_pages(from[i]) != migrate_nr_pages(to[i]));
+		if (migrate_nr_pages(from[i]) > MAX_ORDER_NR_PAGES)
+			return -EINVAL;
+		nr_base_pages += migrate_nr_pages(from[i]);
+	}
+	class = copy_size_class(nr_base_pages);
+
+	copy_degree_limits(page_to_nid(to[0]), nr_base_pages, max_degree);
+	copy_method_select(model, class, max_degree, &choice);
+
+	start = ktime_get_ns();
+	rc = copy_page_lists_method(to, from, nr_pages, &choice);
+	if (rc) {
+		/* the method is not available right now, do not learn that */
+		copy_page_lists_serial(to, from, nr_pages);
+		return 0;
+	}
+	copy_rate_update(model, class, &choice, nr_base_pages * PAGE_SIZE,
+			ktime_get_ns() - start);
+
+	return 0;
+}
+
+/* Best of a few runs, fed to the model as a first sample */
+static void copy_method_bench(struct copy_rate_model *model,
+			struct page **to, struct page **from, int nr_pages,
+			const struct copy_choice *choice)
+{
+	u64 best = U64_MAX;
+	int run;
+
+	for (run = 0; run < COPY_BENCH_RUNS; ++run) {
+		u64 start = ktime_get_ns();
+
+		if (copy_page_lists_method(to, from, nr_pages, choice))
+			return;
+		best = min(best, ktime_get_ns() - start);
+		cond_resched();
+	}
+
+	copy_rate_update(model, copy_size_class(nr_pages), choice,
+			(unsigned long)nr_pages * PAGE_SIZE, best);
+}
+
+/* The degrees measured up front: one, the most, and half as many */
+static bool copy_method_bench_degree(int degree, int max_degree)
+{
+	return !degree || degree == max_degree || degree == max_degree / 2;
+}
+
+/*
+ * Measure every method between two nodes, on a single base page and on a
+ * PMD sized list of them. The other size classes start from the closest
+ * of the two.
+ */
+static void copy_method_calibrate_pair(int dst_nid, int src_nid,
+			struct page **to, struct page **from)
+{
+	struct copy_rate_model *model = copy_rate_model_of(dst_nid, src_nid);
+	int nr_bench = 1 << COPY_BENCH_ORDER;
+	int sizes[] = { 1, nr_bench };
+	struct page *pd, *ps;
+	int i, s;
+
+	pd = alloc_pages_node(dst_nid, GFP_KERNEL | __GFP_THISNODE |
+				__GFP_NOWARN, COPY_BENCH_ORDER);
+	ps = alloc_pages_node(src_nid, GFP_KERNEL | __GFP_THISNODE |
+				__GFP_NOWARN, COPY_BENCH_ORDER);
+	if (!pd || !ps)
+		goto out;
+
+	for (i = 0; i < nr_bench; ++i) {
+		to[i] = pd + i;
+		from[i] = ps + i;
+	}
+
+	for (s = 0; s < ARRAY_SIZE(sizes); ++s) {
+		int max_degree[NR_COPY_METHODS];
+		struct copy_choice choice;
+
+		copy_degree_limits(dst_nid, sizes[s], max_degree);
+		for (choice.method = 0; choice.method < NR_COPY_METHODS;
+			 ++choice.method)
+			for (choice.degree = 0;
+				 choice.degree <= max_degree[choice.method];
+				 ++choice.degree)
+				if (copy_method_bench_degree(choice.degree,
+						max_degree[choice.method]))
+					copy_method_bench(model, to, from,
+							sizes[s], &choice);
+	}
+
+	for (i = 0; i < NR_COPY_METHODS; ++i)
+		pr_info("   node %d <- %d %-6s: %5u MB/sec (4K) %5u MB/sec (huge)\n",
+			dst_nid, src_nid, copy_method_names[i],
+			model->rate[0][i][0],
+			model->rate[COPY_BENCH_ORDER][i][0]);
+
+out:
+	if (pd)
+		__free_pages(pd, COPY_BENCH_ORDER);
+	if (ps)
+		__free_pages(ps, COPY_BENCH_ORDER);
+}
+
+/* Measure the node pairs copy_page_lists_auto() has queued */
+static void copy_method_calibrate_work(struct work_struct *work)
+{
+	struct page **to, **from;
+	int dst_nid, src_nid;
+	int state = COPY_MODEL_READY;
+
+	to = kcalloc(1 << COPY_BENCH_ORDER, sizeof(struct page *), GFP_KERNEL);
+	from = kcalloc(1 << COPY_BENCH_ORDER, sizeof(struct page *), GFP_KERNEL);
+	/* let the next copy queue them again */
+	if (!to || !from)
+		state = COPY_MODEL_NEW;
+
+	for_each_node_state(dst_nid, N_MEMORY)
+		for_each_node_state(src_nid, N_MEMORY) {
+			struct copy_rate_model *model;
+
+			model = copy_rate_model_of(dst_nid, src_nid);
+			if (READ_ONCE(model->state) != COPY_MODEL_QUEUED)
+				continue;
+
+			if (state == COPY_MODEL_READY) {
+				pr_info("copy: measuring page copy methods, node %d <- %d\n",
+					dst_nid, src_nid);
+				copy_method_calibrate_pair(dst_nid, src_nid,
+							to, from);
+			}
+			smp_store_release(&model->state, state);
+		}
+
+	kfree(to);
+	kfree(from);
+}
+
+static int __init copy_method_models_init(void)
+{
+	copy_rate_models = kcalloc(nr_node_ids * nr_node_ids,
+				sizeof(struct copy_rate_model), GFP_KERNEL);
+	if (!copy_rate_models)
+		pr_warn("copy: cannot allocate the copy method models\n");
+	return 0;
+}
+late_initcall(copy_method_models_init);
+
+/* ======================== exchange page kernels ======================== */
+
+/*
+ * Kernels swapping the contents of two ranges of page data. The one used
+ * by exchange_page_data() is picked by measuring them, once for 4K pages
+ * and once for whole huge pages, like the RAID xor templates: the
+ * best one depends on the CPU (fast string instructions, number of loads
+ * in flight) more than on anything we could test for. No SIMD kernel is
+ * offered, it would need the FPU state saved around the whole exchange.
+ * The measurement runs from a work item queued by the first exchange,
+ * not at boot.
+ *
+ * @len is a multiple of 64 for all of them.
+ */
+struct exchange_page_kernel {
+	const char *name;
+	void (*exchange)(char *to, char *from, unsigned long len);
+	unsigned long speed_small;	/* MB/s on 4K pages */
+	unsigned long speed_large;	/* MB/s on huge pages */
+};
+
+/* The original loop, one u64 at a time  */
+static void exchange_page_u64(char *to, char *from, unsigned long len)
+{
+	u64 tmp;
 	int i;
-	struct copy_page_info *work_items;
-	int nr_pages_per_page = hpage_nr_pages(*from);
-	const struct cpumask *per_node_cpumask = cpumask_of_node(to_node);
-	int cpu_id_list[32] = {0};
-	int cpu;
 
-	if (!use_mt_copy)
-		return -1;
+	for (i = 0; i < len; i += sizeof(tmp)) {
+		tmp = *((u64*)(from + i));
+		*((u64*)(from + i)) = *((u64*)(to + i));
+		*((u64*)(to + i)) = tmp;
+	}
+}
+
+/* Four u64 from each side in flight before anything is stored  */
+static void exchange_page_unrolled(char *to, char *from, unsigned long len)
+{
+	u64 *t = (u64 *)to, *f = (u64 *)from;
+	unsigned long i;
+
+	for (i = 0; i < len / sizeof(u64); i += 4) {
+		u64 t0 = t[i], t1 = t[i + 1], t2 = t[i + 2], t3 = t[i + 3];
+		u64 f0 = f[i], f1 = f[i + 1], f2 = f[i + 2], f3 = f[i + 3];
+
+		t[i] = f0;
+		t[i + 1] = f1;
+		t[i + 2] = f2;
+		t[i + 3] = f3;
+		f[i] = t0;
+		f[i + 1] = t1;
+		f[i + 2] = t2;
+		f[i + 3] = t3;
+	}
+}
+
+#define EXCHANGE_SCRATCH_SIZE	PAGE_SIZE
+
+static DEFINE_PER_CPU_PAGE_ALIGNED(char, exchange_scratch[EXCHANGE_SCRATCH_SIZE]);
+
+/*
+ * Three memcpy() through a per-cpu scratch buffer, which stays in the
+ * cache, so the streams to memory use the arch optimized memcpy().
+ */
+static void exchange_page_3copy(char *to, char *from, unsigned long len)
+{
+	unsigned long off;
+
+	for (off = 0; off < len; off += EXCHANGE_SCRATCH_SIZE) {
+		unsigned long n = min_t(unsigned long, len - off,
+					EXCHANGE_SCRATCH_SIZE);
+		char *tmp = get_cpu_var(exchange_scratch);
+
+		memcpy(tmp, from + off, n);
+		memcpy(from + off, to + off, n);
+		memcpy(to + off, tmp, n);
+
+		put_cpu_var(exchange_scratch);
+	}
+}
+
+static struct exchange_page_kernel exchange_page_kernels[] = {
+	{ .name = "u64", .exchange = exchange_page_u64 },
+	{ .name = "unrolled", .exchange = exchange_page_unrolled },
+	{ .name = "3copy", .exchange = exchange_page_3copy },
+};
+
+/* Until calibrated, use the original loop  */
+static struct exchange_page_kernel *exchange_kernel_small = &exchange_page_kernels[0];
+static struct exchange_page_kernel *exchange_kernel_large = &exchange_page_kernels[0];
+
+static void exchange_page_calibrate(struct work_struct *work);
+static DECLARE_WORK(exchange_calibrate_work, exchange_page_calibrate);
+static atomic_t exchange_calibrate_queued = ATOMIC_INIT(0);
+
+void exchange_page_data(char *to, char *from, unsigned long len)
+{
+	/* may be called in atomic context, queue_work() is fine there */
+	if (unlikely(!atomic_read(&exchange_calibrate_queued)) &&
+		!atomic_xchg(&exchange_calibrate_queued, 1))
+		queue_work(system_long_wq, &exchange_calibrate_work);
+
+	if (len > PAGE_SIZE)
+		READ_ONCE(exchange_kernel_large)->exchange(to, from, len);
+	else
+		READ_ONCE(exchange_kernel_small)->exchange(to, from, len);
+}
+
+#define EXCHANGE_BENCH_ORDER	min(9, MAX_ORDER - 1)
+#define EXCHANGE_BENCH_RUNS	3
+#define EXCHANGE_BENCH_PASSES	2
+
+/*
+ * Best MB/s over a few runs of swapping the two buffers @len bytes at a
+ * time, which also shows what the optimized kernels gain over the u64 loop.
+ */
+static unsigned long exchange_page_speed(struct exchange_page_kernel *k,
+			char *a, char *b, unsigned long len)
+{
+	unsigned long size = PAGE_SIZE << EXCHANGE_BENCH_ORDER;
+	u64 best = U64_MAX;
+	int run, pass;
+
+	for (run = 0; run < EXCHANGE_BENCH_RUNS; ++run) {
+		u64 start = ktime_get_ns();
+		unsigned long off;
+
+		for (pass = 0; pass < EXCHANGE_BENCH_PASSES; ++pass)
+			for (off = 0; off < size; off += len)
+				k->exchange(a + off, b + off, len);
+
+		best = min(best, ktime_get_ns() - start);
+		cond_resched();
+	}
+
+	if (!best)
+		best = 1;
+	return div64_u64((u64)size * EXCHANGE_BENCH_PASSES * NSEC_PER_SEC,
+			best << 20);
+}
+
+static void exchange_page_calibrate(struct work_struct *work)
+{
+	struct exchange_page_kernel *small = exchange_kernel_small;
+	struct exchange_page_kernel *large = exchange_kernel_large;
+	struct page *pa, *pb;
+	char *a, *b;
+	int i;
+
+	pa = alloc_pages(GFP_KERNEL, EXCHANGE_BENCH_ORDER);
+	pb = alloc_pages(GFP_KERNEL, EXCHANGE_BENCH_ORDER);
+	if (!pa || !pb) {
+		pr_warn("exchange: cannot allocate benchmark buffers, using %s\n",
+			exchange_kernel_small->name);
+		goto out;
+	}
+	a = page_address(pa);
+	b = page_address(pb);
+	memset(a, 0x5a, PAGE_SIZE << EXCHANGE_BENCH_ORDER);
+	memset(b, 0xa5, PAGE_SIZE << EXCHANGE_BENCH_ORDER);
+
+	pr_info("exchange: measuring software exchange speed\n");
+	for (i = 0; i < ARRAY_SIZE(exchange_page_kernels); ++i) {
+		struct exchange_page_kernel *k = &exchange_page_kernels[i];
+
+		k->speed_small = exchange_page_speed(k, a, b, PAGE_SIZE);
+		k->speed_large = exchange_page_speed(k, a, b,
+					PAGE_SIZE << EXCHANGE_BENCH_ORDER);
+		pr_info("   %-10s: %5lu MB/sec (4K) %5lu MB/sec (huge)\n",
+			k->name, k->speed_small, k->speed_large);
+
+		if (k->speed_small > small->speed_small)
+			small = k;
+		if (k->speed_large > large->speed_large)
+			large = k;
+	}
+	WRITE_ONCE(exchange_kernel_small, small);
+	WRITE_ONCE(exchange_kernel_large, large);
+	pr_info("exchange: using %s for 4K pages, %s for huge pages\n",
+		small->name, large->name);
+
+out:
+	if (pa)
+		__free_pages(pa, EXCHANGE_BENCH_ORDER);
+	if (pb)
+		__free_pages(pb, EXCHANGE_BENCH_ORDER);
+}
+
+/* ====================== multi-threaded exchange page ====================== */
+static void exchange_page_routine(char *to, char *from, unsigned long chunk_size)
+{
+	exchange_page_data(to, from, chunk_size);
+}
+
+int exchange_page_mt(struct page *to, struct page *from, int nr_pages)
+{
+	BUG_ON(migrate_nr_pages(from) != nr_pages);
+
+	return process_page_lists_mt(&to, &from, 1, limit_mt_num,
+				exchange_page_routine);
+}
+
+int exchange_page_lists_mt(struct page **to, struct page **from, int nr_pages)
+{
+	return process_page_lists_mt(to, from, nr_pages, limit_mt_num,
+				exchange_page_routine);
+}
+
+/* ======================== DMA exchange page ======================== */
+
+/*
+ * Asynchronous DMA exchange of a list of page pairs.
+ *
+ * A DMA engine cannot swap two buffers, so each pair goes through a
+ * bounce buffer owned by its channel with three chained transfers:
+ * from -> scratch, to -> from, scratch -> to. Each transfer is fenced on
+ * the previous one, which also keeps the next pair on the channel from
+ * overwriting the scratch buffer before it is drained. Pairs are spread
+ * round-robin over the channels, so up to one pair per channel is in
+ * flight at a time, and only the last transfer on each channel raises an
+ * interrupt.
+ *
+ * Each transfer is submitted as soon as it is prepared, so no descriptor
+ * is ever left prepared but not submitted. Pairs that could not be handed
+ * over are exchanged by the CPU before returning.
+ *
+ * Unlike a copy, an exchange cannot be redone, and the callers cannot
+ * tell which pairs the engines got through. So when a transfer fails or
+ * a chain is cut short, every pair is put back the way it was, see
+ * exchange_page_lists_dma_undo(), and the whole list fails.
+ */
+struct dma_exchange_ctx;
+
+struct dma_exchange_chan_ctx {
+	struct dma_exchange_ctx *ctx;
+	struct dma_chan *chan;
+	dma_cookie_t cookie;
+
+	struct page *scratch;
+	int scratch_order;
+	struct dmaengine_unmap_data *scratch_unmap;
+
+	/* first pair of this channel not handed to the engine */
+	int next;
+};
+
+struct dma_exchange_ctx {
+	/* armed channels plus one reference held by the submitter */
+	atomic_t pending;
+	int err;
+
+	dma_copy_done_t done;
+	void *arg;
+
+	struct page **to;
+	struct page **from;
+	int nr_pages;
+	int nr_chans;
+	struct dmaengine_unmap_data **unmap;
+	/* three per pair, 0 for the transfers not submitted */
+	dma_cookie_t *cookies;
+	struct dma_chan_set chan_set;
+	struct dma_exchange_chan_ctx chans[NUM_AVAIL_DMA_CHAN];
+
+	/* undoes the pairs after a failure, see exchange_page_lists_dma_undo() */
+	struct work_struct work;
+};
+
+static void exchange_page_cpu(struct page *to, struct page *from)
+{
+	int nr_pages = migrate_nr_pages(from);
+	int i;
+
+	for (i = 0; i < nr_pages; i++) {
+		char *vfrom, *vto;
+
+		cond_resched();
+		vfrom = kmap_atomic(mem_map_offset(from, i));
+		vto = kmap_atomic(mem_map_offset(to, i));
+		exchange_page_data(vto, vfrom, PAGE_SIZE);
+		kunmap_atomic(vto);
+		kunmap_atomic(vfrom);
+	}
+}
 
-	work_items = kzalloc(sizeof(struct copy_page_info)*nr_pages, 
-						 GFP_KERNEL);
-	if (!work_items)
+static void exchange_page_copy_cpu(struct page *to, struct page *from,
+			int nr_pages)
+{
+	int i;
+
+	for (i = 0; i < nr_pages; i++) {
+		cond_resched();
+		copy_highpage(mem_map_offset(to, i), mem_map_offset(from, i));
+	}
+}
+
+static bool exchange_page_dma_done(struct dma_chan *chan, dma_cookie_t cookie)
+{
+	return cookie && dma_async_is_tx_complete(chan, cookie,
+				NULL, NULL) == DMA_COMPLETE;
+}
+
+/*
+ * Put every pair back the way it was, after the transfers are unmapped.
+ * A channel does not run past a failed transfer, so the chain of a pair
+ * stops at its first unfinished transfer, and the scratch buffer of the
+ * channel still holds the from page of that pair:
+ * - nothing handed to the engine, or the whole chain done: the pair is
+ *   exchanged, and is exchanged back.
+ * - to -> from done: from holds to, which goes back, and from comes back
+ *   from the scratch buffer.
+ * - from -> scratch done: from may be partly overwritten, and comes back
+ *   from the scratch buffer.
+ * - nothing done: the pair is untouched.
+ */
+static void exchange_page_lists_dma_undo(struct dma_exchange_ctx *ctx)
+{
+	int page_idx;
+
+	for (page_idx = 0; page_idx < ctx->nr_pages; page_idx++) {
+		struct dma_exchange_chan_ctx *chan_ctx =
+				&ctx->chans[page_idx % ctx->nr_chans];
+		dma_cookie_t *cookie = &ctx->cookies[3 * page_idx];
+		struct page *to = ctx->to[page_idx];
+		struct page *from = ctx->from[page_idx];
+		int nr_pages = migrate_nr_pages(from);
+
+		if (!cookie[0] || exchange_page_dma_done(chan_ctx->chan, cookie[2])) {
+			exchange_page_cpu(to, from);
+		} else if (exchange_page_dma_done(chan_ctx->chan, cookie[1])) {
+			exchange_page_copy_cpu(to, from, nr_pages);
+			exchange_page_copy_cpu(from, chan_ctx->scratch, nr_pages);
+		} else if (exchange_page_dma_done(chan_ctx->chan, cookie[0])) {
+			exchange_page_copy_cpu(from, chan_ctx->scratch, nr_pages);
+		}
+	}
+}
+
+static void exchange_page_lists_dma_release(struct dma_exchange_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->nr_pages; ++i)
+		dmaengine_unmap_put(ctx->unmap[i]);
+
+	for (i = 0; i < ctx->nr_chans; ++i)
+		dmaengine_unmap_put(ctx->chans[i].scratch_unmap);
+
+	if (ctx->err)
+		exchange_page_lists_dma_undo(ctx);
+
+	for (i = 0; i < ctx->nr_chans; ++i) {
+		struct dma_exchange_chan_ctx *chan_ctx = &ctx->chans[i];
+
+		if (chan_ctx->scratch)
+			__free_pages(chan_ctx->scratch, chan_ctx->scratch_order);
+	}
+
+	ctx->done(ctx->arg, ctx->err);
+
+	dma_chan_set_put(&ctx->chan_set);
+	kfree(ctx->cookies);
+	kfree(ctx->unmap);
+	kfree(ctx);
+}
+
+static void exchange_page_lists_dma_undo_work(struct work_struct *work)
+{
+	exchange_page_lists_dma_release(container_of(work,
+				struct dma_exchange_ctx, work));
+}
+
+/* The undo copies whole pages, so it does not run from a DMA callback */
+static void exchange_page_lists_dma_finish(struct dma_exchange_ctx *ctx)
+{
+	if (ctx->err) {
+		INIT_WORK(&ctx->work, exchange_page_lists_dma_undo_work);
+		schedule_work(&ctx->work);
+		return;
+	}
+
+	exchange_page_lists_dma_release(ctx);
+}
+
+static void exchange_page_lists_dma_chan_done(void *param)
+{
+	struct dma_exchange_chan_ctx *chan_ctx = param;
+	struct dma_exchange_ctx *ctx = chan_ctx->ctx;
+
+	if (dma_async_is_tx_complete(chan_ctx->chan, chan_ctx->cookie,
+				NULL, NULL) != DMA_COMPLETE)
+		WRITE_ONCE(ctx->err, -EIO);
+
+	if (atomic_dec_and_test(&ctx->pending))
+		exchange_page_lists_dma_finish(ctx);
+}
+
+/* Map the bounce buffer of a channel, big enough for all its pairs */
+static int exchange_page_dma_scratch(struct dma_exchange_chan_ctx *chan_ctx,
+			struct page **from, int nr_pages, int stride)
+{
+	struct device *dev = chan_ctx->chan->device->dev;
+	struct dmaengine_unmap_data *unmap;
+	int order = 0;
+	int page_idx;
+
+	for (page_idx = chan_ctx->next; page_idx < nr_pages; page_idx += stride)
+		order = max_t(int, order, compound_order(from[page_idx]));
+
+	if (order >= MAX_ORDER)
+		return -EINVAL;
+
+	chan_ctx->scratch = alloc_pages_node(dev_to_node(dev),
+				GFP_KERNEL | __GFP_NOWARN, order);
+	if (!chan_ctx->scratch)
 		return -ENOMEM;
+	chan_ctx->scratch_order = order;
 
-	total_mt_num = min_t(int, nr_pages, total_mt_num);
+	unmap = dmaengine_get_unmap_data(dev, 1, GFP_NOWAIT);
+	if (!unmap)
+		return -ENOMEM;
+	chan_ctx->scratch_unmap = unmap;
 
-	i = 0;
-	for_each_cpu(cpu, per_node_cpumask) {
-		if (i >= total_mt_num)
-			break;
-		cpu_id_list[i] = cpu;
-		++i;
+	unmap->len = PAGE_SIZE << order;
+	unmap->addr[0] = dma_map_page(dev, chan_ctx->scratch, 0,
+				unmap->len, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, unmap->addr[0]))
+		return -ENOMEM;
+	unmap->bidi_cnt = 1;
+
+	return 0;
+}
+
+/* Map both pages of a pair, which are read and written */
+static int exchange_page_dma_map(struct device *dev,
+			struct dmaengine_unmap_data *unmap, struct page *to,
+			struct page *from, size_t len)
+{
+	unmap->len = len;
+	unmap->addr[0] = dma_map_page(dev, from, 0, len, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, unmap->addr[0]))
+		return -ENOMEM;
+	unmap->bidi_cnt = 1;
+
+	unmap->addr[1] = dma_map_page(dev, to, 0, len, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, unmap->addr[1]))
+		return -ENOMEM;
+	unmap->bidi_cnt = 2;
+
+	return 0;
+}
+
+/*
+ * Returns 0 if done() has been or will be called, with the result of the
+ * DMA transfers. On a negative result, every pair has been put back the
+ * way it was before done() is called. On a negative return no page was
+ * touched and done() is not called. to and from must stay valid until
+ * done() is called.
+ */
+int exchange_page_lists_dma_async(struct page **to, struct page **from,
+			int nr_pages, dma_copy_done_t done, void *arg)
+{
+	struct dma_exchange_ctx *ctx;
+	int total_available_chans;
+	int i;
+
+	if (nr_pages <= 0)
+		return -EINVAL;
+
+	ctx = kzalloc(sizeof(struct dma_exchange_ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->unmap = kcalloc(nr_pages, sizeof(struct dmaengine_unmap_data *),
+				GFP_KERNEL);
+	ctx->cookies = kcalloc(3 * nr_pages, sizeof(dma_cookie_t), GFP_KERNEL);
+	if (!ctx->unmap || !ctx->cookies) {
+		kfree(ctx->cookies);
+		kfree(ctx->unmap);
+		kfree(ctx);
+		return -ENOMEM;
 	}
 
-	for (i = 0; i < nr_pages; ++i) {
-		int thread_idx = i % total_mt_num;
+	total_available_chans = dma_chan_set_get(page_to_nid(to[0]),
+				page_to_nid(from[0]), nr_pages, &ctx->chan_set);
+	if (!total_available_chans) {
+		kfree(ctx->cookies);
+		kfree(ctx->unmap);
+		kfree(ctx);
+		return -ENODEV;
+	}
 
-		INIT_WORK((struct work_struct *)&work_items[i], exchange_page_work_queue_thread);
+	atomic_set(&ctx->pending, 1);
+	ctx->done = done;
+	ctx->arg = arg;
+	ctx->to = to;
+	ctx->from = from;
+	ctx->nr_pages = nr_pages;
+	ctx->nr_chans = total_available_chans;
 
-		/* XXX: assume no highmem  */
-		work_items[i].to = kmap_atomic(to[i]);
-		work_items[i].from = kmap_atomic(from[i]);
-		work_items[i].chunk_size = PAGE_SIZE * hpage_nr_pages(from[i]);
+	for (i = 0; i < total_available_chans; ++i) {
+		struct dma_exchange_chan_ctx *chan_ctx = &ctx->chans[i];
+		struct dma_chan *chan = ctx->chan_set.chans[i];
+		struct device *dev = chan->device->dev;
+		bool submitted = false, armed = false;
+
+		chan_ctx->ctx = ctx;
+		chan_ctx->chan = chan;
+		chan_ctx->next = i;
+
+		if (exchange_page_dma_scratch(chan_ctx, from, nr_pages,
+					total_available_chans)) {
+			pr_err("%s: no scratch buffer at chan %d\n", __func__, i);
+			continue;
+		}
+
+		for (; chan_ctx->next < nr_pages;
+			 chan_ctx->next += total_available_chans) {
+			int page_idx = chan_ctx->next;
+			size_t page_len = PAGE_SIZE * migrate_nr_pages(from[page_idx]);
+			bool last = page_idx + total_available_chans >= nr_pages;
+			dma_addr_t scratch = chan_ctx->scratch_unmap->addr[0];
+			struct dmaengine_unmap_data *unmap;
+			dma_addr_t dst[3], src[3];
+			int j;
+
+			BUG_ON(page_len != migrate_nr_pages(to[page_idx]) * PAGE_SIZE);
+
+			unmap = dmaengine_get_unmap_data(dev, 2, GFP_NOWAIT);
+			if (!unmap) {
+				pr_err("%s: no unmap data at chan %d\n", __func__, i);
+				break;
+			}
+			ctx->unmap[page_idx] = unmap;
 
-		BUG_ON(nr_pages_per_page != hpage_nr_pages(from[i]));
-		BUG_ON(nr_pages_per_page != hpage_nr_pages(to[i]));
+			if (exchange_page_dma_map(dev, unmap, to[page_idx],
+						from[page_idx], page_len)) {
+				pr_err("%s: dma mapping error at chan %d\n", __func__, i);
+				break;
+			}
 
+			/* from -> scratch, to -> from, scratch -> to */
+			src[0] = unmap->addr[0];
+			dst[0] = scratch;
+			src[1] = unmap->addr[1];
+			dst[1] = unmap->addr[0];
+			src[2] = scratch;
+			dst[2] = unmap->addr[1];
+
+			for (j = 0; j < 3; j++) {
+				bool arm = last && j == 2;
+				struct dma_async_tx_descriptor *tx;
+				dma_cookie_t cookie;
+
+				tx = chan->device->device_prep_dma_memcpy(chan,
+						dst[j], src[j], page_len,
+						DMA_PREP_FENCE |
+						(arm ? DMA_PREP_INTERRUPT : 0));
+				if (!tx) {
+					pr_err("%s: no tx descriptor at chan %d\n",
+						__func__, i);
+					break;
+				}
 
-		queue_work_on(cpu_id_list[thread_idx], system_highpri_wq, (struct work_struct *)&work_items[i]);
+				if (arm) {
+					tx->callback = exchange_page_lists_dma_chan_done;
+					tx->callback_param = chan_ctx;
+					atomic_inc(&ctx->pending);
+				}
+
+				cookie = tx->tx_submit(tx);
+				if (dma_submit_error(cookie)) {
+					pr_err("%s: submission error at chan %d\n",
+						__func__, i);
+					if (arm)
+						atomic_dec(&ctx->pending);
+					break;
+				}
+				ctx->cookies[3 * page_idx + j] = cookie;
+				chan_ctx->cookie = cookie;
+				submitted = true;
+			}
+			if (j < 3) {
+				/* a chain cut short is undone once it stops */
+				if (j) {
+					chan_ctx->next += total_available_chans;
+					WRITE_ONCE(ctx->err, -EIO);
+				}
+				break;
+			}
+			armed = last;
+		}
+
+		if (submitted)
+			dma_async_issue_pending(chan);
+
+		/*
+		 * Without an armed callback nobody tells us when the transfers
+		 * already queued on this channel are done, so wait for them
+		 * before the unmap data and scratch buffer can be released.
+		 */
+		if (submitted && !armed &&
+			dma_sync_wait(chan, chan_ctx->cookie) != DMA_COMPLETE)
+			WRITE_ONCE(ctx->err, -EIO);
 	}
 
-	/* Wait until it finishes  */
-	flush_workqueue(system_highpri_wq);
+	/* what the engines did not take, the CPU exchanges */
+	for (i = 0; i < total_available_chans; ++i) {
+		int page_idx;
 
-	for (i = 0; i < nr_pages; ++i) {
-			kunmap_atomic(work_items[i].to);
-			kunmap_atomic(work_items[i].from);
+		for (page_idx = ctx->chans[i].next; page_idx < nr_pages;
+			 page_idx += total_available_chans)
+			exchange_page_cpu(to[page_idx], from[page_idx]);
 	}
 
-	kfree(work_items);
+	if (atomic_dec_and_test(&ctx->pending))
+		exchange_page_lists_dma_finish(ctx);
 
-	return err;
-}
\ No newline at end of file
+	return 0;
+}
+
+/*
+ * Use DMA to exchange a list of page pairs, sleeping until the engines are
+ * done. On a negative return no page is changed: either the engines could
+ * not be used, or a transfer failed with -EIO and every pair was put back.
+ */
+int exchange_page_lists_dma(struct page **to, struct page **from, int nr_pages)
+{
+	struct dma_copy_waiter waiter;
+	int ret_val;
+
+	init_completion(&waiter.done);
+
+	ret_val = exchange_page_lists_dma_async(to, from, nr_pages,
+				copy_page_lists_dma_wake, &waiter);
+	if (ret_val)
+		return ret_val;
+
+	wait_for_completion(&waiter.done);
+
+	if (waiter.err)
+		pr_err("%s: dma does not complete properly\n", __func__);
+
+	return waiter.err;
+}
@@ -10,6 +10,7 @@
 #include <linux/security.h>
 #include <linux/cpuset.h>
 #include <linux/hugetlb.h>
+#include <linux/hugetlb_cgroup.h>
 #include <linux/mm_inline.h>
 #include <linux/page_idle.h>
 #include <linux/page-flags.h>
@@ -26,20 +27,16 @@
  */
 struct pages_to_node {
 	unsigned long from_addr;
+	struct page *from_page;
 	int from_status;
 
 	unsigned long to_addr;
-	int to_status;
-};
-
-struct exchange_page_info {
-	struct page *from_page;
 	struct page *to_page;
+	int to_status;
 
-	struct anon_vma *from_anon_vma;
-	struct anon_vma *to_anon_vma;
-
-	struct list_head list;
+	/* a THP against a page table of base pages, see exchange_huge_pmd_ptes() */
+	bool exchange_pmd;
+	bool from_thp;
 };
 
 struct page_flags {
@@ -60,25 +57,13 @@ struct page_flags {
 };
 
 
-static void exchange_page(char *to, char *from)
-{
-	u64 tmp;
-	int i;
-
-	for (i = 0; i < PAGE_SIZE; i += sizeof(tmp)) {
-		tmp = *((u64*)(from + i));
-		*((u64*)(from + i)) = *((u64*)(to + i));
-		*((u64*)(to + i)) = tmp;
-	}
-}
-
 static inline void exchange_highpage(struct page *to, struct page *from)
 {
 	char *vfrom, *vto;
 
 	vfrom = kmap_atomic(from);
 	vto = kmap_atomic(to);
-	exchange_page(vto, vfrom);
+	exchange_page_data(vto, vfrom, PAGE_SIZE);
 	kunmap_atomic(vto);
 	kunmap_atomic(vfrom);
 }
@@ -120,6 +105,12 @@ static void exchange_huge_page(struct page *dst, struct page *src)
 		nr_pages = hpage_nr_pages(src);
 	}
 
+	if (!PageHighMem(dst) && !PageHighMem(src)) {
+		exchange_page_data(page_address(dst), page_address(src),
+					nr_pages * PAGE_SIZE);
+		return;
+	}
+
 	for (i = 0; i < nr_pages; i++) {
 		cond_resched();
 		exchange_highpage(dst + i, src + i);
@@ -240,17 +231,8 @@ static void exchange_page_flags(struct page *to_page, struct page *from_page)
 	page_cpupid_xchg_last(to_page, from_cpupid);
 	page_cpupid_xchg_last(from_page, to_cpupid);
 
+	/* PageSwapCache() went with the swap cache slots already */
 	ksm_exchange_page(to_page, from_page);
-	/*
-	 * Please do not reorder this without considering how mm/ksm.c's
-	 * get_ksm_page() depends upon ksm_migrate_page() and PageSwapCache().
-	 */
-	ClearPageSwapCache(to_page);
-	ClearPageSwapCache(from_page);
-	if (from_page_flags.page_swapcache)
-		SetPageSwapCache(to_page);
-	if (to_page_flags.page_swapcache)
-		SetPageSwapCache(from_page);
 
 
 #ifdef CONFIG_PAGE_OWNER
@@ -261,17 +243,123 @@ static void exchange_page_flags(struct page *to_page, struct page *from_page)
 	to_page->mem_cgroup = from_memcg;
 	from_page->mem_cgroup = to_memcg;
 
+	/* exchange hugetlb cgroup  */
+	if (PageHuge(to_page))
+		hugetlb_cgroup_exchange(to_page, from_page);
+
 }
 
 /*
- * Replace the page in the mapping.
+ * Page cache and swap cache pages can be exchanged when their mapping
+ * migrates them the generic way: the page cache slot, index and mapping
+ * are all there is to move besides the data.
+ */
+bool page_exchangeable(struct page *page)
+{
+	struct address_space *mapping = page_mapping(page);
+
+	if (!mapping)
+		return true;
+	if (mapping->a_ops->migratepage == migrate_page)
+		return true;
+#ifdef CONFIG_BLOCK
+	if (mapping->a_ops->migratepage == buffer_migrate_page)
+		return true;
+#endif
+	return false;
+}
+
+/*
+ * Buffers and other fs-private data are not exchanged along with the
+ * page: they have to go first. Called with the page locked.
+ */
+static int exchange_page_drop_private(struct page *page)
+{
+	if (!page->mapping || PageAnon(page) || !page_has_private(page))
+		return 0;
+
+	return try_to_release_page(page, GFP_KERNEL) ? 0 : -EBUSY;
+}
+
+/* Take the tree_locks of both mappings, in address order */
+static void exchange_lock_mappings(struct address_space *m1,
+			struct address_space *m2)
+{
+	if (m1 == m2 || !m1) {
+		m1 = m2;
+		m2 = NULL;
+	} else if (m2 && m1 > m2)
+		swap(m1, m2);
+
+	spin_lock_irq(&m1->tree_lock);
+	if (m2)
+		spin_lock_nested(&m2->tree_lock, SINGLE_DEPTH_NESTING);
+}
+
+/* Leaves irqs disabled, for the zone counters */
+static void exchange_unlock_mappings(struct address_space *m1,
+			struct address_space *m2)
+{
+	if (m2 && m2 != m1)
+		spin_unlock(&m2->tree_lock);
+	if (m1)
+		spin_unlock(&m1->tree_lock);
+}
+
+/* Freeze the refcount of a page found at its slot in mapping */
+static void **exchange_page_freeze(struct address_space *mapping,
+			struct page *page, int expected_count)
+{
+	void **pslot;
+
+	pslot = radix_tree_lookup_slot(&mapping->page_tree, page_index(page));
+
+	if (!pslot || page_count(page) != expected_count ||
+		radix_tree_deref_slot_protected(pslot,
+					&mapping->tree_lock) != page)
+		return NULL;
+
+	if (!page_ref_freeze(page, expected_count))
+		return NULL;
+
+	return pslot;
+}
+
+/*
+ * The cache entry of mapping held by page goes from oldzone to newzone,
+ * see migrate_page_move_mapping(). Called with irqs disabled, before the
+ * flags of the pages are exchanged.
+ */
+static void exchange_mapping_stats(struct address_space *mapping,
+			struct page *page, struct zone *oldzone,
+			struct zone *newzone)
+{
+	if (!mapping || oldzone == newzone)
+		return;
+
+	__dec_zone_state(oldzone, NR_FILE_PAGES);
+	__inc_zone_state(newzone, NR_FILE_PAGES);
+	if (PageSwapBacked(page) && !PageSwapCache(page)) {
+		__dec_zone_state(oldzone, NR_SHMEM);
+		__inc_zone_state(newzone, NR_SHMEM);
+	}
+	if (PageDirty(page) && mapping_cap_account_dirty(mapping)) {
+		__dec_zone_state(oldzone, NR_FILE_DIRTY);
+		__inc_zone_state(newzone, NR_FILE_DIRTY);
+	}
+}
+
+/*
+ * Exchange the pages in their mappings: index, mapping and, for pages in
+ * the page cache or swap cache, the radix tree slots. Both slots are
+ * replaced under the tree_locks, with both refcounts frozen, so a lookup
+ * sees either page in its old place or the other one in its new place.
  *
  * The number of remaining references must be:
  * 1 for anonymous pages without a mapping
  * 2 for pages with a mapping
- * 3 for pages with a mapping and PagePrivate/PagePrivate2 set.
+ * Pages with PagePrivate set are not exchanged.
  */
-
 static int exchange_page_move_mapping(struct address_space *to_mapping,
 			struct address_space *from_mapping, 
 			struct page *to_page, struct page *from_page,
@@ -279,10 +367,14 @@ static int exchange_page_move_mapping(struct address_space *to_mapping,
 			int to_extra_count, int from_extra_count)
 {
 	int to_expected_count = 1 + to_extra_count, from_expected_count = 1 + from_extra_count;
-	unsigned long from_page_index = page_index(from_page), to_page_index = page_index(to_page);
+	unsigned long from_page_index = from_page->index, to_page_index = to_page->index;
 	int to_swapbacked = PageSwapBacked(to_page), from_swapbacked = PageSwapBacked(from_page);
+	int to_swapcache = PageSwapCache(to_page), from_swapcache = PageSwapCache(from_page);
+	unsigned long to_private = page_private(to_page),
+				  from_private = page_private(from_page);
 	struct address_space *to_mapping_value = to_page->mapping,
 						 *from_mapping_value = from_page->mapping;
+	void **to_pslot = NULL, **from_pslot = NULL;
 
 
 	if (!to_mapping) {
@@ -299,6 +391,34 @@ static int exchange_page_move_mapping(struct address_space *to_mapping,
 		}
 	}
 
+	if (page_has_private(to_page) || page_has_private(from_page))
+		return -EBUSY;
+
+	if (to_mapping || from_mapping) {
+		exchange_lock_mappings(to_mapping, from_mapping);
+
+		if (to_mapping) {
+			to_expected_count++;
+			to_pslot = exchange_page_freeze(to_mapping, to_page,
+						to_expected_count);
+			if (!to_pslot)
+				goto out_unlock;
+		}
+
+		if (from_mapping) {
+			from_expected_count++;
+			from_pslot = exchange_page_freeze(from_mapping,
+						from_page, from_expected_count);
+			if (!from_pslot)
+				goto out_unfreeze;
+		}
+
+		exchange_mapping_stats(to_mapping, to_page,
+				page_zone(to_page), page_zone(from_page));
+		exchange_mapping_stats(from_mapping, from_page,
+				page_zone(from_page), page_zone(to_page));
+	}
+
 	/*
 	 * Now we know that no one else is looking at the page:
 	 * no turning back from here.
@@ -311,6 +431,11 @@ static int exchange_page_move_mapping(struct address_space *to_mapping,
 	if (to_swapbacked)
 		SetPageSwapBacked(from_page);
 
+	ClearPageSwapCache(from_page);
+	if (to_swapcache)
+		SetPageSwapCache(from_page);
+	set_page_private(from_page, to_private);
+
 
 	/* to_page  */
 	to_page->index = from_page_index;
@@ -320,7 +445,59 @@ static int exchange_page_move_mapping(struct address_space *to_mapping,
 	if (from_swapbacked)
 		SetPageSwapBacked(to_page);
 
+	ClearPageSwapCache(to_page);
+	if (from_swapcache)
+		SetPageSwapCache(to_page);
+	set_page_private(to_page, from_private);
+
+	if (!to_mapping && !from_mapping)
+		return MIGRATEPAGE_SUCCESS;
+
+	/* each page takes the cache reference of the other's slot */
+	if (to_pslot)
+		radix_tree_replace_slot(to_pslot, from_page);
+	if (from_pslot)
+		radix_tree_replace_slot(from_pslot, to_page);
+
+	if (to_mapping)
+		page_ref_unfreeze(to_page, to_expected_count - !from_mapping);
+	else
+		get_page(to_page);
+
+	if (from_mapping)
+		page_ref_unfreeze(from_page, from_expected_count - !to_mapping);
+	else
+		get_page(from_page);
+
+	exchange_unlock_mappings(to_mapping, from_mapping);
+	local_irq_enable();
+
 	return MIGRATEPAGE_SUCCESS;
+
+out_unfreeze:
+	if (to_pslot)
+		page_ref_unfreeze(to_page, to_expected_count);
+out_unlock:
+	exchange_unlock_mappings(to_mapping, from_mapping);
+	local_irq_enable();
+	return -EAGAIN;
+}
+
+/*
+ * The DMA engines failed to exchange the data of a pair and put both pages
+ * back, after their mappings were exchanged. Returns true if the mappings
+ * are exchanged back too, so the pair can fail. That is only done for
+ * anonymous pages outside the swap cache, which nobody can have looked up
+ * in the meantime; the caller finishes other pairs with the CPU.
+ */
+static bool exchange_page_undo_mapping(struct page *to_page,
+				struct page *from_page, enum migrate_mode mode)
+{
+	if (page_mapping(to_page) || page_mapping(from_page))
+		return false;
+
+	return exchange_page_move_mapping(NULL, NULL, to_page, from_page,
+				mode, 0, 0) == MIGRATEPAGE_SUCCESS;
 }
 
 static int exchange_from_to_pages(struct page *to_page, struct page *from_page,
@@ -332,15 +509,13 @@ static int exchange_from_to_pages(struct page *to_page, struct page *from_page,
 	VM_BUG_ON_PAGE(!PageLocked(from_page), from_page);
 	VM_BUG_ON_PAGE(!PageLocked(to_page), to_page);
 
-	/* copy page->mapping not use page_mapping()  */
+	/* page cache or swap cache of the pages, NULL for plain anon */
 	to_page_mapping = page_mapping(to_page);
 	from_page_mapping = page_mapping(from_page);
 
-	BUG_ON(from_page_mapping);
-	BUG_ON(to_page_mapping);
-
-	BUG_ON(PageWriteback(from_page));
-	BUG_ON(PageWriteback(to_page));
+	/* writeback cannot start while the pages are locked */
+	VM_BUG_ON_PAGE(PageWriteback(from_page), from_page);
+	VM_BUG_ON_PAGE(PageWriteback(to_page), to_page);
 
 	/* actual page mapping exchange */
 	rc = exchange_page_move_mapping(to_page_mapping, from_page_mapping, 
@@ -352,7 +527,12 @@ static int exchange_from_to_pages(struct page *to_page, struct page *from_page,
 	rc = -EFAULT;
 
 	if (mode & MIGRATE_MT) {
-		rc = exchange_page_mt(to_page, from_page, hpage_nr_pages(from_page));
+		rc = exchange_page_mt(to_page, from_page, migrate_nr_pages(from_page));
+	} else if (mode & MIGRATE_DMA) {
+		rc = exchange_page_lists_dma(&to_page, &from_page, 1);
+		if (rc == -EIO &&
+			exchange_page_undo_mapping(to_page, from_page, mode))
+			return rc;
 	}
 	if (rc) {
 		if (PageHuge(from_page) || PageTransHuge(from_page))
@@ -367,7 +547,7 @@ static int exchange_from_to_pages(struct page *to_page, struct page *from_page,
 	return rc;
 }
 
-static int unmap_and_exchange_anon(struct page *from_page, struct page *to_page,
+static int unmap_and_exchange(struct page *from_page, struct page *to_page,
 				enum migrate_mode mode)
 {
 	int rc = -EAGAIN;
@@ -382,7 +562,13 @@ static int unmap_and_exchange_anon(struct page *from_page, struct page *to_page,
 		lock_page(from_page);
 	}
 
-	BUG_ON(PageWriteback(from_page));
+	if (PageWriteback(from_page)) {
+		if (mode & MIGRATE_ASYNC) {
+			rc = -EBUSY;
+			goto out_unlock;
+		}
+		wait_on_page_writeback(from_page);
+	}
 
 	/*
 	 * By try_to_unmap(), page->mapcount goes down to 0 here. In this case,
@@ -409,7 +595,13 @@ static int unmap_and_exchange_anon(struct page *from_page, struct page *to_page,
 		lock_page(to_page);
 	}
 
-	BUG_ON(PageWriteback(to_page));
+	if (PageWriteback(to_page)) {
+		if (mode & MIGRATE_ASYNC) {
+			rc = -EBUSY;
+			goto out_unlock_both;
+		}
+		wait_on_page_writeback(to_page);
+	}
 
 	/*
 	 * By try_to_unmap(), page->mapcount goes down to 0 here. In this case,
@@ -445,6 +637,12 @@ static int unmap_and_exchange_anon(struct page *from_page, struct page *to_page,
 	 * invisible to the vm, so the page can not be migrated.  So try to
 	 * free the metadata, so the page can be freed.
 	 */
+	if (exchange_page_drop_private(from_page) ||
+		exchange_page_drop_private(to_page)) {
+		rc = -EBUSY;
+		goto out_unlock_both;
+	}
+
 	if (!from_page->mapping) {
 		VM_BUG_ON_PAGE(PageAnon(from_page), from_page);
 		if (page_has_private(from_page)) {
@@ -501,6 +699,15 @@ out:
 	return rc;
 }
 
+/* hugetlb pages go back to their hstate, not to the LRU  */
+static void putback_exchange_page(struct page *page)
+{
+	if (PageHuge(page))
+		putback_active_hugepage(page);
+	else
+		putback_lru_page(page);
+}
+
 /* 
  * Exchange pages in the exchange_list
  *
@@ -519,26 +726,185 @@ static int exchange_pages(struct list_head *exchange_list,
 		struct page *to_page = one_pair->to_page;
 		int rc;
 
-		if ((page_mapping(from_page) != NULL) || 
-			(page_mapping(to_page) != NULL)) {
+		if (!page_exchangeable(from_page) ||
+			!page_exchangeable(to_page)) {
 			++failed;
 			goto putback;
 		}
 
 		
-		rc = unmap_and_exchange_anon(from_page, to_page, mode);
+		rc = unmap_and_exchange(from_page, to_page, mode);
 
 		if (rc != MIGRATEPAGE_SUCCESS)
 			++failed;
 
 putback:
-		putback_lru_page(from_page);
-		putback_lru_page(to_page);
+		putback_exchange_page(from_page);
+		putback_exchange_page(to_page);
 
 	}
 	return failed;
 }
 
+/* pfns looked at by isolate_cold_page_node() for one page */
+#define EXCHANGE_SCAN_PFNS	1024UL
+
+/* where the next scan of each node starts, so they do not all hit the same pages */
+static unsigned long exchange_scan_pfn[MAX_NUMNODES];
+
+/*
+ * A page that can take the place of @page on another node: an anonymous
+ * page of the same size sitting on the inactive LRU, not referenced since
+ * it got there. Called without a reference on @cold, so it is rechecked
+ * after one is taken.
+ */
+static bool exchange_page_is_cold(struct page *cold, struct page *page)
+{
+	if (PageTail(cold) || PageHuge(cold))
+		return false;
+
+	if (!PageLRU(cold) || PageActive(cold) || PageReferenced(cold) ||
+		PageUnevictable(cold))
+		return false;
+
+	if (!PageAnon(cold) || PageKsm(cold) || PageSwapCache(cold))
+		return false;
+
+	if (PageTransHuge(page))
+		return PageTransHuge(cold);
+
+	return !PageCompound(cold);
+}
+
+/*
+ * Isolate a cold page of the size of @page from node @nid. The scan is
+ * bounded and goes on from where the last one on @nid stopped.
+ */
+static struct page *isolate_cold_page_node(struct page *page, int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	unsigned long nr_pages = hpage_nr_pages(page);
+	unsigned long start_pfn = ALIGN(pgdat->node_start_pfn, nr_pages);
+	unsigned long end_pfn = pgdat_end_pfn(pgdat);
+	unsigned long pfn = ALIGN(READ_ONCE(exchange_scan_pfn[nid]), nr_pages);
+	unsigned long scanned;
+	struct page *cold = NULL;
+
+	for (scanned = 0; scanned < EXCHANGE_SCAN_PFNS;
+		 scanned += nr_pages, pfn += nr_pages) {
+		struct page *p;
+
+		if (pfn < start_pfn || pfn + nr_pages > end_pfn)
+			pfn = start_pfn;
+
+		if (!pfn_valid(pfn))
+			continue;
+
+		p = pfn_to_page(pfn);
+		if (page_to_nid(p) != nid || !exchange_page_is_cold(p, page))
+			continue;
+
+		if (!get_page_unless_zero(p))
+			continue;
+
+		if (!exchange_page_is_cold(p, page) || isolate_lru_page(p)) {
+			put_page(p);
+			continue;
+		}
+
+		/* isolate_lru_page() holds its own reference */
+		put_page(p);
+		mod_zone_page_state(page_zone(p), NR_ISOLATED_ANON,
+					hpage_nr_pages(p));
+		cold = p;
+		pfn += nr_pages;
+		break;
+	}
+
+	WRITE_ONCE(exchange_scan_pfn[nid], pfn);
+
+	return cold;
+}
+
+/*
+ * Fallback for migrate_pages() callers when node @nid has no free page
+ * left for the isolated @page: exchange @page with a cold page of the same
+ * size on @nid instead. The data of @page ends up on @nid without
+ * allocating anything there, and the cold page goes where @page was.
+ *
+ * Only pages page_exchangeable() accepts, THPs included, can be
+ * exchanged; hugetlb and KSM pages cannot. On success @page
+ * is taken off its migration list and put back; otherwise it is left
+ * there for the caller.
+ */
+int exchange_page_to_node(struct page *page, int nid, enum migrate_mode mode)
+{
+	struct page *cold;
+	int file;
+	int rc;
+
+	if (PageHuge(page) || PageKsm(page) || !page_exchangeable(page))
+		return -ENOSYS;
+
+	if (page_to_nid(page) == nid)
+		return -EINVAL;
+
+	cold = isolate_cold_page_node(page, nid);
+	if (!cold)
+		return -ENOMEM;
+
+	/* as isolated: page holds the data of cold after the exchange */
+	file = page_is_file_cache(page);
+
+	rc = unmap_and_exchange(page, cold, mode);
+
+	mod_zone_page_state(page_zone(cold), NR_ISOLATED_ANON,
+				-hpage_nr_pages(cold));
+	putback_lru_page(cold);
+
+	if (rc != MIGRATEPAGE_SUCCESS)
+		return rc;
+
+	list_del(&page->lru);
+	dec_zone_page_state(page, NR_ISOLATED_ANON + file);
+	putback_lru_page(page);
+
+	return MIGRATEPAGE_SUCCESS;
+}
+
+/*
+ * exchange_page_to_node() for the pages migrate_pages() left on @from,
+ * trying the nodes of @nodes in turn. Returns the number of pages still
+ * on @from.
+ */
+int exchange_pages_to_nodes(struct list_head *from, const nodemask_t *nodes,
+			enum migrate_mode mode)
+{
+	struct page *page, *page2;
+	int nr_remaining = 0;
+	int nid;
+
+	list_for_each_entry_safe(page, page2, from, lru) {
+		int rc = -ENOMEM;
+
+		cond_resched();
+
+		for_each_node_mask(nid, *nodes) {
+			if (nid == page_to_nid(page))
+				continue;
+
+			rc = exchange_page_to_node(page, nid, mode);
+			if (rc != -ENOMEM)
+				break;
+		}
+
+		if (rc != MIGRATEPAGE_SUCCESS)
+			nr_remaining++;
+	}
+
+	return nr_remaining;
+}
+
 
 static int unmap_pair_pages_concur(struct exchange_page_info *one_pair,
 				int force, enum migrate_mode mode)
@@ -556,7 +922,16 @@ static int unmap_pair_pages_concur(struct exchange_page_info *one_pair,
 		lock_page(from_page);
 	}
 
-	BUG_ON(PageWriteback(from_page));
+	if (PageWriteback(from_page)) {
+		if (mode & MIGRATE_ASYNC) {
+			rc = -EBUSY;
+			goto out_unlock;
+		}
+		/* retried with force once the other pairs are done */
+		if (!force)
+			goto out_unlock;
+		wait_on_page_writeback(from_page);
+	}
 
 	/*
 	 * By try_to_unmap(), page->mapcount goes down to 0 here. In this case,
@@ -583,7 +958,16 @@ static int unmap_pair_pages_concur(struct exchange_page_info *one_pair,
 		lock_page(to_page);
 	}
 
-	BUG_ON(PageWriteback(to_page));
+	if (PageWriteback(to_page)) {
+		if (mode & MIGRATE_ASYNC) {
+			rc = -EBUSY;
+			goto out_unlock_both;
+		}
+		/* retried with force once the other pairs are done */
+		if (!force)
+			goto out_unlock_both;
+		wait_on_page_writeback(to_page);
+	}
 
 	/*
 	 * By try_to_unmap(), page->mapcount goes down to 0 here. In this case,
@@ -619,19 +1003,25 @@ static int unmap_pair_pages_concur(struct exchange_page_info *one_pair,
 	 * invisible to the vm, so the page can not be migrated.  So try to
 	 * free the metadata, so the page can be freed.
 	 */
+	if (exchange_page_drop_private(from_page) ||
+		exchange_page_drop_private(to_page)) {
+		rc = -EBUSY;
+		goto out_unlock_both;
+	}
+
 	if (!from_page->mapping) {
 		VM_BUG_ON_PAGE(PageAnon(from_page), from_page);
 		if (page_has_private(from_page)) {
 			try_to_free_buffers(from_page);
 			goto out_unlock_both;
 		}
-	} else {
-		VM_BUG_ON_PAGE(!page_mapped(from_page), from_page);
+	} else if (page_mapped(from_page)) {
 		/* Establish migration ptes */
 		VM_BUG_ON_PAGE(PageAnon(from_page) && !PageKsm(from_page) && 
 					   !anon_vma_from_page, from_page);
-		rc = try_to_unmap(from_page,
-			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
+		try_to_unmap(from_page,
+			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS|
+			(PageHuge(from_page) ? 0 : TTU_BATCH_FLUSH));
 	}
 
 	if (!to_page->mapping) {
@@ -640,16 +1030,27 @@ static int unmap_pair_pages_concur(struct exchange_page_info *one_pair,
 			try_to_free_buffers(to_page);
 			goto out_unlock_both;
 		}
-	} else {
-		VM_BUG_ON_PAGE(!page_mapped(to_page), to_page);
+	} else if (page_mapped(to_page)) {
 		/* Establish migration ptes */
 		VM_BUG_ON_PAGE(PageAnon(to_page) && !PageKsm(to_page) && 
 					   !anon_vma_to_page, to_page);
-		rc = try_to_unmap(to_page,
-			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
+		try_to_unmap(to_page,
+			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS|
+			(PageHuge(to_page) ? 0 : TTU_BATCH_FLUSH));
 	}
 
-	return rc;
+	/*
+	 * Page cache pages need not be mapped at all, so whether the pair
+	 * can go on is down to both pages being unmapped now.
+	 */
+	if (page_mapped(from_page) || page_mapped(to_page)) {
+		remove_migration_ptes(from_page, from_page, false);
+		remove_migration_ptes(to_page, to_page, false);
+		rc = -EAGAIN;
+		goto out_unlock_both;
+	}
+
+	return MIGRATEPAGE_SUCCESS;
 
 out_unlock_both:
 	if (anon_vma_to_page)
@@ -665,6 +1066,29 @@ out:
 	return rc;
 }
 
+/* Map both pages of a pair back as they were, and retry the pair */
+static void exchange_pair_retry(struct exchange_page_info *one_pair,
+				struct list_head *exchange_list_ptr)
+{
+	struct page *from_page = one_pair->from_page;
+	struct page *to_page = one_pair->to_page;
+
+	remove_migration_ptes(from_page, from_page, false);
+	remove_migration_ptes(to_page, to_page, false);
+
+	unlock_page(from_page);
+	if (one_pair->from_anon_vma)
+		put_anon_vma(one_pair->from_anon_vma);
+	one_pair->from_anon_vma = NULL;
+
+	unlock_page(to_page);
+	if (one_pair->to_anon_vma)
+		put_anon_vma(one_pair->to_anon_vma);
+	one_pair->to_anon_vma = NULL;
+
+	list_move(&one_pair->list, exchange_list_ptr);
+}
+
 static int exchange_page_mapping_concur(struct list_head *unmapped_list_ptr,
 					   struct list_head *exchange_list_ptr,
 						enum migrate_mode mode)
@@ -681,22 +1105,20 @@ static int exchange_page_mapping_concur(struct list_head *unmapped_list_ptr,
 		VM_BUG_ON_PAGE(!PageLocked(from_page), from_page);
 		VM_BUG_ON_PAGE(!PageLocked(to_page), to_page);
 
-		/* copy page->mapping not use page_mapping()  */
+		/* page cache or swap cache of the pages, NULL for plain anon */
 		to_page_mapping = page_mapping(to_page);
 		from_page_mapping = page_mapping(from_page);
 
-		BUG_ON(from_page_mapping);
-		BUG_ON(to_page_mapping);
-
-		BUG_ON(PageWriteback(from_page));
-		BUG_ON(PageWriteback(to_page));
+		/* writeback cannot start while the pages are locked */
+		VM_BUG_ON_PAGE(PageWriteback(from_page), from_page);
+		VM_BUG_ON_PAGE(PageWriteback(to_page), to_page);
 
 		/* actual page mapping exchange */
 		rc = exchange_page_move_mapping(to_page_mapping, from_page_mapping, 
 							to_page, from_page, mode, 0, 0);
 
 		if (rc) {
-			list_move(&one_pair->list, exchange_list_ptr);
+			exchange_pair_retry(one_pair, exchange_list_ptr);
 			++nr_failed;
 		}
 	}
@@ -704,27 +1126,34 @@ static int exchange_page_mapping_concur(struct list_head *unmapped_list_ptr,
 	return nr_failed;
 }
 
-static int exchange_page_data_concur(struct list_head *unmapped_list_ptr, 
-									enum migrate_mode mode)
+/*
+ * Exchange the data of the pairs on unmapped_list, whose mappings are
+ * exchanged. If the DMA engines fail, the pairs whose mappings can be
+ * exchanged back are retried from exchange_list, see
+ * exchange_page_undo_mapping(). Returns the number of such pairs.
+ */
+static int exchange_page_data_concur(struct list_head *unmapped_list_ptr,
+					struct list_head *exchange_list_ptr,
+					enum migrate_mode mode)
 {
-	struct exchange_page_info *one_pair;
+	struct exchange_page_info *one_pair, *one_pair2;
 	int num_pages = 0, idx = 0;
 	struct page **src_page_list = NULL, **dst_page_list = NULL;
 	unsigned long size = 0;
+	int nr_failed = 0;
 	int rc = -EFAULT;
 
 	/* form page list  */
 	list_for_each_entry(one_pair, unmapped_list_ptr, list) {
 		++num_pages;
-		size += PAGE_SIZE * hpage_nr_pages(one_pair->from_page);
+		size += PAGE_SIZE * migrate_nr_pages(one_pair->from_page);
 	}
 
+	/* the mappings are exchanged, so the CPU does it without the lists */
 	src_page_list = kzalloc(sizeof(struct page *)*num_pages, GFP_KERNEL);
-	if (!src_page_list)
-		return -ENOMEM;
 	dst_page_list = kzalloc(sizeof(struct page *)*num_pages, GFP_KERNEL);
-	if (!dst_page_list)
-		return -ENOMEM;
+	if (!src_page_list || !dst_page_list)
+		goto exchange_cpu;
 
 	list_for_each_entry(one_pair, unmapped_list_ptr, list) {
 		src_page_list[idx] = one_pair->from_page;
@@ -737,7 +1166,22 @@ static int exchange_page_data_concur(struct list_head *unmapped_list_ptr,
 
 	if (mode & MIGRATE_MT)
 		rc = exchange_page_lists_mt(dst_page_list, src_page_list, num_pages);
+	else if (mode & MIGRATE_DMA)
+		rc = exchange_page_lists_dma(dst_page_list, src_page_list, num_pages);
+
+	if (rc == -EIO) {
+		list_for_each_entry_safe(one_pair, one_pair2, unmapped_list_ptr,
+					list) {
+			if (!exchange_page_undo_mapping(one_pair->to_page,
+						one_pair->from_page, mode))
+				continue;
+
+			exchange_pair_retry(one_pair, exchange_list_ptr);
+			++nr_failed;
+		}
+	}
 
+exchange_cpu:
 	if (rc) {
 		list_for_each_entry(one_pair, unmapped_list_ptr, list) {
 			if (PageHuge(one_pair->from_page) || 
@@ -756,7 +1200,7 @@ static int exchange_page_data_concur(struct list_head *unmapped_list_ptr,
 		exchange_page_flags(one_pair->to_page, one_pair->from_page);
 	}
 	
-	return rc;
+	return nr_failed;
 }
 
 static int remove_migration_ptes_concur(struct list_head *unmapped_list_ptr)
@@ -777,18 +1221,25 @@ static int remove_migration_ptes_concur(struct list_head *unmapped_list_ptr)
 		if (iterator->to_anon_vma)
 			put_anon_vma(iterator->to_anon_vma);
 
+		iterator->exchanged = true;
 
-		putback_lru_page(iterator->from_page);
+		if (!iterator->keep_from_page)
+			putback_exchange_page(iterator->from_page);
 		iterator->from_page = NULL;
 
-		putback_lru_page(iterator->to_page);
+		putback_exchange_page(iterator->to_page);
 		iterator->to_page = NULL;
 	}
 
 	return 0;
 }
 
-static int exchange_pages_concur(struct list_head *exchange_list, enum migrate_mode mode, int reason)
+/*
+ * Exchange the pairs on exchange_list. The pages are put back once done
+ * with, except the from_page of pairs with keep_from_page set, and the
+ * pairs that got exchanged are marked so.
+ */
+int exchange_pages_concur(struct list_head *exchange_list, enum migrate_mode mode, int reason)
 {
 	struct exchange_page_info *one_pair, *one_pair2;
 	int pass = 0;
@@ -798,20 +1249,28 @@ static int exchange_pages_concur(struct list_head *exchange_list, enum migrate_m
 	int rc = 0;
 	LIST_HEAD(serialized_list);
 	LIST_HEAD(unmapped_list);
+	LIST_HEAD(exchanged_list);
 
 	for(pass = 0; pass < 10 && retry; pass++) {
 		retry = 0;
 
-		/* unmap and get new page for page_mapping(page) == NULL */
+		/* unmap the pairs that can be exchanged */
 		list_for_each_entry_safe(one_pair, one_pair2, exchange_list, list) {
 			cond_resched();
 
-			/* We do not exchange huge pages and file-backed pages concurrently */
-			if (PageHuge(one_pair->from_page) || PageHuge(one_pair->to_page)) {
+			/*
+			 * We do not exchange pages whose mapping has its own
+			 * migratepage callback, nor hugetlb pages of a size
+			 * that cannot migrate. Both pages of a pair have the
+			 * same hstate.
+			 */
+			if (PageHuge(one_pair->from_page) &&
+				!hugepage_migration_supported(
+					page_hstate(one_pair->from_page))) {
 				rc = -ENODEV;
 			}
-			else if ((page_mapping(one_pair->from_page) != NULL) ||
-					 (page_mapping(one_pair->from_page) != NULL)) {
+			else if (!page_exchangeable(one_pair->from_page) ||
+					 !page_exchangeable(one_pair->to_page)) {
 				rc = -ENODEV;
 			}
 			else
@@ -845,46 +1304,54 @@ static int exchange_pages_concur(struct list_head *exchange_list, enum migrate_m
 			}
 		}
 
+		/* one TLB shootdown for all the pairs unmapped above */
+		try_to_unmap_flush();
+
 		/* move page->mapping to new page, only -EAGAIN could happen  */
 		exchange_page_mapping_concur(&unmapped_list, exchange_list, mode);
 
 
 		/* copy pages in unmapped_list */
-		exchange_page_data_concur(&unmapped_list, mode);
+		exchange_page_data_concur(&unmapped_list, exchange_list, mode);
 
 
 		/* remove migration pte, if old_page is NULL?, unlock old and new
 		 * pages, put anon_vma, put old and new pages */
 		remove_migration_ptes_concur(&unmapped_list);
+		list_splice_init(&unmapped_list, &exchanged_list);
 	}
 
-	nr_failed += retry;
-	rc = nr_failed;
+	/* pairs still busy after the last pass get one serial try */
+	list_splice_init(exchange_list, &serialized_list);
 
 	list_for_each_entry_safe(one_pair, one_pair2, &serialized_list, list) {
 		struct page *from_page = one_pair->from_page;
 		struct page *to_page = one_pair->to_page;
 		int rc;
 
-		if ((page_mapping(from_page) != NULL) || 
-			(page_mapping(to_page) != NULL)) {
+		if (!page_exchangeable(from_page) ||
+			!page_exchangeable(to_page)) {
 			++nr_failed;
 			goto putback;
 		}
 
 		
-		rc = unmap_and_exchange_anon(from_page, to_page, mode);
+		rc = unmap_and_exchange(from_page, to_page, mode);
 
 		if (rc != MIGRATEPAGE_SUCCESS)
 			++nr_failed;
+		else
+			one_pair->exchanged = true;
 
 putback:
 
-		putback_lru_page(from_page);
-		putback_lru_page(to_page);
+		if (!one_pair->keep_from_page)
+			putback_exchange_page(from_page);
+		putback_exchange_page(to_page);
 
 	}
 out:
+	list_splice(&exchanged_list, exchange_list);
 	list_splice(&unmapped_list, exchange_list);
 	list_splice(&serialized_list, exchange_list);
 
@@ -892,14 +1359,101 @@ out:
 }
 
 /*
- * Move a set of pages as indicated in the pm array. The addr
- * field must be set to the virtual address of the page to be moved
- * and the node number must contain a valid target node.
- * The pm array ends with node = MAX_NUMNODES.
+ * Look up the page at addr in mm and isolate it onto isolated_list.
+ * Returns 0 with *pagep set once isolated, an error otherwise.
+ * Called with mmap_sem held.
+ */
+static int exchange_isolate_page(struct mm_struct *mm, unsigned long addr,
+				int migrate_all, struct list_head *isolated_list,
+				struct page **pagep)
+{
+	struct vm_area_struct *vma;
+	struct page *page;
+	unsigned int follflags;
+	int err;
+
+	err = -EFAULT;
+	vma = find_vma(mm, addr);
+	if (!vma || addr < vma->vm_start || !vma_migratable(vma))
+		return err;
+
+	/* FOLL_DUMP to ignore special (like zero) pages */
+	follflags = FOLL_GET | FOLL_SPLIT | FOLL_DUMP;
+	if (thp_migration_supported())
+		follflags &= ~FOLL_SPLIT;
+	page = follow_page(vma, addr, follflags);
+
+	err = PTR_ERR(page);
+	if (IS_ERR(page))
+		return err;
+
+	err = -ENOENT;
+	if (!page)
+		return err;
+
+	err = -EACCES;
+	if (page_mapcount(page) > 1 &&
+			!migrate_all)
+		goto put_page;
+
+	if (PageHuge(page)) {
+		if (PageHead(page) && isolate_huge_page(page, isolated_list)) {
+			err = 0;
+			*pagep = page;
+		}
+		goto put_page;
+	} else if (PageTransCompound(page)) {
+		if (PageTail(page)) {
+			err = -EACCES;
+			goto put_page;
+		}
+	}
+
+	err = isolate_lru_page(page);
+	if (!err) {
+		list_add_tail(&page->lru, isolated_list);
+		inc_zone_page_state(page, NR_ISOLATED_ANON +
+				    page_is_file_cache(page));
+		*pagep = page;
+	}
+put_page:
+	/*
+	 * Either remove the duplicate refcount from
+	 * isolate_lru_page() or drop the page ref if it was
+	 * not isolated.
+	 *
+	 * Since FOLL_GET calls get_page(), and isolate_lru_page()
+	 * also calls get_page()
+	 */
+	put_page(page);
+
+	return err;
+}
+
+/*
+ * Exchange a set of pages as indicated in the pm array: the page at
+ * from_addr in from_mm with the page at to_addr in to_mm. The two mms
+ * can be the same. The pm array ends with from_addr = to_addr = 0.
+ *
+ * The pages of each mm are isolated under its own mmap_sem, one mm after
+ * the other, so two exchanges between the same mms in opposite
+ * directions do not wait on each other. The exchange itself goes through
+ * the rmap of each page, so it does not care which mm they are in: the
+ * anon_vma, mapping and index of the pages are swapped, and so is their
+ * mem_cgroup, which keeps each memcg charged for one page of the same
+ * size as before.
+ *
+ * Between two tasks, the data of each mm ends up on the node of the other
+ * page. from_nodes and to_nodes are then the nodes each task may use, and
+ * a pair that would leave either task outside its own fails with -EACCES.
  */
-static int do_exchange_page_array(struct mm_struct *mm,
+static int do_exchange_page_array(struct mm_struct *from_mm,
+				      struct mm_struct *to_mm,
+				      const nodemask_t *from_nodes,
+				      const nodemask_t *to_nodes,
 				      struct pages_to_node *pm,
 					  int migrate_all,
+					  int migrate_use_dma,
 					  int migrate_use_mt,
 					  int migrate_batch)
 {
@@ -911,169 +1465,86 @@ static int do_exchange_page_array(struct mm_struct *mm,
 
 	if (migrate_use_mt)
 		mode |= MIGRATE_MT;
-
-
-	down_read(&mm->mmap_sem);
+	else if (migrate_use_dma)
+		mode |= MIGRATE_DMA;
 
 	/*
 	 * Build a list of pages to migrate
 	 */
+	down_read(&from_mm->mmap_sem);
 	for (pp = pm; pp->from_addr != 0 && pp->to_addr != 0; pp++) {
-		struct vm_area_struct *from_vma, *to_vma;
-		struct page *from_page, *to_page;
-		unsigned int follflags;
-		bool isolated = false;
-
-		err = -EFAULT;
-		from_vma = find_vma(mm, pp->from_addr);
-		if (!from_vma || 
-			pp->from_addr < from_vma->vm_start || 
-			!vma_migratable(from_vma))
-			goto set_from_status;
-
-		/* FOLL_DUMP to ignore special (like zero) pages */
-		follflags = FOLL_GET | FOLL_SPLIT | FOLL_DUMP;
-		if (thp_migration_supported())
-			follflags &= ~FOLL_SPLIT;
-		from_page = follow_page(from_vma, pp->from_addr, follflags);
-
-		err = PTR_ERR(from_page);
-		if (IS_ERR(from_page))
-			goto set_from_status;
-
-		err = -ENOENT;
-		if (!from_page)
-			goto set_from_status;
-
-		err = -EACCES;
-		if (page_mapcount(from_page) > 1 &&
-				!migrate_all)
-			goto put_and_set_from_page;
-
-		if (PageHuge(from_page)) {
-			if (PageHead(from_page)) 
-				if (isolate_huge_page(from_page, &err_page_list)) {
-					err = 0;
-					isolated = true;
-				}
-			goto put_and_set_from_page;
-		} else if (PageTransCompound(from_page)) {
-			if (PageTail(from_page)) {
-				err = -EACCES;
-				goto put_and_set_from_page;
-			}
-		}
+		pp->from_page = pp->to_page = NULL;
+		pp->exchange_pmd = false;
+		pp->from_status = exchange_isolate_page(from_mm, pp->from_addr,
+					migrate_all, &err_page_list,
+					&pp->from_page);
+	}
+	up_read(&from_mm->mmap_sem);
 
-		err = isolate_lru_page(from_page);
-		if (!err) {
-			list_add_tail(&from_page->lru, &err_page_list);
-			inc_zone_page_state(from_page, NR_ISOLATED_ANON +
-					    page_is_file_cache(from_page));
-			isolated = true;
+	down_read(&to_mm->mmap_sem);
+	for (pp = pm; pp->from_addr != 0 && pp->to_addr != 0; pp++) {
+		if (pp->from_status) {
+			pp->to_status = pp->from_status;
+			continue;
 		}
-put_and_set_from_page:
-		/*
-		 * Either remove the duplicate refcount from
-		 * isolate_lru_page() or drop the page ref if it was
-		 * not isolated.
-		 *
-		 * Since FOLL_GET calls get_page(), and isolate_lru_page()
-		 * also calls get_page()
-		 */
-		put_page(from_page);
-set_from_status:
-		pp->from_status = err;
+		pp->to_status = exchange_isolate_page(to_mm, pp->to_addr,
+					migrate_all, &err_page_list,
+					&pp->to_page);
+	}
+	/* as in do_move_page_to_node_array(), not held for the exchange */
+	up_read(&to_mm->mmap_sem);
 
-		if (err)
+	err = 0;
+	for (pp = pm; pp->from_addr != 0 && pp->to_addr != 0; pp++) {
+		struct page *from_page = pp->from_page;
+		struct page *to_page = pp->to_page;
+		struct exchange_page_info *one_pair;
+
+		if (pp->from_status || pp->to_status)
 			continue;
 
-		/* to pages  */
-		isolated = false;
-		err = -EFAULT;
-		to_vma = find_vma(mm, pp->to_addr);
-		if (!to_vma || 
-			pp->to_addr < to_vma->vm_start || 
-			!vma_migratable(to_vma))
-			goto set_to_status;
-
-		/* FOLL_DUMP to ignore special (like zero) pages */
-		follflags = FOLL_GET | FOLL_SPLIT | FOLL_DUMP;
-		if (thp_migration_supported())
-			follflags &= ~FOLL_SPLIT;
-		to_page = follow_page(to_vma, pp->to_addr, follflags);
-
-		err = PTR_ERR(to_page);
-		if (IS_ERR(to_page))
-			goto set_to_status;
-
-		err = -ENOENT;
-		if (!to_page)
-			goto set_to_status;
-
-		err = -EACCES;
-		if (page_mapcount(to_page) > 1 &&
-				!migrate_all)
-			goto put_and_set_to_page;
-
-		if (PageHuge(to_page)) {
-			if (PageHead(to_page)) 
-				if (isolate_huge_page(to_page, &err_page_list)) {
-					err = 0;
-					isolated = true;
-				}
-			goto put_and_set_to_page;
-		} else if (PageTransCompound(to_page)) {
-			if (PageTail(to_page)) {
-				err = -EACCES;
-				goto put_and_set_to_page;
-			}
+		if (from_nodes &&
+			(!node_isset(page_to_nid(to_page), *from_nodes) ||
+			 !node_isset(page_to_nid(from_page), *to_nodes))) {
+			pp->to_status = -EACCES;
+			continue;
 		}
 
-		err = isolate_lru_page(to_page);
-		if (!err) {
-			list_add_tail(&to_page->lru, &err_page_list);
-			inc_zone_page_state(to_page, NR_ISOLATED_ANON +
-					    page_is_file_cache(to_page));
-			isolated = true;
-		}
-put_and_set_to_page:
 		/*
-		 * Either remove the duplicate refcount from
-		 * isolate_lru_page() or drop the page ref if it was
-		 * not isolated.
-		 *
-		 * Since FOLL_GET calls get_page(), and isolate_lru_page()
-		 * also calls get_page()
+		 * A THP and a base page in the same mm: exchange the THP with
+		 * all the base pages of the pmd range around the base page,
+		 * once both are back on the LRU.
 		 */
-		put_page(to_page);
-set_to_status:
-		pp->to_status = err;
-
-
-		if (!err) {
-			if ((PageHuge(from_page) != PageHuge(to_page)) ||
-				(PageTransHuge(from_page) != PageTransHuge(to_page))) {
-				pp->to_status = -EFAULT;
-				continue;
-			} else {
-				struct exchange_page_info *one_pair = 
-					kzalloc(sizeof(struct exchange_page_info), GFP_ATOMIC);
-				if (!one_pair) {
-					err = -ENOMEM;
-					break;
-				}
+		if (from_mm == to_mm &&
+			!PageHuge(from_page) && !PageHuge(to_page) &&
+			PageTransHuge(from_page) != PageTransHuge(to_page)) {
+			pp->exchange_pmd = true;
+			pp->from_thp = PageTransHuge(from_page);
+			continue;
+		}
 
+		if ((PageHuge(from_page) != PageHuge(to_page)) ||
+			(PageHuge(from_page) &&
+			 page_hstate(from_page) != page_hstate(to_page)) ||
+			(PageTransHuge(from_page) != PageTransHuge(to_page))) {
+			pp->to_status = -EFAULT;
+			continue;
+		}
 
-				list_del(&from_page->lru);
-				list_del(&to_page->lru);
+		one_pair = kzalloc(sizeof(struct exchange_page_info), GFP_KERNEL);
+		if (!one_pair) {
+			err = -ENOMEM;
+			break;
+		}
 
-				one_pair->from_page = from_page;
-				one_pair->to_page = to_page;
+		/* putback_active_hugepage() moves them later */
+		list_del_init(&from_page->lru);
+		list_del_init(&to_page->lru);
 
-				list_add_tail(&one_pair->list, &exchange_page_list);
-			}
-		}
+		one_pair->from_page = from_page;
+		one_pair->to_page = to_page;
 
+		list_add_tail(&one_pair->list, &exchange_page_list);
 	}
 
 	/* 
@@ -1086,7 +1557,6 @@ set_to_status:
 		putback_movable_pages(&err_page_list);
 	}
 
-	err = 0;
 	if (!list_empty(&exchange_page_list)) {
 		if (migrate_batch) 
 			err = exchange_pages_concur(&exchange_page_list, mode, MR_SYSCALL);
@@ -1103,7 +1573,20 @@ set_to_status:
 		kfree(one_pair);
 	}
 
-	up_read(&mm->mmap_sem);
+	/* the page tables of both ranges change, so mmap_sem is taken for write */
+	for (pp = pm; pp->from_addr != 0 && pp->to_addr != 0; pp++) {
+		if (!pp->exchange_pmd)
+			continue;
+
+		down_write(&from_mm->mmap_sem);
+		if (pp->from_thp)
+			pp->to_status = exchange_huge_pmd_ptes(from_mm,
+					pp->from_addr, pp->to_addr, mode);
+		else
+			pp->to_status = exchange_huge_pmd_ptes(from_mm,
+					pp->to_addr, pp->from_addr, mode);
+		up_write(&from_mm->mmap_sem);
+	}
 
 	return err;
 }
@@ -1111,7 +1594,10 @@ set_to_status:
  * Migrate an array of page address onto an array of nodes and fill
  * the corresponding array of status.
  */
-static int do_pages_exchange(struct mm_struct *mm, nodemask_t task_nodes,
+static int do_pages_exchange(struct mm_struct *from_mm,
+			 struct mm_struct *to_mm,
+			 const nodemask_t *from_nodes,
+			 const nodemask_t *to_nodes,
 			 unsigned long nr_pages,
 			 const void __user * __user *from_pages,
 			 const void __user * __user *to_pages,
@@ -1163,8 +1649,10 @@ static int do_pages_exchange(struct mm_struct *mm, nodemask_t task_nodes,
 		pm[chunk_nr_pages].from_addr = pm[chunk_nr_pages].to_addr = 0;
 
 		/* Migrate this chunk */
-		err = do_exchange_page_array(mm, pm,
+		err = do_exchange_page_array(from_mm, to_mm, from_nodes,
+						 to_nodes, pm,
 						 flags & MPOL_MF_MOVE_ALL,
+						 flags & MPOL_MF_MOVE_DMA,
 						 flags & MPOL_MF_MOVE_MT,
 						 flags & MPOL_MF_MOVE_CONCUR);
 		if (err < 0)
@@ -1186,45 +1674,27 @@ out:
 	return err;
 }
 
-
-
-
-SYSCALL_DEFINE6(exchange_pages, pid_t, pid, unsigned long, nr_pages,
-		const void __user * __user *, from_pages,
-		const void __user * __user *, to_pages,
-		int __user *, status, int, flags)
+/*
+ * Find the mm of the task pid, if the caller has the right to move its
+ * memory around. The right exists if the process has administrative
+ * capabilities, superuser privileges or the same userid as the target
+ * process. If nodes is not NULL, it is set to the nodes the task may use.
+ */
+static struct mm_struct *exchange_pages_get_mm(pid_t pid, nodemask_t *nodes)
 {
 	const struct cred *cred = current_cred(), *tcred;
 	struct task_struct *task;
 	struct mm_struct *mm;
 	int err;
-	nodemask_t task_nodes;
-
-	/* Check flags */
-	if (flags & ~(MPOL_MF_MOVE|
-				  MPOL_MF_MOVE_ALL|
-				  MPOL_MF_MOVE_MT|
-				  MPOL_MF_MOVE_CONCUR))
-		return -EINVAL;
-
-	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
-		return -EPERM;
 
-	/* Find the mm_struct */
 	rcu_read_lock();
 	task = pid ? find_task_by_vpid(pid) : current;
 	if (!task) {
 		rcu_read_unlock();
-		return -ESRCH;
+		return ERR_PTR(-ESRCH);
 	}
 	get_task_struct(task);
 
-	/*
-	 * Check if this process has the right to modify the specified
-	 * process. The right exists if the process has administrative
-	 * capabilities, superuser privileges or the same
-	 * userid as the target process.
-	 */
 	tcred = __task_cred(task);
 	if (!uid_eq(cred->euid, tcred->suid) && !uid_eq(cred->euid, tcred->uid) &&
 	    !uid_eq(cred->uid,  tcred->suid) && !uid_eq(cred->uid,  tcred->uid) &&
@@ -1239,23 +1709,107 @@ SYSCALL_DEFINE6(exchange_pages, pid_t, pid, unsigned long, nr_pages,
  	if (err)
 		goto out;
 
-	task_nodes = cpuset_mems_allowed(task);
+	if (nodes)
+		*nodes = cpuset_mems_allowed(task);
+
 	mm = get_task_mm(task);
 	put_task_struct(task);
 
 	if (!mm)
+		return ERR_PTR(-EINVAL);
+
+	return mm;
+
+out:
+	put_task_struct(task);
+
+	return ERR_PTR(err);
+}
+
+static int exchange_pages_check_flags(int flags)
+{
+	if (flags & ~(MPOL_MF_MOVE|
+				  MPOL_MF_MOVE_ALL|
+				  MPOL_MF_MOVE_DMA|
+				  MPOL_MF_MOVE_MT|
+				  MPOL_MF_MOVE_CONCUR))
 		return -EINVAL;
 
+	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	return 0;
+}
+
+SYSCALL_DEFINE6(exchange_pages, pid_t, pid, unsigned long, nr_pages,
+		const void __user * __user *, from_pages,
+		const void __user * __user *, to_pages,
+		int __user *, status, int, flags)
+{
+	struct mm_struct *mm;
+	int err;
+
+	/* Check flags */
+	err = exchange_pages_check_flags(flags);
+	if (err)
+		return err;
+
+	/* Find the mm_struct */
+	mm = exchange_pages_get_mm(pid, NULL);
+	if (IS_ERR(mm))
+		return PTR_ERR(mm);
 
-	err = do_pages_exchange(mm, task_nodes, nr_pages, from_pages,
+	err = do_pages_exchange(mm, mm, NULL, NULL, nr_pages, from_pages,
 				    to_pages, status, flags);
 
 	mmput(mm);
 
 	return err;
+}
+
+/*
+ * exchange_pages() across two address spaces: from_pages are addresses in
+ * the task pids[0], to_pages in the task pids[1]. The caller needs the
+ * right to move the memory of both, and neither task is given a page on a
+ * node its cpuset does not allow.
+ */
+SYSCALL_DEFINE6(exchange_pages_remote, const pid_t __user *, pids,
+		unsigned long, nr_pages,
+		const void __user * __user *, from_pages,
+		const void __user * __user *, to_pages,
+		int __user *, status, int, flags)
+{
+	struct mm_struct *from_mm, *to_mm;
+	nodemask_t from_nodes, to_nodes;
+	pid_t from_pid, to_pid;
+	int err;
 
+	/* Check flags */
+	err = exchange_pages_check_flags(flags);
+	if (err)
+		return err;
+
+	if (get_user(from_pid, pids) || get_user(to_pid, pids + 1))
+		return -EFAULT;
+
+	/* Find the mm_structs */
+	from_mm = exchange_pages_get_mm(from_pid, &from_nodes);
+	if (IS_ERR(from_mm))
+		return PTR_ERR(from_mm);
+
+	to_mm = exchange_pages_get_mm(to_pid, &to_nodes);
+	if (IS_ERR(to_mm)) {
+		err = PTR_ERR(to_mm);
+		goto out;
+	}
+
+	err = do_pages_exchange(from_mm, to_mm, &from_nodes, &to_nodes,
+				    nr_pages, from_pages,
+				    to_pages, status, flags);
+
+	mmput(to_mm);
 out:
-	put_task_struct(task);
+	mmput(from_mm);
 
 	return err;
 }
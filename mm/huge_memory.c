@@ -2565,6 +2565,370 @@ out:
 	goto out_up_write;
 }
 
+static bool exchange_pmd_vma_check(struct vm_area_struct *vma,
+				unsigned long haddr)
+{
+	if (!vma || haddr < vma->vm_start ||
+		haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return false;
+	if (vma->vm_flags & VM_LOCKED)
+		return false;
+	return hugepage_vma_check(vma);
+}
+
+static void exchange_pmd_release_pages(struct page **pages, int nr)
+{
+	while (nr--)
+		release_pte_page(pages[nr]);
+}
+
+/*
+ * Point a locked anonymous page, which stays mapped once, at its new
+ * address, the way page_move_anon_rmap() does. page_add_new_anon_rmap()
+ * cannot be used: it keeps the anon_vma and index of a page that already
+ * has them, and rmap walks would then look for the page in the old range,
+ * or through an anon_vma freed with it.
+ */
+static void exchange_pmd_move_anon_rmap(struct page *page,
+				struct vm_area_struct *vma, unsigned long address)
+{
+	struct anon_vma *anon_vma = vma->anon_vma;
+
+	VM_BUG_ON_PAGE(!PageLocked(page), page);
+	VM_BUG_ON_VMA(!anon_vma, vma);
+
+	anon_vma = (void *) anon_vma + PAGE_MAPPING_ANON;
+	page->index = linear_page_index(vma, address);
+	WRITE_ONCE(page->mapping, (struct address_space *) anon_vma);
+}
+
+/*
+ * Lock and isolate the base pages mapped by the ptes of a page table
+ * detached by pmdp_collapse_flush(). Like __collapse_huge_page_isolate(),
+ * but every pte has to map an exclusive anonymous page charged to memcg.
+ */
+static int exchange_pmd_isolate_ptes(struct vm_area_struct *vma,
+				unsigned long address, pte_t *pte,
+				struct mem_cgroup *memcg,
+				struct page **pages, bool *writable)
+{
+	int i;
+
+	for (i = 0; i < HPAGE_PMD_NR; i++, address += PAGE_SIZE) {
+		pte_t pteval = pte[i];
+		struct page *page;
+
+		if (!pte_present(pteval) || is_zero_pfn(pte_pfn(pteval)))
+			goto out;
+
+		page = vm_normal_page(vma, address, pteval);
+		if (!page || !PageAnon(page) || PageCompound(page) ||
+			PageKsm(page) || PageSwapCache(page) ||
+			page_mapcount(page) != 1 || page_memcg(page) != memcg)
+			goto out;
+
+		if (!trylock_page(page))
+			goto out;
+
+		/* cannot use mapcount: can't exchange if there's a gup pin */
+		if (page_count(page) != 1 || isolate_lru_page(page)) {
+			unlock_page(page);
+			goto out;
+		}
+		/* 0 stands for page_is_file_cache(page) == false */
+		inc_zone_page_state(page, NR_ISOLATED_ANON + 0);
+
+		if (pte_write(pteval))
+			*writable = true;
+		pages[i] = page;
+	}
+
+	return 1;
+
+out:
+	exchange_pmd_release_pages(pages, i);
+	return 0;
+}
+
+/*
+ * Exchange the anonymous THP mapped by the pmd at thp_addr with the
+ * HPAGE_PMD_NR base pages mapped by the page table at base_addr, in the
+ * same mm, without splitting either side.
+ *
+ * The data of the base pages goes into the THP, which is then mapped huge
+ * at base_addr, the way collapse_huge_page() maps its new THP. The data of
+ * the THP goes into the base pages, mapped at thp_addr through the page
+ * table deposited for the THP, the way __split_huge_pmd_locked() maps the
+ * subpages. Whatever was hot in the base pages ends up huge-mapped on the
+ * node of the THP.
+ *
+ * Called with mmap_sem held for write, so that no fault can map anything
+ * in either range while their pmds are cleared.
+ */
+int exchange_huge_pmd_ptes(struct mm_struct *mm, unsigned long thp_addr,
+			unsigned long base_addr, enum migrate_mode mode)
+{
+	unsigned long thp_haddr = thp_addr & HPAGE_PMD_MASK;
+	unsigned long base_haddr = base_addr & HPAGE_PMD_MASK;
+	struct vm_area_struct *thp_vma, *base_vma;
+	pmd_t *thp_pmd, *base_pmd, _thp_pmd, _base_pmd, _pmd;
+	spinlock_t *thp_ptl, *base_ptl, *pte_ptl;
+	pgtable_t thp_pgtable, base_pgtable;
+	struct page **pages = NULL, **subpages = NULL;
+	struct page *thp;
+	bool write, young, writable = false;
+	bool thp_active, base_active = false;
+	int thp_cpupid;
+	unsigned long addr;
+	pgd_t *pgd;
+	pud_t *pud;
+	pte_t *pte;
+	int i, rc;
+
+	VM_BUG_ON(!rwsem_is_locked(&mm->mmap_sem));
+
+	if (thp_haddr == base_haddr)
+		return -EINVAL;
+
+	thp_vma = find_vma(mm, thp_haddr);
+	base_vma = find_vma(mm, base_haddr);
+	if (!exchange_pmd_vma_check(thp_vma, thp_haddr) ||
+		!exchange_pmd_vma_check(base_vma, base_haddr))
+		return -EFAULT;
+
+	pages = kmalloc_array(HPAGE_PMD_NR, sizeof(*pages), GFP_KERNEL);
+	subpages = kmalloc_array(HPAGE_PMD_NR, sizeof(*subpages), GFP_KERNEL);
+	rc = -ENOMEM;
+	if (!pages || !subpages)
+		goto out_free;
+
+	rc = -EFAULT;
+	pgd = pgd_offset(mm, thp_haddr);
+	if (!pgd_present(*pgd))
+		goto out_free;
+	pud = pud_offset(pgd, thp_haddr);
+	if (!pud_present(*pud))
+		goto out_free;
+	thp_pmd = pmd_offset(pud, thp_haddr);
+
+	base_pmd = mm_find_pmd(mm, base_haddr);
+	if (!base_pmd)
+		goto out_free;
+
+	/* the THP: mapped by its pmd only, and only there */
+	rc = -EBUSY;
+	thp_ptl = pmd_lock(mm, thp_pmd);
+	if (!pmd_present(*thp_pmd) || !pmd_trans_huge(*thp_pmd) ||
+		is_huge_zero_pmd(*thp_pmd)) {
+		spin_unlock(thp_ptl);
+		goto out_free;
+	}
+	thp = pmd_page(*thp_pmd);
+	if (!PageAnon(thp) || PageDoubleMap(thp) || total_mapcount(thp) != 1) {
+		spin_unlock(thp_ptl);
+		goto out_free;
+	}
+	get_page(thp);
+	spin_unlock(thp_ptl);
+
+	if (!trylock_page(thp))
+		goto out_put;
+	if (isolate_lru_page(thp)) {
+		unlock_page(thp);
+		goto out_put;
+	}
+	mod_zone_page_state(page_zone(thp), NR_ISOLATED_ANON, HPAGE_PMD_NR);
+	/* isolate_lru_page() holds its own reference */
+	put_page(thp);
+
+	/* the base pages, as collapse_huge_page() takes them */
+	anon_vma_lock_write(base_vma->anon_vma);
+
+	pte = pte_offset_map(base_pmd, base_haddr);
+	pte_ptl = pte_lockptr(mm, base_pmd);
+
+	mmu_notifier_invalidate_range_start(mm, base_haddr,
+					base_haddr + HPAGE_PMD_SIZE);
+	base_ptl = pmd_lock(mm, base_pmd);
+	_base_pmd = pmdp_collapse_flush(base_vma, base_haddr, base_pmd);
+	spin_unlock(base_ptl);
+	mmu_notifier_invalidate_range_end(mm, base_haddr,
+					base_haddr + HPAGE_PMD_SIZE);
+
+	spin_lock(pte_ptl);
+	rc = exchange_pmd_isolate_ptes(base_vma, base_haddr, pte,
+				page_memcg(thp), pages, &writable);
+	spin_unlock(pte_ptl);
+
+	if (!rc) {
+		rc = -EBUSY;
+		goto out_base_pmd;
+	}
+
+	/*
+	 * All pages are isolated and locked so anon_vma rmap
+	 * can't run anymore.
+	 */
+	anon_vma_unlock_write(base_vma->anon_vma);
+
+	mmu_notifier_invalidate_range_start(mm, thp_haddr,
+					thp_haddr + HPAGE_PMD_SIZE);
+	spin_lock(thp_ptl);
+	_thp_pmd = pmdp_huge_clear_flush(thp_vma, thp_haddr, thp_pmd);
+	write = pmd_write(_thp_pmd);
+	young = pmd_young(_thp_pmd);
+	thp_pgtable = pgtable_trans_huge_withdraw(mm, thp_pmd);
+	spin_unlock(thp_ptl);
+	mmu_notifier_invalidate_range_end(mm, thp_haddr,
+					thp_haddr + HPAGE_PMD_SIZE);
+
+	/* gup_fast cannot get to it anymore: 1 for the pmd, 1 for isolation */
+	if (page_count(thp) != 2) {
+		spin_lock(thp_ptl);
+		pgtable_trans_huge_deposit(mm, thp_pmd, thp_pgtable);
+		set_pmd_at(mm, thp_haddr, thp_pmd, _thp_pmd);
+		update_mmu_cache_pmd(thp_vma, thp_haddr, thp_pmd);
+		spin_unlock(thp_ptl);
+
+		exchange_pmd_release_pages(pages, HPAGE_PMD_NR);
+		anon_vma_lock_write(base_vma->anon_vma);
+		rc = -EBUSY;
+		goto out_base_pmd;
+	}
+
+	/* swap the data in bulk */
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		subpages[i] = thp + i;
+
+	rc = -EFAULT;
+	if (mode & MIGRATE_MT)
+		rc = exchange_page_lists_mt(subpages, pages, HPAGE_PMD_NR);
+	else if (mode & MIGRATE_DMA)
+		rc = exchange_page_lists_dma(subpages, pages, HPAGE_PMD_NR);
+	if (rc) {
+		for (i = 0; i < HPAGE_PMD_NR; i++) {
+			char *vfrom, *vto;
+
+			cond_resched();
+			vfrom = kmap_atomic(pages[i]);
+			vto = kmap_atomic(subpages[i]);
+			exchange_page_data(vto, vfrom, PAGE_SIZE);
+			kunmap_atomic(vto);
+			kunmap_atomic(vfrom);
+		}
+	}
+
+	thp_active = PageActive(thp);
+	thp_cpupid = page_cpupid_last(thp);
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		base_active |= PageActive(pages[i]);
+
+	/*
+	 * The page table of the base pages, emptied, becomes the one
+	 * deposited for the THP at base_addr.
+	 */
+	base_pgtable = pmd_pgtable(_base_pmd);
+	spin_lock(pte_ptl);
+	for (i = 0, addr = base_haddr; i < HPAGE_PMD_NR;
+		 i++, addr += PAGE_SIZE)
+		pte_clear(mm, addr, pte + i);
+	spin_unlock(pte_ptl);
+	pte_unmap(pte);
+
+	/*
+	 * and the one of the THP maps the base pages at thp_addr. Each page
+	 * is still mapped once, so its mapcount is left alone and only its
+	 * rmap moves.
+	 */
+	pmd_populate(mm, &_pmd, thp_pgtable);
+	spin_lock(thp_ptl);
+	for (i = 0, addr = thp_haddr; i < HPAGE_PMD_NR;
+		 i++, addr += PAGE_SIZE) {
+		pte_t entry;
+
+		entry = mk_pte(pages[i], thp_vma->vm_page_prot);
+		entry = maybe_mkwrite(entry, thp_vma);
+		if (!write)
+			entry = pte_wrprotect(entry);
+		if (!young)
+			entry = pte_mkold(entry);
+		/*
+		 * The page now holds data it has never written back, however
+		 * clean it was: like the THP below, it is mapped dirty, or
+		 * reclaim could drop it as a clean MADV_FREE page.
+		 */
+		entry = pte_mkdirty(entry);
+		SetPageDirty(pages[i]);
+
+		exchange_pmd_move_anon_rmap(pages[i], thp_vma, addr);
+		page_cpupid_xchg_last(pages[i], thp_cpupid);
+		if (thp_active)
+			SetPageActive(pages[i]);
+		else
+			ClearPageActive(pages[i]);
+
+		pte = pte_offset_map(&_pmd, addr);
+		BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, addr, pte, entry);
+		pte_unmap(pte);
+	}
+	smp_wmb(); /* make pte visible before pmd */
+	pmd_populate(mm, thp_pmd, thp_pgtable);
+	spin_unlock(thp_ptl);
+
+	_pmd = mk_huge_pmd(thp, base_vma->vm_page_prot);
+	_pmd = pmd_mkdirty(_pmd);
+	if (writable)
+		_pmd = maybe_pmd_mkwrite(_pmd, base_vma);
+	if (base_active)
+		SetPageActive(thp);
+	else
+		ClearPageActive(thp);
+
+	/*
+	 * spin_lock() below is not the equivalent of smp_wmb(), so
+	 * this is needed to avoid the exchange writes to become
+	 * visible after the set_pmd_at() write.
+	 */
+	smp_wmb();
+
+	spin_lock(base_ptl);
+	BUG_ON(!pmd_none(*base_pmd));
+	exchange_pmd_move_anon_rmap(thp, base_vma, base_haddr);
+	pgtable_trans_huge_deposit(mm, base_pmd, base_pgtable);
+	set_pmd_at(mm, base_haddr, base_pmd, _pmd);
+	update_mmu_cache_pmd(base_vma, base_haddr, base_pmd);
+	spin_unlock(base_ptl);
+
+	exchange_pmd_release_pages(pages, HPAGE_PMD_NR);
+	rc = 0;
+	goto out_thp;
+
+out_base_pmd:
+	pte_unmap(pte);
+	spin_lock(base_ptl);
+	BUG_ON(!pmd_none(*base_pmd));
+	/*
+	 * We can only use set_pmd_at when establishing
+	 * hugepmds and never for establishing regular pmds that
+	 * points to regular pagetables. Use pmd_populate for that
+	 */
+	pmd_populate(mm, base_pmd, pmd_pgtable(_base_pmd));
+	spin_unlock(base_ptl);
+	anon_vma_unlock_write(base_vma->anon_vma);
+out_thp:
+	mod_zone_page_state(page_zone(thp), NR_ISOLATED_ANON, -HPAGE_PMD_NR);
+	unlock_page(thp);
+	putback_lru_page(thp);
+	goto out_free;
+out_put:
+	put_page(thp);
+out_free:
+	kfree(subpages);
+	kfree(pages);
+	return rc;
+}
+
 static int khugepaged_scan_pmd(struct mm_struct *mm,
 			       struct vm_area_struct *vma,
 			       unsigned long address,
@@ -3598,9 +3962,14 @@ late_initcall(split_huge_pages_debugfs);
 #endif
 
 #ifdef CONFIG_ARCH_ENABLE_THP_MIGRATION
-int set_pmd_migration_entry(struct page *page, struct mm_struct *mm,
-				unsigned long addr)
+/*
+ * With TTU_BATCH_FLUSH the TLB flush is left to try_to_unmap_flush(), as
+ * try_to_unmap_one() does for ptes.
+ */
+int set_pmd_migration_entry(struct page *page, struct vm_area_struct *vma,
+				unsigned long addr, enum ttu_flags flags)
 {
+	struct mm_struct *mm = vma->vm_mm;
 	pte_t *pte;
 	pmd_t *pmd;
 	pmd_t pmdval;
@@ -3613,7 +3982,15 @@ int set_pmd_migration_entry(struct page *page, struct mm_struct *mm,
 		goto out;
 	if (pte)
 		goto out;
-	pmdval = pmdp_huge_get_and_clear(mm, addr, pmd);
+	flush_cache_range(vma, addr, addr + HPAGE_PMD_SIZE);
+	if (should_defer_flush(mm, flags)) {
+		pmdval = pmdp_huge_get_and_clear(mm, addr, pmd);
+		set_tlb_ubc_flush_pending(mm, page, pmd_dirty(pmdval));
+	} else
+		pmdval = pmdp_huge_clear_flush(vma, addr, pmd);
+	/* Move the dirty bit to the physical page now the pmd is gone. */
+	if (pmd_dirty(pmdval))
+		set_page_dirty(page);
 	entry = make_migration_entry(page, pmd_write(pmdval));
 	pmdswp = swp_entry_to_pmd(entry);
 	pmdswp = pmd_mkhuge(pmdswp);
@@ -3639,7 +4016,6 @@ int remove_migration_pmd(struct page *new, struct vm_area_struct *vma,
 	pmd_t pmde;
 	swp_entry_t entry;
 	unsigned long mmun_start = addr & HPAGE_PMD_MASK;
-	unsigned long mmun_end = mmun_start + HPAGE_PMD_SIZE;
 
 	pgd = pgd_offset(mm, addr);
 	if (!pgd_present(*pgd))
@@ -3663,11 +4039,12 @@ int remove_migration_pmd(struct page *new, struct vm_area_struct *vma,
 		pmde = pmd_mksoft_dirty(pmde);
 	if (is_write_migration_entry(entry))
 		pmde = maybe_pmd_mkwrite(pmde, vma);
-	flush_cache_range(vma, mmun_start, mmun_end);
 	page_add_anon_rmap(new, vma, mmun_start, true);
-	pmdp_huge_clear_flush_notify(vma, mmun_start, pmd);
+	/*
+	 * A migration entry is never cached by the TLB, so it can be
+	 * replaced without a flush, as remove_migration_pte() does.
+	 */
 	set_pmd_at(mm, mmun_start, pmd, pmde);
-	flush_tlb_range(vma, mmun_start, mmun_end);
 	if (vma->vm_flags & VM_LOCKED)
 		mlock_vma_page(new);
 	update_mmu_cache_pmd(vma, addr, pmd);
@@ -1660,6 +1660,33 @@ struct page *alloc_huge_page_node(struct hstate *h, int nid)
 	return page;
 }
 
+/*
+ * Take up to @nr free huge pages of node @nid off the pool under a single
+ * hold of hugetlb_lock and queue them on @list, for callers about to need
+ * many pages at once like a batched migration. Returns the number of pages
+ * queued; the caller gets the rest with alloc_huge_page_node() and returns
+ * the unused ones with putback_active_hugepage().
+ */
+int alloc_huge_pages_node(struct hstate *h, int nid, int nr,
+			struct list_head *list)
+{
+	struct page *page;
+	int allocated = 0;
+
+	spin_lock(&hugetlb_lock);
+	while (allocated < nr &&
+	       h->free_huge_pages - h->resv_huge_pages > 0) {
+		page = dequeue_huge_page_node(h, nid);
+		if (!page)
+			break;
+		list_move_tail(&page->lru, list);
+		allocated++;
+	}
+	spin_unlock(&hugetlb_lock);
+
+	return allocated;
+}
+
 /*
  * Increase the hugetlb pool such that it can accommodate a reservation
  * of size 'delta'.
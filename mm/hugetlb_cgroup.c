@@ -433,6 +433,27 @@ void hugetlb_cgroup_migrate(struct page *oldhpage, struct page *newhpage)
 	return;
 }
 
+/*
+ * Two hugepages swapping their contents also swap their charges, the same
+ * way hugetlb_cgroup_migrate() moves the charge to the new page.
+ */
+void hugetlb_cgroup_exchange(struct page *hpage1, struct page *hpage2)
+{
+	struct hugetlb_cgroup *h_cg1, *h_cg2;
+
+	if (hugetlb_cgroup_disabled())
+		return;
+
+	VM_BUG_ON_PAGE(!PageHuge(hpage1), hpage1);
+	VM_BUG_ON_PAGE(!PageHuge(hpage2), hpage2);
+	spin_lock(&hugetlb_lock);
+	h_cg1 = hugetlb_cgroup_from_page(hpage1);
+	h_cg2 = hugetlb_cgroup_from_page(hpage2);
+	set_hugetlb_cgroup(hpage1, h_cg2);
+	set_hugetlb_cgroup(hpage2, h_cg1);
+	spin_unlock(&hugetlb_lock);
+}
+
 struct cgroup_subsys hugetlb_cgrp_subsys = {
 	.css_alloc	= hugetlb_cgroup_css_alloc,
 	.css_offline	= hugetlb_cgroup_css_offline,
@@ -471,6 +471,9 @@ struct tlbflush_unmap_batch;
 #ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
 void try_to_unmap_flush(void);
 void try_to_unmap_flush_dirty(void);
+void set_tlb_ubc_flush_pending(struct mm_struct *mm,
+		struct page *page, bool writable);
+bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags);
 #else
 static inline void try_to_unmap_flush(void)
 {
@@ -478,6 +481,15 @@ static inline void try_to_unmap_flush(void)
 static inline void try_to_unmap_flush_dirty(void)
 {
 }
+static inline void set_tlb_ubc_flush_pending(struct mm_struct *mm,
+		struct page *page, bool writable)
+{
+}
+static inline bool should_defer_flush(struct mm_struct *mm,
+		enum ttu_flags flags)
+{
+	return false;
+}
 
 #endif /* CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH */
 
@@ -485,14 +497,71 @@ extern const struct trace_print_flags pageflag_names[];
 extern const struct trace_print_flags vmaflag_names[];
 extern const struct trace_print_flags gfpflag_names[];
 
+/*
+ * Number of base pages of a page being migrated. Unlike hpage_nr_pages()
+ * this is right for hugetlb pages of any size, gigantic ones included.
+ */
+static inline int migrate_nr_pages(struct page *page)
+{
+	return 1 << compound_order(page);
+}
+
+/*
+ * Page copies of at least this many pages bypass the cache for the
+ * destination, see copy_page_nocache().
+ */
+#define COPY_NOCACHE_MIN_PAGES	16
 
 extern int copy_page_lists_dma_always(struct page **to, 
 			struct page **from, int nr_pages);
+typedef void (*dma_copy_done_t)(void *arg, int err);
+extern int copy_page_lists_dma_async(struct page **to,
+			struct page **from, int nr_pages,
+			dma_copy_done_t done, void *arg);
 extern int copy_page_lists_mt(struct page **to, 
 			struct page **from, int nr_pages);
+extern int copy_page_lists_auto(struct page **to,
+			struct page **from, int nr_pages);
+extern int copy_workers_nr(int nid);
+
+struct exchange_page_info {
+	struct page *from_page;
+	struct page *to_page;
+
+	struct anon_vma *from_anon_vma;
+	struct anon_vma *to_anon_vma;
+
+	/* from_page is exchanged again next, so it stays isolated */
+	bool keep_from_page;
+	bool exchanged;
+
+	struct list_head list;
+};
 
+extern bool page_exchangeable(struct page *page);
+extern int exchange_pages_concur(struct list_head *exchange_list,
+			enum migrate_mode mode, int reason);
+extern void exchange_page_data(char *to, char *from, unsigned long len);
 extern int exchange_page_mt(struct page *to, struct page *from, int nr_pages);
 extern int exchange_page_lists_mt(struct page **to, 
 						  struct page **from, 
 						  int nr_pages);
+extern int exchange_page_lists_dma(struct page **to,
+			struct page **from, int nr_pages);
+extern int exchange_page_lists_dma_async(struct page **to,
+			struct page **from, int nr_pages,
+			dma_copy_done_t done, void *arg);
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+extern int exchange_huge_pmd_ptes(struct mm_struct *mm,
+			unsigned long thp_addr, unsigned long base_addr,
+			enum migrate_mode mode);
+#else
+static inline int exchange_huge_pmd_ptes(struct mm_struct *mm,
+			unsigned long thp_addr, unsigned long base_addr,
+			enum migrate_mode mode)
+{
+	return -ENOSYS;
+}
+#endif
 #endif	/* __MM_INTERNAL_H */
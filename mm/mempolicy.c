@@ -1049,6 +1049,13 @@ static int migrate_to_node(struct mm_struct *mm, int source, int dest,
 	if (!list_empty(&pagelist)) {
 		err = migrate_pages(&pagelist, new_node_page, NULL, dest,
 					MIGRATE_SYNC, MR_SYSCALL);
+		if (err == -ENOMEM) {
+			nodemask_t nodes = nodemask_of_node(dest);
+
+			if (!exchange_pages_to_nodes(&pagelist, &nodes,
+						MIGRATE_SYNC))
+				err = 0;
+		}
 		if (err)
 			putback_movable_pages(&pagelist);
 	}
@@ -1199,6 +1206,27 @@ static struct page *new_page(struct page *page, unsigned long start, int **x)
 	 */
 	return alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, address);
 }
+
+/*
+ * new_page() found no free memory left on the nodes of the new policy for
+ * the pages still on @pagelist: exchange them with cold pages there.
+ */
+static int mbind_exchange_pages(struct list_head *pagelist,
+				struct mempolicy *pol)
+{
+	nodemask_t nodes;
+
+	if (!pol || (pol->flags & MPOL_F_LOCAL))
+		return -ENOMEM;
+
+	if (pol->mode == MPOL_PREFERRED)
+		nodes = nodemask_of_node(pol->v.preferred_node);
+	else
+		nodes = pol->v.nodes;
+
+	return exchange_pages_to_nodes(pagelist, &nodes, MIGRATE_SYNC) ?
+		-ENOMEM : 0;
+}
 #else
 
 static void migrate_page_add(struct page *page, struct list_head *pagelist,
@@ -1216,6 +1244,12 @@ static struct page *new_page(struct page *page, unsigned long start, int **x)
 {
 	return NULL;
 }
+
+static int mbind_exchange_pages(struct list_head *pagelist,
+				struct mempolicy *pol)
+{
+	return -ENOMEM;
+}
 #endif
 
 static long do_mbind(unsigned long start, unsigned long len,
@@ -1299,6 +1333,8 @@ static long do_mbind(unsigned long start, unsigned long len,
 			WARN_ON_ONCE(flags & MPOL_MF_LAZY);
 			nr_failed = migrate_pages(&pagelist, new_page, NULL,
 				start, MIGRATE_SYNC, MR_MEMPOLICY_MBIND);
+			if (nr_failed == -ENOMEM)
+				nr_failed = mbind_exchange_pages(&pagelist, new);
 			if (nr_failed)
 				putback_movable_pages(&pagelist);
 		}
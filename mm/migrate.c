@@ -39,6 +39,14 @@
 #include <linux/mmu_notifier.h>
 #include <linux/page_idle.h>
 #include <linux/page_owner.h>
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/mempool.h>
+#include <linux/sort.h>
 
 #include <asm/tlbflush.h>
 
@@ -48,12 +56,22 @@
 #include "internal.h"
 
 int accel_page_migration = 1;
+int precopy_thp_migration = 0;
+int rdonly_page_migration = 0;
+int numa_exchange_migration = 0;
 
 
 struct page_migration_work_item {
 	struct page *old_page;
 	struct page *new_page;
 	struct anon_vma *anon_vma;
+	int *result;
+	/* buffers moved to new_page, locked until the data is copied */
+	struct buffer_head *buffers;
+	/* result of __unmap_page_concur() */
+	int rc;
+	/* new_page already holds the data, see precopy_thp_concur() */
+	bool precopied;
 	struct list_head list;
 };
 
@@ -338,6 +356,108 @@ static inline bool buffer_migrate_lock_buffers(struct buffer_head *head,
 }
 #endif /* CONFIG_BLOCK */
 
+/*
+ * Freeze the references of page in mapping at expected_count, if it still
+ * has exactly that many and is still in the mapping. Called with tree_lock
+ * held. Returns the radix tree slot of page, NULL if it is busy.
+ */
+static void **migrate_mapping_freeze_page(struct address_space *mapping,
+				struct page *page, int expected_count)
+{
+	void **pslot;
+
+	pslot = radix_tree_lookup_slot(&mapping->page_tree,
+					page_index(page));
+
+	if (page_count(page) != expected_count ||
+		radix_tree_deref_slot_protected(pslot, &mapping->tree_lock) != page)
+		return NULL;
+
+	if (!page_ref_freeze(page, expected_count))
+		return NULL;
+
+	return pslot;
+}
+
+/*
+ * Put newpage in the place of page, frozen by migrate_mapping_freeze_page(),
+ * and drop the cache reference of page. Called with tree_lock held.
+ * Returns whether page was dirty, for migrate_mapping_move_stats().
+ */
+static int migrate_mapping_replace_page(void **pslot, struct page *newpage,
+				struct page *page, int expected_count)
+{
+	int dirty;
+
+	/*
+	 * Now we know that no one else is looking at the page:
+	 * no turning back from here.
+	 */
+	newpage->index = page->index;
+	newpage->mapping = page->mapping;
+	if (PageSwapBacked(page))
+		__SetPageSwapBacked(newpage);
+
+	get_page(newpage);	/* add cache reference */
+	if (PageSwapCache(page)) {
+		SetPageSwapCache(newpage);
+		set_page_private(newpage, page_private(page));
+	}
+
+	/* Move dirty while page refs frozen and newpage not yet exposed */
+	dirty = PageDirty(page);
+	if (dirty) {
+		ClearPageDirty(page);
+		SetPageDirty(newpage);
+	}
+
+	radix_tree_replace_slot(pslot, newpage);
+
+	/*
+	 * Drop cache reference from old page by unfreezing
+	 * to one less reference.
+	 * We know this isn't the last reference.
+	 */
+	page_ref_unfreeze(page, expected_count - 1);
+
+	return dirty;
+}
+
+/*
+ * If moved to a different zone then also account
+ * the page for that zone. Other VM counters will be
+ * taken care of when we establish references to the
+ * new page and drop references to the old page.
+ *
+ * Note that anonymous pages are accounted for
+ * via NR_FILE_PAGES and NR_ANON_PAGES if they
+ * are mapped to swap space. hugetlbfs pages are not accounted, see
+ * migrate_huge_page_move_mapping().
+ *
+ * Called with irqs disabled.
+ */
+static void migrate_mapping_move_stats(struct address_space *mapping,
+				struct page *newpage, struct page *page,
+				int dirty)
+{
+	struct zone *oldzone = page_zone(page);
+	struct zone *newzone = page_zone(newpage);
+
+	if (newzone == oldzone || PageHuge(page))
+		return;
+
+	__dec_zone_state(oldzone, NR_FILE_PAGES);
+	__inc_zone_state(newzone, NR_FILE_PAGES);
+	if (PageSwapBacked(page) && !PageSwapCache(page)) {
+		__dec_zone_state(oldzone, NR_SHMEM);
+		__inc_zone_state(newzone, NR_SHMEM);
+	}
+	if (dirty && mapping_cap_account_dirty(mapping)) {
+		__dec_zone_state(oldzone, NR_FILE_DIRTY);
+		__inc_zone_state(newzone, NR_FILE_DIRTY);
+	}
+}
+
 /*
  * Replace the page in the mapping.
  *
@@ -351,7 +471,6 @@ int migrate_page_move_mapping(struct address_space *mapping,
 		struct buffer_head *head, enum migrate_mode mode,
 		int extra_count)
 {
-	struct zone *oldzone, *newzone;
 	int dirty;
 	int expected_count = 1 + extra_count;
 	void **pslot;
@@ -370,22 +489,11 @@ int migrate_page_move_mapping(struct address_space *mapping,
 		return MIGRATEPAGE_SUCCESS;
 	}
 
-	oldzone = page_zone(page);
-	newzone = page_zone(newpage);
-
 	spin_lock_irq(&mapping->tree_lock);
 
-	pslot = radix_tree_lookup_slot(&mapping->page_tree,
- 					page_index(page));
-
 	expected_count += 1 + page_has_private(page);
-	if (page_count(page) != expected_count ||
-		radix_tree_deref_slot_protected(pslot, &mapping->tree_lock) != page) {
-		spin_unlock_irq(&mapping->tree_lock);
-		return -EAGAIN;
-	}
-
-	if (!page_ref_freeze(page, expected_count)) {
+	pslot = migrate_mapping_freeze_page(mapping, page, expected_count);
+	if (!pslot) {
 		spin_unlock_irq(&mapping->tree_lock);
 		return -EAGAIN;
 	}
@@ -404,62 +512,13 @@ int migrate_page_move_mapping(struct address_space *mapping,
 		return -EAGAIN;
 	}
 
-	/*
-	 * Now we know that no one else is looking at the page:
-	 * no turning back from here.
-	 */
-	newpage->index = page->index;
-	newpage->mapping = page->mapping;
-	if (PageSwapBacked(page))
-		__SetPageSwapBacked(newpage);
-
-	get_page(newpage);	/* add cache reference */
-	if (PageSwapCache(page)) {
-		SetPageSwapCache(newpage);
-		set_page_private(newpage, page_private(page));
-	}
-
-	/* Move dirty while page refs frozen and newpage not yet exposed */
-	dirty = PageDirty(page);
-	if (dirty) {
-		ClearPageDirty(page);
-		SetPageDirty(newpage);
-	}
-
-	radix_tree_replace_slot(pslot, newpage);
-
-	/*
-	 * Drop cache reference from old page by unfreezing
-	 * to one less reference.
-	 * We know this isn't the last reference.
-	 */
-	page_ref_unfreeze(page, expected_count - 1);
+	dirty = migrate_mapping_replace_page(pslot, newpage, page,
+					expected_count);
 
 	spin_unlock(&mapping->tree_lock);
 	/* Leave irq disabled to prevent preemption while updating stats */
 
-	/*
-	 * If moved to a different zone then also account
-	 * the page for that zone. Other VM counters will be
-	 * taken care of when we establish references to the
-	 * new page and drop references to the old page.
-	 *
-	 * Note that anonymous pages are accounted for
-	 * via NR_FILE_PAGES and NR_ANON_PAGES if they
-	 * are mapped to swap space.
-	 */
-	if (newzone != oldzone) {
-		__dec_zone_state(oldzone, NR_FILE_PAGES);
-		__inc_zone_state(newzone, NR_FILE_PAGES);
-		if (PageSwapBacked(page) && !PageSwapCache(page)) {
-			__dec_zone_state(oldzone, NR_SHMEM);
-			__inc_zone_state(newzone, NR_SHMEM);
-		}
-		if (dirty && mapping_cap_account_dirty(mapping)) {
-			__dec_zone_state(oldzone, NR_FILE_DIRTY);
-			__inc_zone_state(newzone, NR_FILE_DIRTY);
-		}
-	}
+	migrate_mapping_move_stats(mapping, newpage, page, dirty);
 	local_irq_enable();
 
 	return MIGRATEPAGE_SUCCESS;
@@ -511,28 +570,39 @@ int migrate_huge_page_move_mapping(struct address_space *mapping,
  * Gigantic pages are so large that we do not guarantee that page++ pointer
  * arithmetic will work across the entire page.  We need something more
  * specialized.
+ *
+ * The DMA and multi-threaded copies are handed one MAX_ORDER block at a
+ * time, inside which page++ still works; a block they fail on is copied
+ * by the CPU.
  */
 static void __copy_gigantic_page(struct page *dst, struct page *src,
 				int nr_pages, enum migrate_mode mode)
 {
-	int i;
+	int i, j;
 	struct page *dst_base = dst;
 	struct page *src_base = src;
-	int rc = -EFAULT;
+	int nr_chunk;
+	int rc;
 
 	for (i = 0; i < nr_pages; ) {
+		nr_chunk = min_t(int, nr_pages - i, MAX_ORDER_NR_PAGES);
+		rc = -EFAULT;
+
 		cond_resched();
 
 		if (mode & MIGRATE_DMA)
-			rc = copy_page_dma(dst, src, 1);
+			rc = copy_page_dma(dst, src, nr_chunk);
 
 		if (rc && (mode & MIGRATE_MT))
-			rc = copy_page_mt(dst, src, 1);
+			rc = copy_page_mt(dst, src, nr_chunk);
 
 		if (rc)
-			copy_highpage(dst, src);
+			for (j = 0; j < nr_chunk; j++) {
+				cond_resched();
+				copy_highpage_nocache(dst + j, src + j);
+			}
 
-		i++;
+		i += nr_chunk;
 		dst = mem_map_next(dst, dst_base, i);
 		src = mem_map_next(src, src_base, i);
 	}
@@ -549,24 +619,30 @@ static void copy_huge_page(struct page *dst, struct page *src,
 		/* hugetlbfs page */
 		struct hstate *h = page_hstate(src);
 		nr_pages = pages_per_huge_page(h);
-
-		if (unlikely(nr_pages > MAX_ORDER_NR_PAGES)) {
-			__copy_gigantic_page(dst, src, nr_pages, mode);
-			return;
-		}
 	} else {
 		/* thp page */
 		BUG_ON(!PageTransHuge(src));
 		nr_pages = hpage_nr_pages(src);
 	}
 
-	/* Try to accelerate page migration if it is not specified in mode  */
+	/*
+	 * Try to accelerate page migration if it is not specified in mode,
+	 * with whatever copy_page_lists_auto() finds fastest for this size
+	 * and node pair.
+	 */
 	if (accel_page_migration &&
 		!(mode & (MIGRATE_DMA|MIGRATE_MT))) {
+		if (!copy_page_lists_auto(&dst, &src, 1))
+			return;
 		mode |= MIGRATE_DMA;
 		mode |= MIGRATE_MT;
 	}
 
+	if (unlikely(nr_pages > MAX_ORDER_NR_PAGES)) {
+		__copy_gigantic_page(dst, src, nr_pages, mode);
+		return;
+	}
+
 	if (mode & MIGRATE_DMA)
 		rc = copy_page_dma(dst, src, nr_pages);
 
@@ -576,23 +652,26 @@ static void copy_huge_page(struct page *dst, struct page *src,
 	if (rc)
 		for (i = 0; i < nr_pages; i++) {
 			cond_resched();
-			copy_highpage(dst + i, src + i);
+			if (nr_pages >= COPY_NOCACHE_MIN_PAGES)
+				copy_highpage_nocache(dst + i, src + i);
+			else
+				copy_highpage(dst + i, src + i);
 		}
 }
 
-/*
- * Copy the page to its new location
- */
-void migrate_page_copy(struct page *newpage, struct page *page, 
+static void migrate_page_copy_data(struct page *newpage, struct page *page,
 					   enum migrate_mode mode)
 {
-	int cpupid;
 	int rc = -EFAULT;
 
 	if (PageHuge(page) || PageTransHuge(page))
 		copy_huge_page(newpage, page, mode);
 	else {
-		if (mode & MIGRATE_DMA)
+		if (accel_page_migration &&
+			!(mode & (MIGRATE_DMA|MIGRATE_MT)))
+			rc = copy_page_lists_auto(&newpage, &page, 1);
+
+		if (rc && (mode & MIGRATE_DMA))
 			rc = copy_page_dma(newpage, page, 1);
 
 		if (rc && (mode & MIGRATE_MT))
@@ -601,6 +680,18 @@ void migrate_page_copy(struct page *newpage, struct page *page,
 		if (rc)
 			copy_highpage(newpage, page);
 	}
+}
+
+/*
+ * Copy the page to its new location
+ */
+void migrate_page_copy(struct page *newpage, struct page *page, 
+					   enum migrate_mode mode)
+{
+	int cpupid;
+
+	if (!(mode & MIGRATE_NOCOPY))
+		migrate_page_copy_data(newpage, page, mode);
 
 	if (PageError(page))
 		SetPageError(newpage);
@@ -731,7 +822,7 @@ int buffer_migrate_page(struct address_space *mapping,
 
 	SetPagePrivate(newpage);
 
-	migrate_page_copy(newpage, page, 0);
+	migrate_page_copy(newpage, page, mode & MIGRATE_NOCOPY);
 
 	bh = head;
 	do {
@@ -856,6 +947,30 @@ static int move_to_new_page(struct page *newpage, struct page *page,
 	return rc;
 }
 
+/*
+ * With MIGRATE_RDONLY, the data of a mapped page is copied while the page
+ * is mapped read-only rather than behind migration entries: faults to read
+ * the page do not wait for the copy, while writes wait on the page lock.
+ * Migration entries are then only installed to move the mapping. The new
+ * page is mapped read-only, so its first write takes a write fault.
+ *
+ * Only base pages qualify, and only if page_wrprotect() finds that every
+ * write fault on them takes the page lock: a THP mapped once by a PMD, or
+ * a page in a shared mapping without ->page_mkwrite (shmem for one), is
+ * made writable again without it, and a write during the copy would be
+ * lost. Those, hugetlb and KSM pages are migrated as usual.
+ */
+static bool migrate_page_wrprotect(struct page *page, enum migrate_mode mode)
+{
+	if (!(mode & MIGRATE_RDONLY))
+		return false;
+
+	if (PageHuge(page) || PageKsm(page) || PageTransHuge(page))
+		return false;
+
+	return page_wrprotect(page);
+}
+
 static int __unmap_and_move(struct page *page, struct page *newpage,
 				int force, enum migrate_mode mode)
 {
@@ -964,6 +1079,10 @@ static int __unmap_and_move(struct page *page, struct page *newpage,
 		/* Establish migration ptes */
 		VM_BUG_ON_PAGE(PageAnon(page) && !PageKsm(page) && !anon_vma,
 				page);
+		if (migrate_page_wrprotect(page, mode)) {
+			migrate_page_copy_data(newpage, page, mode);
+			mode |= MIGRATE_NOCOPY;
+		}
 		try_to_unmap(page,
 			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
 		page_was_mapped = 1;
@@ -1188,12 +1307,144 @@ out:
 	return rc;
 }
 
+/*
+ * Copy a page from an unmap lane, see precopy_thp_concur() and
+ * migrate_page_wrprotect(). Lanes run on migrate_lane_wq, not on the copy
+ * workers, so copy_huge_page() may pick any copy method.
+ */
+static void copy_page_lane_concur(struct page *newpage, struct page *page)
+{
+	if (PageTransHuge(page))
+		copy_huge_page(newpage, page, 0);
+	else
+		copy_highpage(newpage, page);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Pre-copy of THPs, with precopy_thp_migration set: the data of a THP is
+ * copied while the page is still mapped, so the application only waits on
+ * the migration entry for the time of a TLB flush. Its PMD is cleaned
+ * before the copy, and the page is copied again once unmapped only if the
+ * PMD was dirtied in between. A PMD has a single dirty bit, so a THP
+ * written during the pre-copy is copied again as a whole.
+ *
+ * Only anonymous THPs mapped by a single PMD are pre-copied: the dirty
+ * state of any other mapping could not be tracked.
+ */
+struct precopy_thp_control {
+	bool dirty;
+	bool failed;
+};
+
+static int precopy_thp_clean_one(struct page *page, struct vm_area_struct *vma,
+				unsigned long address, void *arg)
+{
+	struct precopy_thp_control *pc = arg;
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	int ret = SWAP_AGAIN;
+	pmd_t *pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+	pmd_t entry;
+
+	/*
+	 * ->invalidate_range alone leaves the sptes of KVM in place, and a
+	 * guest write through them would not dirty the PMD.
+	 */
+	mmu_notifier_invalidate_range_start(mm, haddr, haddr + HPAGE_PMD_SIZE);
+
+	if (!page_check_address_transhuge(page, mm, address, &pmd, &pte, &ptl))
+		goto out;
+
+	if (pte) {
+		/* split since we checked the mapcount */
+		pte_unmap_unlock(pte, ptl);
+		pc->failed = true;
+		ret = SWAP_FAIL;
+		goto out;
+	}
+
+	/*
+	 * As in madvise_free_huge_pmd(), the PMD is cleared only under the
+	 * PMD lock, which a fault has to take before it can fill it again.
+	 * The flush makes the CPUs set the dirty bit in memory on their next
+	 * write.
+	 */
+	flush_cache_range(vma, address, address + HPAGE_PMD_SIZE);
+	entry = pmdp_huge_clear_flush_notify(vma, address, pmd);
+	if (pmd_dirty(entry))
+		pc->dirty = true;
+	set_pmd_at(mm, address, pmd, pmd_mkclean(entry));
+
+	spin_unlock(ptl);
+out:
+	mmu_notifier_invalidate_range_end(mm, haddr, haddr + HPAGE_PMD_SIZE);
+
+	return ret;
+}
+
+/*
+ * Clean the PMD of a locked THP and copy the page while it stays mapped.
+ * PageDirty is cleared so that set_pmd_migration_entry() tells whether
+ * the page was written since; the dirty state of the page before the
+ * pre-copy is returned in *dirty, to be put back by the caller.
+ */
+static bool precopy_thp_concur(struct page *page, struct page *newpage,
+				bool *dirty)
+{
+	struct precopy_thp_control pc = {
+		.dirty = false,
+		.failed = false,
+	};
+	struct rmap_walk_control rwc = {
+		.rmap_one = precopy_thp_clean_one,
+		.arg = &pc,
+	};
+
+	if (!precopy_thp_migration || PageHuge(page) || !PageTransHuge(page) ||
+		!PageAnon(page) || PageSwapCache(page) ||
+		!PageTransHuge(newpage))
+		return false;
+
+	if (total_mapcount(page) != 1 || compound_mapcount(page) != 1)
+		return false;
+
+	rmap_walk(page, &rwc);
+
+	*dirty = pc.dirty || PageDirty(page);
+
+	if (pc.failed) {
+		if (pc.dirty)
+			set_page_dirty(page);
+		return false;
+	}
+
+	ClearPageDirty(page);
+
+	copy_page_lane_concur(newpage, page);
+
+	return true;
+}
+#else
+static bool precopy_thp_concur(struct page *page, struct page *newpage,
+				bool *dirty)
+{
+	return false;
+}
+#endif
+
 static int __unmap_page_concur(struct page *page, struct page *newpage,
-				struct anon_vma **anon_vma,
+				struct anon_vma **anon_vma, bool *precopied,
 				int force, enum migrate_mode mode)
 {
 	int rc = -EAGAIN;
+	bool dirty = false;
+	bool tracked = false;
+
 	*anon_vma = NULL;
+	*precopied = false;
 
 	if (!trylock_page(page)) {
 		if (!force || mode == MIGRATE_ASYNC)
@@ -1218,8 +1469,16 @@ static int __unmap_page_concur(struct page *page, struct page *newpage,
 		lock_page(page);
 	}
 
-	/* We are working on page_mapping(page) == NULL */
-	VM_BUG_ON_PAGE(PageWriteback(page), page);
+	if (PageWriteback(page)) {
+		/* Same as __unmap_and_move(), only full sync migration waits */
+		if (!(mode & MIGRATE_SYNC)) {
+			rc = -EBUSY;
+			goto out_unlock;
+		}
+		if (!force)
+			goto out_unlock;
+		wait_on_page_writeback(page);
+	}
 
 	/*
 	 * By try_to_unmap(), page->mapcount goes down to 0 here. In this case,
@@ -1279,16 +1538,47 @@ static int __unmap_page_concur(struct page *page, struct page *newpage,
 			try_to_free_buffers(page);
 			goto out_unlock_both;
 		}
-	} else {
-		VM_BUG_ON_PAGE(!page_mapped(page), page);
+	} else if (page_mapped(page)) {
 		/* Establish migration ptes */
 		VM_BUG_ON_PAGE(PageAnon(page) && !PageKsm(page) && !*anon_vma,
 				page);
-		rc = try_to_unmap(page,
-			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
+
+		if (migrate_page_wrprotect(page, mode)) {
+			copy_page_lane_concur(newpage, page);
+			*precopied = true;
+		} else
+			*precopied = tracked = precopy_thp_concur(page,
+						newpage, &dirty);
+
+		/*
+		 * The TLB flush is deferred to the end of the lane, see
+		 * unmap_lane_concur(), so a whole lane costs a single
+		 * shootdown. hugetlb pages are not batched by try_to_unmap()
+		 * and flush right away.
+		 */
+		try_to_unmap(page,
+			TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS|
+			(PageHuge(page) ? 0 : TTU_BATCH_FLUSH));
+
+		/* written during the pre-copy: copy the page again */
+		if (tracked) {
+			if (PageDirty(page))
+				*precopied = false;
+			if (dirty)
+				SetPageDirty(page);
+		}
+
+		/*
+		 * Unlike the serial path, the page stays locked until its batch
+		 * is copied, so do not keep a half unmapped page around.
+		 */
+		if (page_mapped(page)) {
+			remove_migration_ptes(page, page, false);
+			goto out_unlock_both;
+		}
 	}
 
-	return rc;
+	return MIGRATEPAGE_SUCCESS;
 
 out_unlock_both:
 	unlock_page(newpage);
@@ -1301,95 +1591,298 @@ out:
 	return rc;
 }
 
-static int unmap_pages_and_get_new_concur(new_page_t get_new_page,
-				free_page_t put_new_page, unsigned long private,
-				struct page_migration_work_item *item, 
-				int force,
-				enum migrate_mode mode, int reason)
+/* Give an isolated old page back, off the migration list */
+static void putback_old_page_concur(struct page *page)
 {
-	int rc = MIGRATEPAGE_SUCCESS;
-	int *result = NULL;
-
-	
-	item->new_page = get_new_page(item->old_page, private, &result);
-
-	if (!item->new_page) {
-		rc = -ENOMEM;
-		return rc;
+	if (PageHuge(page)) {
+		putback_active_hugepage(page);
+		return;
 	}
 
-	if (page_count(item->old_page) == 1) {
-		rc = -ECANCELED;
-		goto out;
-	}
+	list_del(&page->lru);
+	dec_zone_page_state(page, NR_ISOLATED_ANON +
+			page_is_file_cache(page));
 
-	if (unlikely(PageTransHuge(item->old_page) && 
-		!PageTransHuge(item->new_page))) {
-		lock_page(item->old_page);
-		rc = split_huge_page(item->old_page);
-		unlock_page(item->old_page);
-		if (rc)
-			goto out;
-	}
-
-	rc = __unmap_page_concur(item->old_page, item->new_page, &item->anon_vma,
-							force, mode);
-	if (rc == MIGRATEPAGE_SUCCESS) {
-		put_new_page = NULL;
-		return rc;
-	}
-
-out:
-	if (rc != -EAGAIN) {
-		list_del(&item->old_page->lru);
-		dec_zone_page_state(item->old_page, NR_ISOLATED_ANON +
-				page_is_file_cache(item->old_page));
-
-		putback_lru_page(item->old_page);
-	}
+	putback_lru_page(page);
+}
 
+static void putback_new_page_concur(struct page *newpage,
+				free_page_t put_new_page, unsigned long private)
+{
 	/*
 	 * If migration was not successful and there's a freeing callback, use
 	 * it.  Otherwise, putback_lru_page() will drop the reference grabbed
 	 * during isolation.
 	 */
 	if (put_new_page)
-		put_new_page(item->new_page, private);
-	else if (unlikely(__is_movable_balloon_page(item->new_page))) {
+		put_new_page(newpage, private);
+	else if (PageHuge(newpage))
+		putback_active_hugepage(newpage);
+	else if (unlikely(__is_movable_balloon_page(newpage))) {
 		/* drop our reference, page already in the balloon */
-		put_page(item->new_page);
+		put_page(newpage);
 	} else
-		putback_lru_page(item->new_page);
+		putback_lru_page(newpage);
+}
 
-	if (result) {
+/* Drop a page that could not be unmapped from the batched path */
+static void unmap_page_concur_failed(struct page_migration_work_item *item,
+				int rc, free_page_t put_new_page, unsigned long private)
+{
+	if (rc != -EAGAIN)
+		putback_old_page_concur(item->old_page);
+
+	putback_new_page_concur(item->new_page, put_new_page, private);
+	item->new_page = NULL;
+
+	if (item->result)
+		*item->result = rc;
+}
+
+/*
+ * Get the new page of an item, ready for __unmap_page_concur(). This part
+ * stays on the calling CPU: the get_new_page() callbacks keep state in
+ * private that is not meant to be shared between threads.
+ */
+static int get_new_page_concur(new_page_t get_new_page,
+				free_page_t put_new_page, unsigned long private,
+				struct page_migration_work_item *item)
+{
+	int rc = MIGRATEPAGE_SUCCESS;
+	int *result = NULL;
+
+
+	item->new_page = get_new_page(item->old_page, private, &result);
+	item->result = result;
+
+	if (!item->new_page) {
+		rc = -ENOMEM;
+		return rc;
+	}
+
+	if (page_count(item->old_page) == 1) {
+		rc = -ECANCELED;
+		goto out;
+	}
+
+	if (unlikely(!PageHuge(item->old_page) &&
+		PageTransHuge(item->old_page) &&
+		!PageTransHuge(item->new_page))) {
+		lock_page(item->old_page);
+		rc = split_huge_page(item->old_page);
+		unlock_page(item->old_page);
 		if (rc)
-			*result = rc;
-		else
-			*result = page_to_nid(item->new_page);
+			goto out;
 	}
 
 	return rc;
+
+out:
+	unmap_page_concur_failed(item, rc, put_new_page, private);
+
+	return rc;
+}
+
+/*
+ * Undo __unmap_page_concur() for a page that cannot be migrated after all.
+ * The old page stays on the migration list, so the serial path can retry.
+ */
+static void undo_unmap_page_concur(struct page_migration_work_item *item,
+				free_page_t put_new_page, unsigned long private)
+{
+	remove_migration_ptes(item->old_page, item->old_page, false);
+
+	unlock_page(item->new_page);
+
+	if (item->anon_vma)
+		put_anon_vma(item->anon_vma);
+	item->anon_vma = NULL;
+
+	unlock_page(item->old_page);
+
+	putback_new_page_concur(item->new_page, put_new_page, private);
+	item->new_page = NULL;
+}
+
+/*
+ * Pages in an address_space take the batched path if their mapping is
+ * moved the way migrate_page() or buffer_migrate_page() do it. Anything
+ * else needs the filesystem's own ->migratepage() and is left to
+ * migrate_pages(). hugetlbfs pages are the exception, see
+ * move_mapping_concurr().
+ */
+static bool mapping_migrate_concur(struct address_space *mapping)
+{
+	if (!mapping)
+		return true;
+	if (mapping->a_ops->migratepage == migrate_page)
+		return true;
+#ifdef CONFIG_BLOCK
+	if (mapping->a_ops->migratepage == buffer_migrate_page)
+		return true;
+#endif
+	return false;
+}
+
+#ifdef CONFIG_BLOCK
+static struct buffer_head *page_buffers_concur(struct address_space *mapping,
+				struct page *page)
+{
+	if (mapping->a_ops->migratepage == buffer_migrate_page &&
+		page_has_buffers(page))
+		return page_buffers(page);
+	return NULL;
+}
+
+/* What buffer_migrate_page() does once the mapping is moved */
+static void move_buffers_concur(struct page *newpage, struct page *page,
+				struct buffer_head *head)
+{
+	struct buffer_head *bh;
+
+	ClearPagePrivate(page);
+	set_page_private(newpage, page_private(page));
+	set_page_private(page, 0);
+	put_page(page);
+	get_page(newpage);
+
+	bh = head;
+	do {
+		set_bh_page(bh, newpage, bh_offset(bh));
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	SetPagePrivate(newpage);
+}
+
+static void unlock_buffers_concur(struct buffer_head *head)
+{
+	struct buffer_head *bh = head;
+
+	do {
+		unlock_buffer(bh);
+		put_bh(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+#else
+static inline struct buffer_head *page_buffers_concur(
+				struct address_space *mapping, struct page *page)
+{
+	return NULL;
+}
+
+static inline void move_buffers_concur(struct page *newpage,
+				struct page *page, struct buffer_head *head)
+{
+}
+
+static inline void unlock_buffers_concur(struct buffer_head *head)
+{
+}
+#endif /* CONFIG_BLOCK */
+
+/*
+ * Replace the old pages of all items in @mapping with their new pages in
+ * the radix tree, as migrate_page_move_mapping() does for a single page,
+ * but under one tree_lock hold. Moved items go to @moved_list_ptr, items
+ * whose pages are still referenced elsewhere to @busy_list_ptr.
+ *
+ * For buffer_migrate_page() mappings the buffers are moved to the new page
+ * as well. They can only be trylocked under tree_lock and stay locked until
+ * the data is copied, see copy_page_flags_concur().
+ */
+static int move_file_mapping_concur(struct address_space *mapping,
+				struct list_head *unmapped_list_ptr,
+				struct list_head *moved_list_ptr,
+				struct list_head *busy_list_ptr)
+{
+	struct page_migration_work_item *iterator, *iterator2;
+	int nr_failed = 0;
+
+	spin_lock_irq(&mapping->tree_lock);
+	list_for_each_entry_safe(iterator, iterator2, unmapped_list_ptr, list) {
+		struct page *page = iterator->old_page;
+		struct page *newpage = iterator->new_page;
+		struct buffer_head *head;
+		int expected_count;
+		void **pslot;
+		int dirty;
+
+		if (page_mapping(page) != mapping)
+			continue;
+
+		head = page_buffers_concur(mapping, page);
+
+		expected_count = 2 + page_has_private(page);
+		pslot = migrate_mapping_freeze_page(mapping, page,
+						expected_count);
+		if (!pslot) {
+			list_move_tail(&iterator->list, busy_list_ptr);
+			++nr_failed;
+			continue;
+		}
+
+		if (head && !buffer_migrate_lock_buffers(head, MIGRATE_ASYNC)) {
+			page_ref_unfreeze(page, expected_count);
+			list_move_tail(&iterator->list, busy_list_ptr);
+			++nr_failed;
+			continue;
+		}
+
+		dirty = migrate_mapping_replace_page(pslot, newpage, page,
+						expected_count);
+		/* irqs are off, as in migrate_page_move_mapping() */
+		migrate_mapping_move_stats(mapping, newpage, page, dirty);
+
+		if (head) {
+			move_buffers_concur(newpage, page, head);
+			iterator->buffers = head;
+		}
+
+		list_move_tail(&iterator->list, moved_list_ptr);
+	}
+	spin_unlock_irq(&mapping->tree_lock);
+
+	return nr_failed;
 }
 
 static int move_mapping_concurr(struct list_head *unmapped_list_ptr,
 					   struct list_head *wip_list_ptr,
 					   enum migrate_mode mode)
 {
-	struct page_migration_work_item *iterator, *iterator2;
+	struct page_migration_work_item *iterator;
 	struct address_space *mapping;
+	LIST_HEAD(moved_list);
+	int nr_failed = 0;
+
+	while (!list_empty(unmapped_list_ptr)) {
+		iterator = list_first_entry(unmapped_list_ptr,
+				struct page_migration_work_item, list);
 
-	list_for_each_entry_safe(iterator, iterator2, unmapped_list_ptr, list) {
 		VM_BUG_ON_PAGE(!PageLocked(iterator->old_page), iterator->old_page);
 		VM_BUG_ON_PAGE(!PageLocked(iterator->new_page), iterator->new_page);
 
-		mapping = page_mapping(iterator->old_page);
+		VM_BUG_ON(PageWriteback(iterator->old_page));
 
-		VM_BUG_ON(mapping);
+		mapping = page_mapping(iterator->old_page);
 
-		VM_BUG_ON(PageWriteback(iterator->old_page));
+		/*
+		 * All the pages of this mapping in the batch at once. What
+		 * hugetlbfs_migrate_page() does to the mapping is a subset of
+		 * migrate_page(), so hugetlbfs pages are batched as well.
+		 */
+		if (mapping && (PageHuge(iterator->old_page) ||
+				mapping_migrate_concur(mapping))) {
+			nr_failed += move_file_mapping_concur(mapping,
+					unmapped_list_ptr, &moved_list,
+					wip_list_ptr);
+			continue;
+		}
 
-		if (page_count(iterator->old_page) != 1) {
+		if (mapping || page_count(iterator->old_page) != 1) {
 			list_move(&iterator->list, wip_list_ptr);
+			++nr_failed;
 			continue;
 		}
 
@@ -1397,9 +1890,13 @@ static int move_mapping_concurr(struct list_head *unmapped_list_ptr,
 		iterator->new_page->mapping = iterator->old_page->mapping;
 		if (PageSwapBacked(iterator->old_page))
 			SetPageSwapBacked(iterator->new_page);
+
+		list_move_tail(&iterator->list, &moved_list);
 	}
 
-	return 0;
+	list_splice(&moved_list, unmapped_list_ptr);
+
+	return nr_failed;
 }
 
 static void migrate_page_copy_page_flags(struct page *newpage, struct page *page)
@@ -1460,223 +1957,710 @@ static void migrate_page_copy_page_flags(struct page *newpage, struct page *page
 	mem_cgroup_migrate(page, newpage);
 }
 
+/*
+ * migrate_pages_concur() works on the isolated pages in batches. While the
+ * data of one batch is copied, by the DMA engine or from migrate_remap_wq,
+ * the next batch is being unmapped and its mappings moved. The remaining
+ * steps of a batch are run from migrate_remap_wq once its copy completes.
+ */
+#define MIGRATE_CONCUR_BATCH		64
+#define MIGRATE_CONCUR_MAX_INFLIGHT	2
 
-static int copy_to_new_pages_concur(struct list_head *unmapped_list_ptr,
-				enum migrate_mode mode)
+/*
+ * With MIGRATE_MT, the unmap, mapping move and remap of a batch run in up
+ * to MIGRATE_CONCUR_LANES lanes on migrate_lane_wq, each lane getting at
+ * least MIGRATE_CONCUR_LANE_MIN pages. Lanes sleep on page locks and rmap
+ * walks, so they are kept off the copy workers, where they would hold up
+ * the copies queued behind them. A lane is a run of
+ * neighbouring pages, cut where page->mapping changes whenever possible,
+ * so that lanes rarely contend on an anon_vma, a tree_lock or a page
+ * table lock.
+ */
+#define MIGRATE_CONCUR_LANES		8
+#define MIGRATE_CONCUR_LANE_MIN		4
+
+struct migrate_concur_batch;
+
+struct migrate_concur_lane {
+	struct migrate_concur_batch *batch;
+	struct work_struct work;
+	struct list_head items;
+	/* items the lane gives up on */
+	struct list_head busy;
+	int nr_failed;
+};
+
+typedef void (*migrate_concur_lane_fn)(struct migrate_concur_lane *lane);
+
+struct migrate_concur_batch {
+	struct list_head list;
+	struct list_head items;
+	int nr_items;
+	enum migrate_mode mode;
+	int force;
+	int copy_err;
+
+	int nr_lanes;
+	migrate_concur_lane_fn lane_fn;
+	struct migrate_concur_lane lanes[MIGRATE_CONCUR_LANES];
+	atomic_t lanes_pending;
+	struct completion lanes_done;
+
+	struct work_struct remap_work;
+	struct completion done;
+
+	/* the pages left to copy, pre-copied THPs are not */
+	int nr_copy;
+	struct page *src_pages[MIGRATE_CONCUR_BATCH];
+	struct page *dst_pages[MIGRATE_CONCUR_BATCH];
+
+	struct page_migration_work_item work_items[MIGRATE_CONCUR_BATCH];
+};
+
+/* What became of the pages handed to migrate_pages_concur() */
+struct migrate_concur_stats {
+	int nr_succeeded;
+	int nr_failed;
+	/* left on the list for migrate_pages() */
+	int nr_retry;
+	int nr_serial;
+};
+
+static struct workqueue_struct *migrate_remap_wq;
+static struct workqueue_struct *migrate_lane_wq;
+
+/*
+ * Enough batches for one migrate_pages_concur() to make progress. The
+ * batches, and the work items in them, are all the memory it needs,
+ * whatever the length of the list. Callers share the spares, so only one
+ * with no batch in flight waits for them.
+ */
+static mempool_t *migrate_concur_batch_pool;
+
+static void copy_to_new_pages_serial(struct list_head *unmapped_list_ptr)
 {
 	struct page_migration_work_item *iterator;
-	int num_pages = 0, idx = 0;
-	struct page **src_page_list = NULL, **dst_page_list = NULL;
-	unsigned long size = 0;
-	int rc = -EFAULT;
 
 	list_for_each_entry(iterator, unmapped_list_ptr, list) {
-		++num_pages;
-		size += PAGE_SIZE * hpage_nr_pages(iterator->old_page);
+		cond_resched();
+		if (iterator->precopied)
+			continue;
+		if (PageHuge(iterator->old_page) ||
+			PageTransHuge(iterator->old_page))
+			copy_huge_page(iterator->new_page, iterator->old_page, 0);
+		else
+			copy_highpage(iterator->new_page, iterator->old_page);
 	}
+}
 
-	src_page_list = kzalloc(sizeof(struct page *)*num_pages, GFP_KERNEL);
-	if (!src_page_list)
-		return -ENOMEM;
-	dst_page_list = kzalloc(sizeof(struct page *)*num_pages, GFP_KERNEL);
-	if (!dst_page_list)
-		return -ENOMEM;
+static void copy_page_flags_concur(struct list_head *unmapped_list_ptr)
+{
+	struct page_migration_work_item *iterator;
 
 	list_for_each_entry(iterator, unmapped_list_ptr, list) {
-		src_page_list[idx] = iterator->old_page;
-		dst_page_list[idx] = iterator->new_page;
-		++idx;
-	}
+		migrate_page_copy_page_flags(iterator->new_page, iterator->old_page);
 
-	BUG_ON(idx != num_pages);
-	
-	if (mode & MIGRATE_DMA)
-		rc = copy_page_lists_dma_always(dst_page_list, src_page_list, 
-							num_pages);
-	else if (mode & MIGRATE_MT)
-		rc = copy_page_lists_mt(dst_page_list, src_page_list, 
-							num_pages);
-
-	if (rc) {
-		list_for_each_entry(iterator, unmapped_list_ptr, list) {
-			if (PageHuge(iterator->old_page) ||
-				PageTransHuge(iterator->old_page))
-				copy_huge_page(iterator->new_page, iterator->old_page, 0);
-			else
-				copy_highpage(iterator->new_page, iterator->old_page);
+		/* the data is in place, let I/O on the moved buffers go */
+		if (iterator->buffers) {
+			unlock_buffers_concur(iterator->buffers);
+			iterator->buffers = NULL;
 		}
+
+		/* as in move_to_new_page() */
+		if (!PageAnon(iterator->old_page))
+			iterator->old_page->mapping = NULL;
 	}
+}
 
-	kfree(src_page_list);
-	kfree(dst_page_list);
+static int copy_to_new_pages_concur(struct migrate_concur_batch *batch)
+{
+	int rc = -EFAULT;
 
-	list_for_each_entry(iterator, unmapped_list_ptr, list) {
-		migrate_page_copy_page_flags(iterator->new_page, iterator->old_page);
-	}
+	if (!batch->nr_copy)
+		return 0;
+
+	if (batch->mode & MIGRATE_DMA)
+		rc = copy_page_lists_dma_always(batch->dst_pages,
+					batch->src_pages, batch->nr_copy);
+	else if (batch->mode & MIGRATE_MT)
+		rc = copy_page_lists_mt(batch->dst_pages,
+					batch->src_pages, batch->nr_copy);
+	else if (accel_page_migration)
+		rc = copy_page_lists_auto(batch->dst_pages,
+					batch->src_pages, batch->nr_copy);
+
+	if (rc)
+		copy_to_new_pages_serial(&batch->items);
 
 	return 0;
 }
 
+/*
+ * Remove migration ptes, unlock old and new pages and put anon_vma. The
+ * pages are put back by the caller, since the old pages are still linked
+ * on the migration list.
+ */
 static int remove_migration_ptes_concurr(struct list_head *unmapped_list_ptr)
 {
-	struct page_migration_work_item *iterator, *iterator2;
+	struct page_migration_work_item *iterator;
 
-	list_for_each_entry_safe(iterator, iterator2, unmapped_list_ptr, list) {
+	list_for_each_entry(iterator, unmapped_list_ptr, list) {
 		remove_migration_ptes(iterator->old_page, iterator->new_page, false);
 
 		unlock_page(iterator->new_page);
 
 		if (iterator->anon_vma)
 			put_anon_vma(iterator->anon_vma);
+		iterator->anon_vma = NULL;
+
+		if (PageHuge(iterator->old_page))
+			hugetlb_cgroup_migrate(iterator->old_page,
+					iterator->new_page);
 
 		unlock_page(iterator->old_page);
+	}
+
+	return 0;
+}
+
+static void split_batch_lanes_concur(struct migrate_concur_batch *batch,
+				int nr_lanes)
+{
+	struct page_migration_work_item *iterator, *iterator2;
+	int per_lane = DIV_ROUND_UP(batch->nr_items, nr_lanes);
+	void *key = NULL;
+	int lane = 0;
+	int nr = 0;
+	int i;
 
-		list_del(&iterator->old_page->lru);
-		dec_zone_page_state(iterator->old_page, NR_ISOLATED_ANON +
-				page_is_file_cache(iterator->old_page));
+	for (i = 0; i < nr_lanes; ++i) {
+		batch->lanes[i].batch = batch;
+		INIT_LIST_HEAD(&batch->lanes[i].items);
+		INIT_LIST_HEAD(&batch->lanes[i].busy);
+		batch->lanes[i].nr_failed = 0;
+	}
 
-		putback_lru_page(iterator->old_page);
-		iterator->old_page = NULL;
+	list_for_each_entry_safe(iterator, iterator2, &batch->items, list) {
+		void *mapping = READ_ONCE(iterator->old_page->mapping);
 
-		putback_lru_page(iterator->new_page);
-		iterator->new_page = NULL;
+		/*
+		 * Move on to the next lane once this one is full, at a change
+		 * of anon_vma or address_space, or in the middle of a long
+		 * run of the same one.
+		 */
+		if (nr >= per_lane && lane < nr_lanes - 1 &&
+			(mapping != key || nr >= per_lane + per_lane / 2)) {
+			++lane;
+			nr = 0;
+		}
+		key = mapping;
+		++nr;
+
+		list_move_tail(&iterator->list, &batch->lanes[lane].items);
 	}
 
-	return 0;
+	batch->nr_lanes = lane + 1;
 }
 
-int migrate_pages_concur(struct list_head *from, new_page_t get_new_page,
-		free_page_t put_new_page, unsigned long private,
-		enum migrate_mode mode, int reason)
+static void migrate_concur_lane_work(struct work_struct *work)
 {
-	int retry = 1;
-	int nr_failed = 0;
-	int nr_succeeded = 0;
-	int pass = 0;
-	struct page *page;
-	int swapwrite = current->flags & PF_SWAPWRITE;
-	int rc;
-	int total_num_pages = 0, idx;
-	struct page_migration_work_item *item_list;
-	struct page_migration_work_item *iterator, *iterator2;
-	int item_list_order = 0;
+	struct migrate_concur_lane *lane = container_of(work,
+				struct migrate_concur_lane, work);
+	struct migrate_concur_batch *batch = lane->batch;
 
-	LIST_HEAD(wip_list);
-	LIST_HEAD(unmapped_list);
-	LIST_HEAD(serialized_list);
-	LIST_HEAD(failed_list);
+	batch->lane_fn(lane);
 
-	if (!swapwrite)
-		current->flags |= PF_SWAPWRITE;
+	if (atomic_dec_and_test(&batch->lanes_pending))
+		complete(&batch->lanes_done);
+}
 
-	list_for_each_entry(page, from, lru)
-		++total_num_pages;
+/*
+ * Run the lanes but the first on migrate_lane_wq, preferably on CPUs of
+ * node nid, and the first one on the calling CPU.
+ */
+static void run_batch_lanes_wq(struct migrate_concur_batch *batch, int nid)
+{
+	const struct cpumask *cpus = cpumask_of_node(nid);
+	int cpu = cpumask_any_and(cpus, cpu_online_mask);
+	int i;
 
-	item_list_order = get_order(total_num_pages * 
-		sizeof(struct page_migration_work_item));
+	atomic_set(&batch->lanes_pending, batch->nr_lanes);
+	init_completion(&batch->lanes_done);
 
-	if (item_list_order > MAX_ORDER) {
-		item_list = alloc_pages_exact(total_num_pages * 
-			sizeof(struct page_migration_work_item), GFP_ATOMIC);
-		memset(item_list, 0, total_num_pages * 
-			sizeof(struct page_migration_work_item));
-	} else {
-		item_list = (struct page_migration_work_item *)__get_free_pages(GFP_ATOMIC, 
-						item_list_order);
-		memset(item_list, 0, PAGE_SIZE<<item_list_order);
+	for (i = 1; i < batch->nr_lanes; ++i) {
+		INIT_WORK(&batch->lanes[i].work, migrate_concur_lane_work);
+		if (cpu < nr_cpu_ids)
+			queue_work_on(cpu, migrate_lane_wq, &batch->lanes[i].work);
+		else
+			queue_work(migrate_lane_wq, &batch->lanes[i].work);
 	}
 
-	idx = 0;
-	list_for_each_entry(page, from, lru) {
-		item_list[idx].old_page = page;
-		item_list[idx].new_page = NULL;
-		INIT_LIST_HEAD(&item_list[idx].list);
-		list_add_tail(&item_list[idx].list, &wip_list);
-		idx += 1;
-	}
+	batch->lane_fn(&batch->lanes[0]);
+	if (!atomic_dec_and_test(&batch->lanes_pending))
+		wait_for_completion(&batch->lanes_done);
+}
 
-	for(pass = 0; pass < 1 && retry; pass++) {
-		retry = 0;
+/*
+ * Run fn over the items of a batch, in parallel on migrate_lane_wq with
+ * MIGRATE_MT, on the calling CPU otherwise. The items keep their order.
+ * Returns the number of items the lanes gave up on, which are moved to
+ * busy_list.
+ */
+static int run_batch_lanes_concur(struct migrate_concur_batch *batch,
+				migrate_concur_lane_fn fn,
+				struct list_head *busy_list)
+{
+	struct page_migration_work_item *first;
+	int nr_lanes = 1;
+	int nr_failed = 0;
+	int i;
 
-		/* unmap and get new page for page_mapping(page) == NULL */
-		list_for_each_entry_safe(iterator, iterator2, &wip_list, list) {
-			cond_resched();
+	if (list_empty(&batch->items))
+		return 0;
 
-			if (iterator->new_page)
-				continue;
+	first = list_first_entry(&batch->items,
+			struct page_migration_work_item, list);
 
-			/* We do not migrate huge pages, file-backed, or swapcached pages */
-			if (PageHuge(iterator->old_page)) {
-				rc = -ENODEV;
-			}
-			else if ((page_mapping(iterator->old_page) != NULL)) {
-				rc = -ENODEV;
-			}
-			else
-				rc = unmap_pages_and_get_new_concur(get_new_page, put_new_page,
-						private, iterator, pass > 2, mode,
-						reason);
+	if (batch->mode & MIGRATE_MT)
+		nr_lanes = min3(copy_workers_nr(page_to_nid(first->old_page)),
+				MIGRATE_CONCUR_LANES,
+				batch->nr_items / MIGRATE_CONCUR_LANE_MIN);
+	nr_lanes = max(nr_lanes, 1);
 
-			switch(rc) {
-			case -ENODEV:
-				list_move(&iterator->list, &serialized_list);
-				break;
-			case -ENOMEM:
-				goto out;
-			case -EAGAIN:
-				retry++;
-				break;
-			case MIGRATEPAGE_SUCCESS:
-				list_move(&iterator->list, &unmapped_list);
-				nr_succeeded++;
-				break;
-			default:
-				/*
-				 * Permanent failure (-EBUSY, -ENOSYS, etc.):
-				 * unlike -EAGAIN case, the failed page is
-				 * removed from migration page list and not
-				 * retried in the next outer loop.
-				 */
-				list_move(&iterator->list, &failed_list);
-				nr_failed++;
-				break;
+	split_batch_lanes_concur(batch, nr_lanes);
+	batch->lane_fn = fn;
+
+	if (batch->nr_lanes > 1 && migrate_lane_wq)
+		run_batch_lanes_wq(batch, page_to_nid(first->old_page));
+	else
+		for (i = 0; i < batch->nr_lanes; ++i)
+			fn(&batch->lanes[i]);
+
+	for (i = 0; i < batch->nr_lanes; ++i) {
+		list_splice_tail(&batch->lanes[i].items, &batch->items);
+		if (busy_list)
+			list_splice_tail(&batch->lanes[i].busy, busy_list);
+		nr_failed += batch->lanes[i].nr_failed;
+	}
+
+	return nr_failed;
+}
+
+static void unmap_lane_concur(struct migrate_concur_lane *lane)
+{
+	struct migrate_concur_batch *batch = lane->batch;
+	struct page_migration_work_item *iterator;
+
+	list_for_each_entry(iterator, &lane->items, list) {
+		iterator->rc = __unmap_page_concur(iterator->old_page,
+				iterator->new_page, &iterator->anon_vma,
+				&iterator->precopied, batch->force,
+				batch->mode);
+		cond_resched();
+	}
+
+	/*
+	 * The deferred flush is per task, the caller would not see the one
+	 * pending on a copy worker.
+	 */
+	try_to_unmap_flush();
+}
+
+static void move_mapping_lane_concur(struct migrate_concur_lane *lane)
+{
+	lane->nr_failed = move_mapping_concurr(&lane->items, &lane->busy,
+				lane->batch->mode);
+}
+
+static void remap_lane_concur(struct migrate_concur_lane *lane)
+{
+	copy_page_flags_concur(&lane->items);
+
+	remove_migration_ptes_concurr(&lane->items);
+}
+
+/*
+ * Unmap the old pages of a batch. Pages that cannot be unmapped leave the
+ * batch; the ones to retry stay on the migration list, for the serial
+ * path.
+ */
+static void migrate_concur_batch_unmap(struct migrate_concur_batch *batch,
+				free_page_t put_new_page, unsigned long private,
+				struct migrate_concur_stats *stats)
+{
+	struct page_migration_work_item *iterator, *iterator2;
+
+	run_batch_lanes_concur(batch, unmap_lane_concur, NULL);
+
+	list_for_each_entry_safe(iterator, iterator2, &batch->items, list) {
+		int rc = iterator->rc;
+
+		if (rc == MIGRATEPAGE_SUCCESS)
+			continue;
+
+		unmap_page_concur_failed(iterator, rc, put_new_page, private);
+		list_del_init(&iterator->list);
+		batch->nr_items--;
+
+		/*
+		 * Permanent failure (-EBUSY, -ENOSYS, etc.):
+		 * unlike -EAGAIN case, the failed page is
+		 * removed from migration page list and not
+		 * retried in the next outer loop.
+		 */
+		if (rc == -EAGAIN)
+			stats->nr_retry++;
+		else
+			stats->nr_failed++;
+	}
+
+	stats->nr_succeeded += batch->nr_items;
+}
+
+static void putback_migrated_pages_concur(struct list_head *unmapped_list_ptr)
+{
+	struct page_migration_work_item *iterator, *iterator2;
+
+	list_for_each_entry_safe(iterator, iterator2, unmapped_list_ptr, list) {
+		if (iterator->result)
+			*iterator->result = page_to_nid(iterator->new_page);
+
+		putback_old_page_concur(iterator->old_page);
+		iterator->old_page = NULL;
+
+		if (PageHuge(iterator->new_page))
+			putback_active_hugepage(iterator->new_page);
+		else
+			putback_lru_page(iterator->new_page);
+		iterator->new_page = NULL;
+
+		list_del_init(&iterator->list);
+	}
+}
+
+static void migrate_concur_batch_remap(struct work_struct *work)
+{
+	struct migrate_concur_batch *batch = container_of(work,
+				struct migrate_concur_batch, remap_work);
+
+	if (batch->copy_err)
+		copy_to_new_pages_serial(&batch->items);
+
+	run_batch_lanes_concur(batch, remap_lane_concur, NULL);
+
+	complete(&batch->done);
+}
+
+/* The copy of a batch not copied by DMA, see migrate_concur_batch_start() */
+static void migrate_concur_batch_copy(struct work_struct *work)
+{
+	struct migrate_concur_batch *batch = container_of(work,
+				struct migrate_concur_batch, remap_work);
+
+	copy_to_new_pages_concur(batch);
+
+	run_batch_lanes_concur(batch, remap_lane_concur, NULL);
+
+	complete(&batch->done);
+}
+
+static void migrate_concur_batch_dma_done(void *arg, int err)
+{
+	struct migrate_concur_batch *batch = arg;
+
+	batch->copy_err = err;
+	queue_work(migrate_remap_wq, &batch->remap_work);
+}
+
+static struct migrate_concur_batch *alloc_migrate_concur_batch(
+				enum migrate_mode mode, int force, gfp_t gfp)
+{
+	struct migrate_concur_batch *batch;
+
+	/* only fails if gfp cannot wait for a batch of another migration */
+	batch = mempool_alloc(migrate_concur_batch_pool, gfp);
+	if (!batch)
+		return NULL;
+
+	INIT_LIST_HEAD(&batch->list);
+	INIT_LIST_HEAD(&batch->items);
+	INIT_WORK(&batch->remap_work, migrate_concur_batch_remap);
+	init_completion(&batch->done);
+	batch->nr_items = 0;
+	batch->mode = mode;
+	batch->force = force;
+	batch->copy_err = 0;
+	batch->nr_lanes = 0;
+	batch->nr_copy = 0;
+
+	return batch;
+}
+
+/* The next free work item of a batch being filled */
+static struct page_migration_work_item *migrate_concur_batch_item(
+				struct migrate_concur_batch *batch,
+				struct page *page)
+{
+	struct page_migration_work_item *item;
+
+	item = &batch->work_items[batch->nr_items];
+	item->old_page = page;
+	item->new_page = NULL;
+	item->anon_vma = NULL;
+	item->result = NULL;
+	item->buffers = NULL;
+	item->rc = 0;
+	item->precopied = false;
+	INIT_LIST_HEAD(&item->list);
+
+	return item;
+}
+
+/*
+ * Move the mappings of a batch of unmapped pages and start copying them.
+ * The copy and remap of the batch go on from migrate_remap_wq, right away
+ * or once its DMA completes, while the caller unmaps the next batch.
+ */
+static void migrate_concur_batch_start(struct migrate_concur_batch *batch,
+				struct list_head *inflight_list,
+				free_page_t put_new_page, unsigned long private,
+				struct migrate_concur_stats *stats)
+{
+	struct page_migration_work_item *iterator, *iterator2;
+	LIST_HEAD(busy_list);
+	int nr_failed;
+	int idx = 0;
+
+	/* move page->mapping to new page, only -EAGAIN could happen  */
+	nr_failed = run_batch_lanes_concur(batch, move_mapping_lane_concur,
+				&busy_list);
+
+	/* the old pages stay on the migration list, for the serial path */
+	list_for_each_entry_safe(iterator, iterator2, &busy_list, list) {
+		undo_unmap_page_concur(iterator, put_new_page, private);
+		list_del_init(&iterator->list);
+	}
+	batch->nr_items -= nr_failed;
+	stats->nr_succeeded -= nr_failed;
+	stats->nr_serial += nr_failed;
+
+	list_for_each_entry(iterator, &batch->items, list) {
+		if (iterator->precopied)
+			continue;
+		batch->src_pages[idx] = iterator->old_page;
+		batch->dst_pages[idx] = iterator->new_page;
+		++idx;
+	}
+	BUG_ON(idx > batch->nr_items);
+	batch->nr_copy = idx;
+
+	list_add_tail(&batch->list, inflight_list);
+
+	if (!batch->nr_items) {
+		complete(&batch->done);
+		return;
+	}
+
+	if ((batch->mode & MIGRATE_DMA) && batch->nr_copy &&
+		!copy_page_lists_dma_async(batch->dst_pages, batch->src_pages,
+				batch->nr_copy, migrate_concur_batch_dma_done, batch))
+		return;
+
+	INIT_WORK(&batch->remap_work, migrate_concur_batch_copy);
+	queue_work(migrate_remap_wq, &batch->remap_work);
+}
+
+/* Wait for the oldest in-flight batch and put its pages back. */
+static void migrate_concur_batch_finish(struct list_head *inflight_list)
+{
+	struct migrate_concur_batch *batch;
+
+	batch = list_first_entry(inflight_list, struct migrate_concur_batch, list);
+
+	wait_for_completion(&batch->done);
+
+	putback_migrated_pages_concur(&batch->items);
+
+	list_del(&batch->list);
+	mempool_free(batch, migrate_concur_batch_pool);
+}
+
+/*
+ * Unmap a full batch and start it, once the oldest in-flight batch is done
+ * if MIGRATE_CONCUR_MAX_INFLIGHT of them are locked already.
+ */
+static void migrate_concur_batch_submit(struct migrate_concur_batch *batch,
+				struct list_head *inflight_list, int *nr_inflight,
+				free_page_t put_new_page, unsigned long private,
+				struct migrate_concur_stats *stats)
+{
+	migrate_concur_batch_unmap(batch, put_new_page, private, stats);
+
+	if (*nr_inflight == MIGRATE_CONCUR_MAX_INFLIGHT) {
+		migrate_concur_batch_finish(inflight_list);
+		(*nr_inflight)--;
+	}
+
+	migrate_concur_batch_start(batch, inflight_list, put_new_page,
+				private, stats);
+	(*nr_inflight)++;
+}
+
+int migrate_pages_concur(struct list_head *from, new_page_t get_new_page,
+		free_page_t put_new_page, unsigned long private,
+		enum migrate_mode mode, int reason)
+{
+	struct migrate_concur_stats stats = {};
+	int nr_inflight = 0;
+	struct page *page, *page2;
+	int swapwrite = current->flags & PF_SWAPWRITE;
+	int rc = 0;
+	struct page_migration_work_item *item;
+	struct migrate_concur_batch *batch = NULL;
+
+	LIST_HEAD(inflight_list);
+
+	if (!swapwrite)
+		current->flags |= PF_SWAPWRITE;
+
+	/*
+	 * The list is taken MIGRATE_CONCUR_BATCH pages at a time. Pages
+	 * that leave it are either in a batch already or put back, so the
+	 * next page is never touched under us.
+	 */
+	list_for_each_entry_safe(page, page2, from, lru) {
+		cond_resched();
+
+		/*
+		 * Waiting on the pool with batches in flight could deadlock
+		 * against another caller holding the rest of it, finish our
+		 * oldest batch instead.
+		 */
+		while (!batch) {
+			batch = alloc_migrate_concur_batch(mode, 0,
+					nr_inflight ? GFP_NOWAIT : GFP_KERNEL);
+			if (!batch) {
+				migrate_concur_batch_finish(&inflight_list);
+				nr_inflight--;
 			}
 		}
-		/* move page->mapping to new page, only -EAGAIN could happen  */
-		move_mapping_concurr(&unmapped_list, &wip_list, mode);
-		/* copy pages in unmapped_list */
-		copy_to_new_pages_concur(&unmapped_list, mode);
-		/* remove migration pte, if old_page is NULL?, unlock old and new
-		 * pages, put anon_vma, put old and new pages */
-		remove_migration_ptes_concurr(&unmapped_list);
-	}
-	nr_failed += retry;
-	rc = nr_failed;
 
-	if (!list_empty(&serialized_list)) {
-		rc = migrate_pages(from, get_new_page, put_new_page, 
-				private, mode, reason);
+		item = migrate_concur_batch_item(batch, page);
+
+		/*
+		 * hugetlb pages of a size that cannot be migrated and
+		 * pages whose mapping has its own migratepage callback
+		 * go through migrate_pages().
+		 */
+		if (PageHuge(page) &&
+			!hugepage_migration_supported(page_hstate(page))) {
+			rc = -ENODEV;
+		}
+		else if (!PageHuge(page) &&
+			!mapping_migrate_concur(page_mapping(page))) {
+			rc = -ENODEV;
+		}
+		else if (isolated_balloon_page(page)) {
+			rc = -ENODEV;
+		}
+		else
+			rc = get_new_page_concur(get_new_page, put_new_page,
+					private, item);
+
+		switch(rc) {
+		case -ENODEV:
+			stats.nr_serial++;
+			break;
+		case -ENOMEM:
+			goto out;
+		case -EAGAIN:
+			stats.nr_retry++;
+			break;
+		case MIGRATEPAGE_SUCCESS:
+			/* unmapped along with the rest of the batch */
+			list_add_tail(&item->list, &batch->items);
+			batch->nr_items++;
+			break;
+		default:
+			/*
+			 * Permanent failure (-EBUSY, -ENOSYS, etc.):
+			 * unlike -EAGAIN case, the failed page is
+			 * removed from migration page list and not
+			 * retried in the next outer loop.
+			 */
+			stats.nr_failed++;
+			break;
+		}
+
+		if (batch->nr_items < MIGRATE_CONCUR_BATCH)
+			continue;
+
+		migrate_concur_batch_submit(batch, &inflight_list, &nr_inflight,
+					put_new_page, private, &stats);
+		batch = NULL;
 	}
+
 out:
-	if (nr_succeeded)
-		count_vm_events(PGMIGRATE_SUCCESS, nr_succeeded);
-	if (nr_failed)
-		count_vm_events(PGMIGRATE_FAIL, nr_failed);
-	trace_mm_migrate_pages(nr_succeeded, nr_failed, mode, reason);
+	/* the last, partial batch */
+	if (batch && batch->nr_items)
+		migrate_concur_batch_submit(batch, &inflight_list, &nr_inflight,
+					put_new_page, private, &stats);
+	else if (batch)
+		mempool_free(batch, migrate_concur_batch_pool);
 
-	if (item_list_order >= MAX_ORDER) {
-		free_pages_exact(item_list, total_num_pages * 
-			sizeof(struct page_migration_work_item));
-	} else {
-		free_pages((unsigned long)item_list, item_list_order);
+	while (!list_empty(&inflight_list))
+		migrate_concur_batch_finish(&inflight_list);
+
+	if (rc != -ENOMEM) {
+		rc = stats.nr_failed + stats.nr_retry;
+
+		if (stats.nr_serial || stats.nr_retry) {
+			int serial_rc = migrate_pages(from, get_new_page,
+					put_new_page, private, mode, reason);
+
+			rc = serial_rc < 0 ? serial_rc :
+				stats.nr_failed + serial_rc;
+		} else
+			stats.nr_failed += stats.nr_retry;
 	}
 
+	if (stats.nr_succeeded)
+		count_vm_events(PGMIGRATE_SUCCESS, stats.nr_succeeded);
+	if (stats.nr_failed)
+		count_vm_events(PGMIGRATE_FAIL, stats.nr_failed);
+	trace_mm_migrate_pages(stats.nr_succeeded, stats.nr_failed, mode,
+				reason);
+
 	if (!swapwrite)
 		current->flags &= ~PF_SWAPWRITE;
 
 	return rc;
 }
 
+static int __init migrate_concur_init(void)
+{
+	migrate_remap_wq = alloc_workqueue("migrate_remap",
+				WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!migrate_remap_wq)
+		return -ENOMEM;
+
+	migrate_concur_batch_pool = mempool_create_kmalloc_pool(
+				MIGRATE_CONCUR_MAX_INFLIGHT + 1,
+				sizeof(struct migrate_concur_batch));
+	if (!migrate_concur_batch_pool) {
+		destroy_workqueue(migrate_remap_wq);
+		migrate_remap_wq = NULL;
+		return -ENOMEM;
+	}
+
+	/* lanes run serially without it */
+	migrate_lane_wq = alloc_workqueue("migrate_lane",
+				WQ_UNBOUND | WQ_MEM_RECLAIM, MIGRATE_CONCUR_LANES);
+
+	return 0;
+}
+subsys_initcall(migrate_concur_init);
+
 /*
  * migrate_pages - migrate the pages specified in a list, to the free pages
  *		   supplied as the target for the page migration
@@ -1775,28 +2759,97 @@ struct page_to_node {
 	struct page *page;
 	int node;
 	int status;
+	struct hlist_node hnode;
 };
 
-static struct page *new_page_node(struct page *p, unsigned long private,
-		int **result)
+/*
+ * move_pages() works on chunks of this many pages, large enough for
+ * migrate_pages_concur() to see full batches.
+ */
+#define MOVE_PAGES_CHUNK_NR	8192
+
+/*
+ * A chunk of move_pages() requests. The entries of isolated pages are
+ * hashed by page, so the allocation callbacks find them without a scan
+ * of the whole chunk.
+ */
+struct page_to_node_map {
+	struct page_to_node *pm;
+	struct hlist_head *hash;
+	unsigned int hash_bits;
+
+	/* hugetlb pages reserved by new_page_node_batch() */
+	struct list_head huge_pages;
+	nodemask_t huge_pages_reserved;
+};
+
+static void page_to_node_map_init(struct page_to_node_map *map)
 {
-	struct page_to_node *pm = (struct page_to_node *)private;
+	int i;
 
-	while (pm->node != MAX_NUMNODES && pm->page != p)
-		pm++;
+	for (i = 0; i < (1 << map->hash_bits); i++)
+		INIT_HLIST_HEAD(&map->hash[i]);
+	INIT_LIST_HEAD(&map->huge_pages);
+	nodes_clear(map->huge_pages_reserved);
+}
 
-	if (pm->node == MAX_NUMNODES)
-		return NULL;
+/* Room for chunks of up to @nr_pages pages */
+static int page_to_node_map_alloc(struct page_to_node_map *map,
+		unsigned long nr_pages)
+{
+	nr_pages = clamp_t(unsigned long, nr_pages, 1, MOVE_PAGES_CHUNK_NR);
 
-	*result = &pm->status;
+	/* keep one more entry as the end marker */
+	map->pm = vmalloc((nr_pages + 1) * sizeof(struct page_to_node));
+	if (!map->pm)
+		return -ENOMEM;
+
+	map->hash_bits = ilog2(roundup_pow_of_two(nr_pages));
+	map->hash = vmalloc(sizeof(struct hlist_head) << map->hash_bits);
+	if (!map->hash) {
+		vfree(map->pm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void page_to_node_map_free(struct page_to_node_map *map)
+{
+	vfree(map->hash);
+	vfree(map->pm);
+}
+
+static void page_to_node_map_add(struct page_to_node_map *map,
+		struct page_to_node *pp)
+{
+	hlist_add_head(&pp->hnode,
+			&map->hash[hash_ptr(pp->page, map->hash_bits)]);
+}
+
+static struct page_to_node *page_to_node_lookup(struct page_to_node_map *map,
+		struct page *page)
+{
+	struct page_to_node *pp;
+
+	hlist_for_each_entry(pp, &map->hash[hash_ptr(page, map->hash_bits)],
+			hnode)
+		if (pp->page == page)
+			return pp;
 
+	return NULL;
+}
+
+/* Allocate a page of the size of @p on @node */
+static struct page *alloc_migrate_target_node(struct page *p, int node)
+{
 	if (PageHuge(p))
 		return alloc_huge_page_node(page_hstate(compound_head(p)),
-					pm->node);
+					node);
 	else if (thp_migration_supported() && PageTransHuge(p)) {
 		struct page *thp;
 
-		thp = alloc_pages_node(pm->node,
+		thp = alloc_pages_node(node,
 			(GFP_TRANSHUGE | __GFP_THISNODE) & ~__GFP_RECLAIM,
 			HPAGE_PMD_ORDER);
 		if (!thp)
@@ -1804,43 +2857,530 @@ static struct page *new_page_node(struct page *p, unsigned long private,
 		prep_transhuge_page(thp);
 		return thp;
 	} else
-		return __alloc_pages_node(pm->node,
+		return __alloc_pages_node(node,
 				GFP_HIGHUSER_MOVABLE | __GFP_THISNODE, 0);
 }
 
-/*
- * Move a set of pages as indicated in the pm array. The addr
- * field must be set to the virtual address of the page to be moved
- * and the node number must contain a valid target node.
- * The pm array ends with node = MAX_NUMNODES.
- */
-static int do_move_page_to_node_array(struct mm_struct *mm,
-				      struct page_to_node *pm,
-				      int migrate_all,
-					  int migrate_use_dma,
-					  int migrate_use_mt,
-					  int migrate_concur)
+static struct page *new_page_node(struct page *p, unsigned long private,
+		int **result)
 {
-	int err;
-	struct page_to_node *pp;
-	LIST_HEAD(pagelist);
-	enum migrate_mode mode = MIGRATE_SYNC;
+	struct page_to_node_map *map = (struct page_to_node_map *)private;
+	struct page_to_node *pm = page_to_node_lookup(map, p);
 
-	if (migrate_use_mt)
-		mode |= MIGRATE_MT;
-	else if (migrate_use_dma)
-		mode |= MIGRATE_DMA;
+	if (!pm)
+		return NULL;
 
-	down_read(&mm->mmap_sem);
+	*result = &pm->status;
 
-	/*
-	 * Build a list of pages to migrate
-	 */
-	for (pp = pm; pp->node != MAX_NUMNODES; pp++) {
-		struct vm_area_struct *vma;
+	return alloc_migrate_target_node(p, pm->node);
+}
+
+/*
+ * new_page_node() for migrate_pages_concur(). Instead of taking one hugetlb
+ * page at a time off the pool, the first hugetlb page going to a node
+ * reserves pages for all the ones of the chunk going there with the same
+ * hstate. What is left unused is given back with putback_active_hugepage().
+ */
+static struct page *take_reserved_huge_page(struct list_head *huge_pages,
+		struct hstate *h, int nid)
+{
+	struct page *page;
+
+	list_for_each_entry(page, huge_pages, lru) {
+		if (page_hstate(page) == h && page_to_nid(page) == nid) {
+			list_del_init(&page->lru);
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+static struct page *new_page_node_batch(struct page *p, unsigned long private,
+		int **result)
+{
+	struct page_to_node_map *map = (struct page_to_node_map *)private;
+	struct page_to_node *pm, *pp;
+	struct hstate *h;
+	struct page *page;
+	int nr = 0;
+
+	if (!PageHuge(p))
+		return new_page_node(p, private, result);
+
+	pm = page_to_node_lookup(map, p);
+	if (!pm)
+		return NULL;
+
+	*result = &pm->status;
+
+	h = page_hstate(compound_head(p));
+	page = take_reserved_huge_page(&map->huge_pages, h, pm->node);
+	if (page)
+		return page;
+
+	/* reserve once per node, the pool will not grow in the meantime */
+	if (node_isset(pm->node, map->huge_pages_reserved))
+		return alloc_huge_page_node(h, pm->node);
+	node_set(pm->node, map->huge_pages_reserved);
+
+	/* pages are migrated in pm order, so only look ahead */
+	for (pp = pm; pp->node != MAX_NUMNODES; pp++)
+		if (pp->node == pm->node && pp->page && PageHuge(pp->page) &&
+			page_hstate(compound_head(pp->page)) == h &&
+			page_to_nid(pp->page) != pp->node)
+			nr++;
+
+	if (alloc_huge_pages_node(h, pm->node, nr, &map->huge_pages)) {
+		page = take_reserved_huge_page(&map->huge_pages, h, pm->node);
+		if (page)
+			return page;
+	}
+
+	return alloc_huge_page_node(h, pm->node);
+}
+
+/*
+ * The target nodes of the pages migrate_pages() left on pagelist ran out of
+ * free memory. Get the pages there by exchanging them with cold pages.
+ */
+static int exchange_page_to_node_array(struct list_head *pagelist,
+				struct page_to_node_map *map,
+				enum migrate_mode mode)
+{
+	struct page *page, *page2;
+	int nr_remaining = 0;
+
+	list_for_each_entry_safe(page, page2, pagelist, lru) {
+		struct page_to_node *pm = page_to_node_lookup(map, page);
+
+		cond_resched();
+
+		if (pm && exchange_page_to_node(page, pm->node, mode) ==
+				MIGRATEPAGE_SUCCESS)
+			pm->status = pm->node;
+		else
+			nr_remaining++;
+	}
+
+	return nr_remaining ? -ENOMEM : 0;
+}
+
+/*
+ * Pages of a move_pages() chunk going between nodes in opposite directions
+ * do not need any free memory: they can be exchanged with each other.
+ *
+ * The pages that can be exchanged, base pages and THPs, are
+ * sorted by size, source node and target node. Each run of them is an edge
+ * of the graph of nodes, and the cycles of that graph are what gets
+ * exchanged. A cycle of k pages takes k - 1 exchanges, all with its first
+ * page: the i-th moves the data the first page holds by then to where it
+ * is going, and brings in the data of the (i + 1)-th page. A pair (k == 2)
+ * is done with one exchange, instead of two allocations and two copies.
+ */
+struct exchange_plan_edge {
+	bool thp;
+	int src;
+	int dst;
+	/* the pages of the edge; the last nr of them are not in a cycle yet */
+	struct page_to_node **pm;
+	int nr;
+	/* no cycle left through this edge */
+	bool dead;
+};
+
+struct exchange_plan {
+	struct page_to_node **pages;
+	int nr_pages;
+
+	struct exchange_plan_edge *edges;
+	int nr_edges;
+
+	/* the walk looking for a cycle: its edges, and where each node is on it */
+	int *path;
+	int *pos;
+
+	/* the pages of each cycle, in cycle order, back to back */
+	struct page_to_node **cycles;
+	int *cycle_start;
+	int nr_cycles;
+};
+
+static int exchange_plan_cmp(const void *a, const void *b)
+{
+	struct page_to_node *pa = *(struct page_to_node **)a;
+	struct page_to_node *pb = *(struct page_to_node **)b;
+
+	if (PageTransHuge(pa->page) != PageTransHuge(pb->page))
+		return PageTransHuge(pa->page) ? 1 : -1;
+	if (page_to_nid(pa->page) != page_to_nid(pb->page))
+		return page_to_nid(pa->page) - page_to_nid(pb->page);
+	return pa->node - pb->node;
+}
+
+/* Edges are sorted as their pages: binary search for the first out of nid */
+static int exchange_plan_next_edge(struct exchange_plan *plan, bool thp,
+				int nid)
+{
+	int lo = 0, hi = plan->nr_edges;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		struct exchange_plan_edge *edge = &plan->edges[mid];
+
+		if (edge->thp < thp || (edge->thp == thp && edge->src < nid))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < plan->nr_edges; lo++) {
+		struct exchange_plan_edge *edge = &plan->edges[lo];
+
+		if (edge->thp != thp || edge->src != nid)
+			break;
+		if (edge->nr && !edge->dead)
+			return lo;
+	}
+
+	return -1;
+}
+
+/* Take as many cycles along the len edges of path as they have pages for */
+static void exchange_plan_take_cycles(struct exchange_plan *plan, int *path,
+				int len)
+{
+	struct page_to_node **cycle = plan->cycles +
+				plan->cycle_start[plan->nr_cycles];
+	int nr = INT_MAX;
+	int i;
+
+	for (i = 0; i < len; i++)
+		nr = min(nr, plan->edges[path[i]].nr);
+
+	while (nr--) {
+		for (i = 0; i < len; i++) {
+			struct exchange_plan_edge *edge = &plan->edges[path[i]];
+
+			*cycle++ = edge->pm[--edge->nr];
+		}
+		plan->nr_cycles++;
+		plan->cycle_start[plan->nr_cycles] =
+			plan->cycle_start[plan->nr_cycles - 1] + len;
+	}
+}
+
+/*
+ * Walk the graph from edge e until the walk comes back to a node it went
+ * through, which closes a cycle. Edges the walk gets stuck on lead to a
+ * node with no way out, so there is no cycle through them.
+ */
+static void exchange_plan_walk(struct exchange_plan *plan, int e)
+{
+	int len = 0;
+	int i;
+
+	plan->pos[plan->edges[e].src] = len;
+	plan->path[len++] = e;
+
+	while (len) {
+		struct exchange_plan_edge *last = &plan->edges[plan->path[len - 1]];
+		int nid = last->dst;
+
+		if (plan->pos[nid] >= 0) {
+			exchange_plan_take_cycles(plan, plan->path + plan->pos[nid],
+					len - plan->pos[nid]);
+			break;
+		}
+
+		e = exchange_plan_next_edge(plan, last->thp, nid);
+		if (e < 0) {
+			last->dead = true;
+			plan->pos[last->src] = -1;
+			len--;
+			continue;
+		}
+
+		plan->pos[nid] = len;
+		plan->path[len++] = e;
+	}
+
+	for (i = 0; i < len; i++)
+		plan->pos[plan->edges[plan->path[i]].src] = -1;
+}
+
+static int exchange_plan_build(struct exchange_plan *plan,
+				struct list_head *pagelist,
+				struct page_to_node_map *map)
+{
+	struct page *page;
+	int i;
+
+	list_for_each_entry(page, pagelist, lru) {
+		struct page_to_node *pm;
+
+		if (PageHuge(page) || PageKsm(page) || !page_exchangeable(page))
+			continue;
+
+		pm = page_to_node_lookup(map, page);
+		if (pm)
+			plan->pages[plan->nr_pages++] = pm;
+	}
+
+	if (plan->nr_pages < 2)
+		return 0;
+
+	sort(plan->pages, plan->nr_pages, sizeof(*plan->pages),
+			exchange_plan_cmp, NULL);
+
+	for (i = 0; i < plan->nr_pages; i++) {
+		struct page_to_node *pm = plan->pages[i];
+		struct exchange_plan_edge *edge = &plan->edges[plan->nr_edges];
+
+		if (i && !exchange_plan_cmp(&plan->pages[i - 1], &pm)) {
+			edge[-1].nr++;
+			continue;
+		}
+
+		edge->thp = PageTransHuge(pm->page);
+		edge->src = page_to_nid(pm->page);
+		edge->dst = pm->node;
+		edge->pm = &plan->pages[i];
+		edge->nr = 1;
+		edge->dead = false;
+		plan->nr_edges++;
+	}
+
+	for (i = 0; i < nr_node_ids; i++)
+		plan->pos[i] = -1;
+
+	for (i = 0; i < plan->nr_edges; i++)
+		while (plan->edges[i].nr && !plan->edges[i].dead)
+			exchange_plan_walk(plan, i);
+
+	return plan->nr_cycles;
+}
+
+/*
+ * Put a page of a failed exchange back on pagelist, isolated and counted
+ * as do_move_page_to_node_array() left it. If exchange_pages_concur() put
+ * it back already, the reference taken for the exchange keeps it around
+ * until it is isolated again.
+ */
+static void exchange_plan_requeue(struct page *page, struct page_to_node *pm,
+				bool put_back, struct list_head *pagelist)
+{
+	if (put_back) {
+		int err = isolate_lru_page(page);
+
+		put_page(page);
+		if (err) {
+			pm->status = err;
+			return;
+		}
+	}
+
+	inc_zone_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+	list_add_tail(&page->lru, pagelist);
+}
+
+/*
+ * A step of a cycle failed: what is left of it, the two pages of the
+ * failed exchange included, is migrated the usual way.
+ */
+static void exchange_plan_abort(struct page_to_node_map *map,
+				struct page_to_node **cycle, int len, int step,
+				struct exchange_page_info *pair,
+				struct list_head *pagelist)
+{
+	struct page *first = cycle[0]->page;
+	int i;
+
+	/* the first page holds the data of the previous one by now */
+	if (step > 1) {
+		hlist_del_init(&cycle[0]->hnode);
+		hlist_del_init(&cycle[step - 1]->hnode);
+		cycle[step - 1]->page = first;
+		page_to_node_map_add(map, cycle[step - 1]);
+	}
+
+	exchange_plan_requeue(first, cycle[step - 1], !pair->keep_from_page,
+				pagelist);
+	exchange_plan_requeue(cycle[step]->page, cycle[step], true, pagelist);
+
+	for (i = step + 1; i < len; i++)
+		list_add_tail(&cycle[i]->page->lru, pagelist);
+}
+
+/*
+ * Exchange the pages of the chunk on pagelist that are in cycles across
+ * nodes, see struct exchange_plan_edge. They are taken off pagelist, which
+ * is left with the pages to migrate.
+ */
+static void exchange_page_cycles(struct list_head *pagelist,
+				struct page_to_node_map *map,
+				enum migrate_mode mode)
+{
+	struct exchange_plan plan = {};
+	struct exchange_page_info *pairs = NULL;
+	struct page *page;
+	int nr_pages = 0;
+	int max_len = 0;
+	int c, step;
+
+	list_for_each_entry(page, pagelist, lru)
+		nr_pages++;
+	if (nr_pages < 2)
+		return;
+
+	plan.pages = vmalloc(nr_pages * sizeof(*plan.pages));
+	plan.edges = vmalloc(nr_pages * sizeof(*plan.edges));
+	plan.cycles = vmalloc(nr_pages * sizeof(*plan.cycles));
+	plan.cycle_start = vmalloc((nr_pages / 2 + 1) *
+				sizeof(*plan.cycle_start));
+	plan.path = kmalloc_array(nr_node_ids, sizeof(int), GFP_KERNEL);
+	plan.pos = kmalloc_array(nr_node_ids, sizeof(int), GFP_KERNEL);
+	if (!plan.pages || !plan.edges || !plan.cycles || !plan.cycle_start ||
+		!plan.path || !plan.pos)
+		goto out;
+
+	plan.cycle_start[0] = 0;
+	if (!exchange_plan_build(&plan, pagelist, map))
+		goto out;
+
+	pairs = vzalloc(plan.nr_cycles * sizeof(*pairs));
+	if (!pairs)
+		goto out;
+
+	for (c = 0; c < plan.nr_cycles; c++) {
+		int len = plan.cycle_start[c + 1] - plan.cycle_start[c];
+		int i;
+
+		for (i = 0; i < len; i++)
+			list_del_init(&plan.cycles[plan.cycle_start[c] + i]->page->lru);
+		max_len = max(max_len, len);
+	}
+
+	for (step = 1; step < max_len; step++) {
+		struct exchange_page_info *pair;
+		LIST_HEAD(exchange_list);
+
+		for (c = 0; c < plan.nr_cycles; c++) {
+			struct page_to_node **cycle = plan.cycles +
+						plan.cycle_start[c];
+			int len = plan.cycle_start[c + 1] - plan.cycle_start[c];
+
+			pair = &pairs[c];
+			/* done, or the previous step failed */
+			if (step >= len || (step > 1 && !pair->exchanged))
+				continue;
+
+			memset(pair, 0, sizeof(*pair));
+			pair->from_page = cycle[0]->page;
+			pair->to_page = cycle[step]->page;
+			pair->keep_from_page = step + 1 < len;
+
+			/*
+			 * Pages are put back once exchanged. The first one
+			 * is counted out as it was isolated, before it holds
+			 * the data of the others.
+			 */
+			dec_zone_page_state(pair->to_page, NR_ISOLATED_ANON +
+					page_is_file_cache(pair->to_page));
+			if (step == 1)
+				dec_zone_page_state(pair->from_page,
+					NR_ISOLATED_ANON +
+					page_is_file_cache(pair->from_page));
+
+			/* to isolate them again if the exchange fails */
+			get_page(pair->to_page);
+			if (!pair->keep_from_page)
+				get_page(pair->from_page);
+
+			list_add_tail(&pair->list, &exchange_list);
+		}
+
+		exchange_pages_concur(&exchange_list, mode, MR_SYSCALL);
+
+		/* failed pairs were put back, maybe on another CPU's pagevec */
+		list_for_each_entry(pair, &exchange_list, list)
+			if (!pair->exchanged) {
+				lru_add_drain_all();
+				break;
+			}
+
+		list_for_each_entry(pair, &exchange_list, list) {
+			c = pair - pairs;
+
+			if (!pair->exchanged) {
+				exchange_plan_abort(map,
+					plan.cycles + plan.cycle_start[c],
+					plan.cycle_start[c + 1] - plan.cycle_start[c],
+					step, pair, pagelist);
+				continue;
+			}
+
+			put_page(plan.cycles[plan.cycle_start[c] + step]->page);
+			if (!pair->keep_from_page)
+				put_page(plan.cycles[plan.cycle_start[c]]->page);
+
+			plan.cycles[plan.cycle_start[c] + step - 1]->status =
+				plan.cycles[plan.cycle_start[c] + step - 1]->node;
+			if (!pair->keep_from_page)
+				plan.cycles[plan.cycle_start[c] + step]->status =
+					plan.cycles[plan.cycle_start[c] + step]->node;
+		}
+	}
+
+out:
+	vfree(pairs);
+	kfree(plan.pos);
+	kfree(plan.path);
+	vfree(plan.cycle_start);
+	vfree(plan.cycles);
+	vfree(plan.edges);
+	vfree(plan.pages);
+}
+
+/*
+ * Move a set of pages as indicated in the pm array. The addr
+ * field must be set to the virtual address of the page to be moved
+ * and the node number must contain a valid target node.
+ * The pm array ends with node = MAX_NUMNODES.
+ */
+static int do_move_page_to_node_array(struct mm_struct *mm,
+				      struct page_to_node_map *map,
+				      int migrate_all,
+					  int migrate_use_dma,
+					  int migrate_use_mt,
+					  int migrate_concur)
+{
+	int err;
+	struct page_to_node *pp;
+	LIST_HEAD(pagelist);
+	enum migrate_mode mode = MIGRATE_SYNC;
+
+	if (migrate_use_mt)
+		mode |= MIGRATE_MT;
+	else if (migrate_use_dma)
+		mode |= MIGRATE_DMA;
+	if (rdonly_page_migration)
+		mode |= MIGRATE_RDONLY;
+
+	page_to_node_map_init(map);
+
+	down_read(&mm->mmap_sem);
+
+	/*
+	 * Build a list of pages to migrate
+	 */
+	for (pp = map->pm; pp->node != MAX_NUMNODES; pp++) {
+		struct vm_area_struct *vma;
 		struct page *page;
 		unsigned int follflags;
 
+		pp->page = NULL;
+
 		err = -EFAULT;
 		vma = find_vma(mm, pp->addr);
 		if (!vma || pp->addr < vma->vm_start || !vma_migratable(vma))
@@ -1875,8 +3415,8 @@ static int do_move_page_to_node_array(struct mm_struct *mm,
 			goto put_and_set;
 
 		if (PageHuge(page)) {
-			if (PageHead(page))
-				isolate_huge_page(page, &pagelist);
+			if (PageHead(page) && isolate_huge_page(page, &pagelist))
+				page_to_node_map_add(map, pp);
 			goto put_and_set;
 		} else if (PageTransCompound(page)) {
 			if (PageTail(page)) {
@@ -1890,6 +3430,7 @@ static int do_move_page_to_node_array(struct mm_struct *mm,
 			list_add_tail(&page->lru, &pagelist);
 			inc_zone_page_state(page, NR_ISOLATED_ANON +
 					    page_is_file_cache(page));
+			page_to_node_map_add(map, pp);
 		}
 put_and_set:
 		/*
@@ -1902,203 +3443,845 @@ set_status:
 		pp->status = err;
 	}
 
+	/*
+	 * The isolated pages hold a reference and are found through the
+	 * rmap from now on, so mmap_sem is not needed past this point. Do
+	 * not make mmap()/munmap() in the task wait for the copy.
+	 */
+	up_read(&mm->mmap_sem);
+
+	/* pages going both ways between nodes are swapped, not migrated */
+	exchange_page_cycles(&pagelist, map, mode);
+
 	err = 0;
 	if (!list_empty(&pagelist)) {
 		if (migrate_concur) {
-			err = migrate_pages_concur(&pagelist, new_page_node, NULL,
-					(unsigned long)pm, 
+			struct page *page, *page2;
+
+			err = migrate_pages_concur(&pagelist, new_page_node_batch,
+					NULL, (unsigned long)map,
 					mode,
 					MR_SYSCALL);
+
+			list_for_each_entry_safe(page, page2, &map->huge_pages, lru)
+				putback_active_hugepage(page);
 		} else {
 			err = migrate_pages(&pagelist, new_page_node, NULL,
-					(unsigned long)pm, 
+					(unsigned long)map, 
 					mode,
 					MR_SYSCALL);
 		}
+		if (err == -ENOMEM)
+			err = exchange_page_to_node_array(&pagelist, map, mode);
+		if (err)
+			putback_movable_pages(&pagelist);
+	}
+
+	return err;
+}
+
+/* Check a move_pages() target node against the nodes the task may use */
+static int move_pages_check_node(int node, const nodemask_t *task_nodes)
+{
+	if (node < 0 || node >= MAX_NUMNODES)
+		return -ENODEV;
+
+	if (!node_state(node, N_MEMORY))
+		return -ENODEV;
+
+	if (!node_isset(node, *task_nodes))
+		return -EACCES;
+
+	return 0;
+}
+
+/*
+ * Migrate an array of page address onto an array of nodes and fill
+ * the corresponding array of status.
+ */
+static int do_pages_move(struct mm_struct *mm, nodemask_t task_nodes,
+			 unsigned long nr_pages,
+			 const void __user * __user *pages,
+			 const int __user *nodes,
+			 int __user *status, int flags)
+{
+	struct page_to_node_map map;
+	struct page_to_node *pm;
+	unsigned long chunk_nr_pages;
+	unsigned long chunk_start;
+	int err;
+
+	err = page_to_node_map_alloc(&map, nr_pages);
+	if (err)
+		goto out;
+	pm = map.pm;
+
+	chunk_nr_pages = min_t(unsigned long, nr_pages, MOVE_PAGES_CHUNK_NR);
+
+	migrate_prep();
+
+	for (chunk_start = 0;
+	     chunk_start < nr_pages;
+	     chunk_start += chunk_nr_pages) {
+		int j;
+
+		if (chunk_start + chunk_nr_pages > nr_pages)
+			chunk_nr_pages = nr_pages - chunk_start;
+
+		/* fill the chunk pm with addrs and nodes from user-space */
+		for (j = 0; j < chunk_nr_pages; j++) {
+			const void __user *p;
+			int node;
+
+			err = -EFAULT;
+			if (get_user(p, pages + j + chunk_start))
+				goto out_pm;
+			pm[j].addr = (unsigned long) p;
+
+			if (get_user(node, nodes + j + chunk_start))
+				goto out_pm;
+
+			err = move_pages_check_node(node, &task_nodes);
+			if (err)
+				goto out_pm;
+
+			pm[j].node = node;
+		}
+
+		/* End marker for this chunk */
+		pm[chunk_nr_pages].node = MAX_NUMNODES;
+
+		/* Migrate this chunk */
+		err = do_move_page_to_node_array(mm, &map,
+						 flags & MPOL_MF_MOVE_ALL,
+						 flags & MPOL_MF_MOVE_DMA,
+						 flags & MPOL_MF_MOVE_MT,
+						 flags & MPOL_MF_MOVE_CONCUR);
+		if (err < 0)
+			goto out_pm;
+
+		/* Return status information */
+		for (j = 0; j < chunk_nr_pages; j++)
+			if (put_user(pm[j].status, status + j + chunk_start)) {
+				err = -EFAULT;
+				goto out_pm;
+			}
+	}
+	err = 0;
+
+out_pm:
+	page_to_node_map_free(&map);
+out:
+	return err;
+}
+
+/*
+ * Determine the nodes of an array of pages and store it in an array of status.
+ */
+static void do_pages_stat_array(struct mm_struct *mm, unsigned long nr_pages,
+				const void __user **pages, int *status)
+{
+	unsigned long i;
+
+	down_read(&mm->mmap_sem);
+
+	for (i = 0; i < nr_pages; i++) {
+		unsigned long addr = (unsigned long)(*pages);
+		struct vm_area_struct *vma;
+		struct page *page;
+		int err = -EFAULT;
+
+		vma = find_vma(mm, addr);
+		if (!vma || addr < vma->vm_start)
+			goto set_status;
+
+		/* FOLL_DUMP to ignore special (like zero) pages */
+		page = follow_page(vma, addr, FOLL_DUMP);
+
+		err = PTR_ERR(page);
+		if (IS_ERR(page))
+			goto set_status;
+
+		err = page ? page_to_nid(page) : -ENOENT;
+set_status:
+		*status = err;
+
+		pages++;
+		status++;
+	}
+
+	up_read(&mm->mmap_sem);
+}
+
+/*
+ * Determine the nodes of a user array of pages and store it in
+ * a user array of status.
+ */
+static int do_pages_stat(struct mm_struct *mm, unsigned long nr_pages,
+			 const void __user * __user *pages,
+			 int __user *status)
+{
+#define DO_PAGES_STAT_CHUNK_NR 16
+	const void __user *chunk_pages[DO_PAGES_STAT_CHUNK_NR];
+	int chunk_status[DO_PAGES_STAT_CHUNK_NR];
+
+	while (nr_pages) {
+		unsigned long chunk_nr;
+
+		chunk_nr = nr_pages;
+		if (chunk_nr > DO_PAGES_STAT_CHUNK_NR)
+			chunk_nr = DO_PAGES_STAT_CHUNK_NR;
+
+		if (copy_from_user(chunk_pages, pages, chunk_nr * sizeof(*chunk_pages)))
+			break;
+
+		do_pages_stat_array(mm, chunk_nr, chunk_pages, chunk_status);
+
+		if (copy_to_user(status, chunk_status, chunk_nr * sizeof(*status)))
+			break;
+
+		pages += chunk_nr;
+		status += chunk_nr;
+		nr_pages -= chunk_nr;
+	}
+	return nr_pages ? -EFAULT : 0;
+}
+
+/*
+ * Find the mm_struct of @pid and check that the caller may move its pages.
+ * The nodes the task may allocate from go to @task_nodes.
+ */
+static struct mm_struct *find_mm_struct(pid_t pid, nodemask_t *task_nodes)
+{
+	const struct cred *cred = current_cred(), *tcred;
+	struct task_struct *task;
+	struct mm_struct *mm;
+	int err;
+
+	/* Find the mm_struct */
+	rcu_read_lock();
+	task = pid ? find_task_by_vpid(pid) : current;
+	if (!task) {
+		rcu_read_unlock();
+		return ERR_PTR(-ESRCH);
+	}
+	get_task_struct(task);
+
+	/*
+	 * Check if this process has the right to modify the specified
+	 * process. The right exists if the process has administrative
+	 * capabilities, superuser privileges or the same
+	 * userid as the target process.
+	 */
+	tcred = __task_cred(task);
+	if (!uid_eq(cred->euid, tcred->suid) && !uid_eq(cred->euid, tcred->uid) &&
+	    !uid_eq(cred->uid,  tcred->suid) && !uid_eq(cred->uid,  tcred->uid) &&
+	    !capable(CAP_SYS_NICE)) {
+		rcu_read_unlock();
+		err = -EPERM;
+		goto out;
+	}
+	rcu_read_unlock();
+
+ 	err = security_task_movememory(task);
+ 	if (err)
+		goto out;
+
+	*task_nodes = cpuset_mems_allowed(task);
+	mm = get_task_mm(task);
+	put_task_struct(task);
+
+	if (!mm)
+		return ERR_PTR(-EINVAL);
+
+	return mm;
+
+out:
+	put_task_struct(task);
+	return ERR_PTR(err);
+}
+
+/*
+ * Move a list of pages in the address space of the currently executing
+ * process.
+ */
+SYSCALL_DEFINE6(move_pages, pid_t, pid, unsigned long, nr_pages,
+		const void __user * __user *, pages,
+		const int __user *, nodes,
+		int __user *, status, int, flags)
+{
+	struct mm_struct *mm;
+	int err;
+	nodemask_t task_nodes;
+
+	/* Check flags */
+	if (flags & ~(MPOL_MF_MOVE|MPOL_MF_MOVE_ALL|
+				  MPOL_MF_MOVE_DMA|MPOL_MF_MOVE_MT|
+				  MPOL_MF_MOVE_CONCUR))
+		return -EINVAL;
+
+	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	mm = find_mm_struct(pid, &task_nodes);
+	if (IS_ERR(mm))
+		return PTR_ERR(mm);
+
+	if (nodes)
+		err = do_pages_move(mm, task_nodes, nr_pages, pages,
+				    nodes, status, flags);
+	else
+		err = do_pages_stat(mm, nr_pages, pages, status);
+
+	mmput(mm);
+	return err;
+}
+
+/*
+ * Move all the pages mapped in a range of an address space to one node.
+ *
+ * The range is walked once, PMD mapped THPs are isolated whole and the
+ * isolated pages are migrated every MOVE_PAGES_CHUNK_NR pages, so that
+ * the concurrent path sees full batches without userspace having to list
+ * every base page like move_pages() wants.
+ */
+struct move_range_walk {
+	struct list_head pagelist;
+	int nr_isolated;
+	int node;
+	int flags;
+	/* where the walk resumes once the isolated pages are migrated */
+	unsigned long next;
+};
+
+static void move_range_add_page(struct page *page, struct move_range_walk *mrw)
+{
+	if (page_to_nid(page) == mrw->node)
+		return;
+
+	/* as in move_pages(), shared pages need MPOL_MF_MOVE_ALL */
+	if (!(mrw->flags & MPOL_MF_MOVE_ALL) && page_mapcount(page) > 1)
+		return;
+
+	if (isolate_lru_page(page))
+		return;
+
+	list_add_tail(&page->lru, &mrw->pagelist);
+	inc_zone_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+	mrw->nr_isolated++;
+}
+
+/* Stop the walk at @end if a chunk is full */
+static int move_range_chunk_full(struct move_range_walk *mrw,
+		unsigned long end)
+{
+	if (mrw->nr_isolated < MOVE_PAGES_CHUNK_NR)
+		return 0;
+
+	mrw->next = end;
+	return 1;
+}
+
+static int move_range_pmd(pmd_t *pmd, spinlock_t *ptl, unsigned long addr,
+		unsigned long end, struct mm_walk *walk)
+{
+	struct move_range_walk *mrw = walk->private;
+	struct page *page;
+	int ret;
+
+	if (unlikely(is_pmd_migration_entry(*pmd))) {
+		spin_unlock(ptl);
+		return 1;
+	}
+
+	page = pmd_page(*pmd);
+	if (is_huge_zero_page(page)) {
+		/* nothing to move */
+		spin_unlock(ptl);
+		return 1;
+	}
+
+	if ((end - addr != HPAGE_PMD_SIZE) || !thp_migration_supported()) {
+		get_page(page);
+		spin_unlock(ptl);
+		lock_page(page);
+		ret = split_huge_page(page);
+		unlock_page(page);
+		put_page(page);
+		/* walk the ptes of a split page, skip it otherwise */
+		return ret ? 1 : 0;
+	}
+
+	move_range_add_page(page, mrw);
+	spin_unlock(ptl);
+
+	return 1;
+}
+
+static int move_range_pte_range(pmd_t *pmd, unsigned long addr,
+		unsigned long end, struct mm_walk *walk)
+{
+	struct vm_area_struct *vma = walk->vma;
+	struct move_range_walk *mrw = walk->private;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *pte;
+	int ret;
+
+	ptl = pmd_trans_huge_lock(pmd, vma);
+	if (ptl && move_range_pmd(pmd, ptl, addr, end, walk))
+		return move_range_chunk_full(mrw, end);
+
+	if (pmd_trans_unstable(pmd))
+		return 0;
+retry:
+	pte = pte_offset_map_lock(walk->mm, pmd, addr, &ptl);
+	for (; addr != end; pte++, addr += PAGE_SIZE) {
+		if (!pte_present(*pte))
+			continue;
+		page = vm_normal_page(vma, addr, *pte);
+		if (!page)
+			continue;
+		/*
+		 * vm_normal_page() filters out zero pages, but there might
+		 * still be PageReserved pages to skip, perhaps in a VDSO.
+		 */
+		if (PageReserved(page))
+			continue;
+		if (page_to_nid(page) == mrw->node)
+			continue;
+		/* a THP mapped by ptes cannot be moved whole */
+		if (PageTransCompound(page) && PageAnon(page)) {
+			get_page(page);
+			pte_unmap_unlock(pte, ptl);
+			lock_page(page);
+			ret = split_huge_page(page);
+			unlock_page(page);
+			put_page(page);
+			/* Failed to split -- skip. */
+			if (ret) {
+				pte = pte_offset_map_lock(walk->mm, pmd,
+						addr, &ptl);
+				continue;
+			}
+			goto retry;
+		}
+
+		move_range_add_page(page, mrw);
+	}
+	pte_unmap_unlock(pte - 1, ptl);
+	cond_resched();
+
+	return move_range_chunk_full(mrw, end);
+}
+
+static int move_range_hugetlb(pte_t *pte, unsigned long hmask,
+		unsigned long addr, unsigned long end, struct mm_walk *walk)
+{
+#ifdef CONFIG_HUGETLB_PAGE
+	struct move_range_walk *mrw = walk->private;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t entry;
+
+	ptl = huge_pte_lock(hstate_vma(walk->vma), walk->mm, pte);
+	entry = huge_ptep_get(pte);
+	if (!pte_present(entry))
+		goto unlock;
+	page = pte_page(entry);
+	if (page_to_nid(page) == mrw->node)
+		goto unlock;
+	if (!(mrw->flags & MPOL_MF_MOVE_ALL) && page_mapcount(page) > 1)
+		goto unlock;
+	if (isolate_huge_page(page, &mrw->pagelist))
+		mrw->nr_isolated++;
+unlock:
+	spin_unlock(ptl);
+	return move_range_chunk_full(mrw, end);
+#else
+	BUG();
+	return 0;
+#endif
+}
+
+static int move_range_test_walk(unsigned long start, unsigned long end,
+		struct mm_walk *walk)
+{
+	struct vm_area_struct *vma = walk->vma;
+
+	/* skip the vmas move_pages() would fail with -EFAULT */
+	if (!vma_migratable(vma) || (vma->vm_flags & VM_PFNMAP))
+		return 1;
+
+	return 0;
+}
+
+static struct page *new_range_page(struct page *p, unsigned long node,
+		int **result)
+{
+	return alloc_migrate_target_node(p, node);
+}
+
+/*
+ * Returns the number of pages that could not be moved, or an error.
+ */
+static int do_move_pages_range(struct mm_struct *mm, unsigned long start,
+		unsigned long end, int node, int flags)
+{
+	struct move_range_walk mrw = {
+		.node = node,
+		.flags = flags,
+	};
+	struct mm_walk walk = {
+		.pmd_entry = move_range_pte_range,
+		.hugetlb_entry = move_range_hugetlb,
+		.test_walk = move_range_test_walk,
+		.mm = mm,
+		.private = &mrw,
+	};
+	enum migrate_mode mode = MIGRATE_SYNC;
+	int nr_failed = 0;
+	int err = 0;
+
+	if (flags & MPOL_MF_MOVE_MT)
+		mode |= MIGRATE_MT;
+	else if (flags & MPOL_MF_MOVE_DMA)
+		mode |= MIGRATE_DMA;
+	if (rdonly_page_migration)
+		mode |= MIGRATE_RDONLY;
+
+	migrate_prep();
+
+	while (start < end) {
+		INIT_LIST_HEAD(&mrw.pagelist);
+		mrw.nr_isolated = 0;
+		mrw.next = end;
+
+		down_read(&mm->mmap_sem);
+		err = walk_page_range(start, end, &walk);
+		if (err > 0)
+			err = 0;
+		up_read(&mm->mmap_sem);
+
+		if (!list_empty(&mrw.pagelist)) {
+			int rc;
+
+			if (flags & MPOL_MF_MOVE_CONCUR)
+				rc = migrate_pages_concur(&mrw.pagelist,
+						new_range_page, NULL, node,
+						mode, MR_SYSCALL);
+			else
+				rc = migrate_pages(&mrw.pagelist,
+						new_range_page, NULL, node,
+						mode, MR_SYSCALL);
+			if (rc)
+				putback_movable_pages(&mrw.pagelist);
+			if (rc < 0 && !err)
+				err = rc;
+			else if (rc > 0)
+				nr_failed += rc;
+		}
+
 		if (err)
-			putback_movable_pages(&pagelist);
+			break;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+
+		start = mrw.next;
 	}
 
-	up_read(&mm->mmap_sem);
+	return err ? err : nr_failed;
+}
+
+/*
+ * Move the pages mapped in [start, start + len) of a process to @node.
+ * Returns the number of pages that could not be moved.
+ */
+SYSCALL_DEFINE5(move_pages_range, pid_t, pid, unsigned long, start,
+		unsigned long, len, int, node, int, flags)
+{
+	struct mm_struct *mm;
+	unsigned long end;
+	nodemask_t task_nodes;
+	int err;
+
+	/* Check flags */
+	if (flags & ~(MPOL_MF_MOVE|MPOL_MF_MOVE_ALL|
+				  MPOL_MF_MOVE_DMA|MPOL_MF_MOVE_MT|
+				  MPOL_MF_MOVE_CONCUR))
+		return -EINVAL;
+
+	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
+		return -EPERM;
+
+	if (start & ~PAGE_MASK)
+		return -EINVAL;
+
+	len = (len + ~PAGE_MASK) & PAGE_MASK;
+	end = start + len;
+	if (end < start)
+		return -EINVAL;
+	if (end == start)
+		return 0;
+
+	if (node < 0 || node >= MAX_NUMNODES || !node_state(node, N_MEMORY))
+		return -ENODEV;
+
+	mm = find_mm_struct(pid, &task_nodes);
+	if (IS_ERR(mm))
+		return PTR_ERR(mm);
+
+	err = -EACCES;
+	if (node_isset(node, task_nodes))
+		err = do_move_pages_range(mm, start, end, node, flags);
+
+	mmput(mm);
 	return err;
 }
 
 /*
- * Migrate an array of page address onto an array of nodes and fill
- * the corresponding array of status.
+ * Asynchronous move_pages()
+ *
+ * move_pages_async() copies the request in, queues it to move_pages_wq and
+ * returns a file descriptor at once. The descriptor polls readable once the
+ * pages are moved; read() then returns the status array move_pages() would
+ * have filled, or the error that stopped the request. Closing it early
+ * cancels the chunks not started yet.
  */
-static int do_pages_move(struct mm_struct *mm, nodemask_t task_nodes,
-			 unsigned long nr_pages,
-			 const void __user * __user *pages,
-			 const int __user *nodes,
-			 int __user *status, int flags)
+struct move_pages_request {
+	struct kref ref;
+	struct work_struct work;
+
+	struct mm_struct *mm;
+	int flags;
+	unsigned long nr_pages;
+	unsigned long *addrs;
+	int *nodes;
+	int *status;
+
+	bool cancelled;
+	bool done;
+	int err;
+	wait_queue_head_t wait;
+};
+
+static struct workqueue_struct *move_pages_wq;
+
+/*
+ * The request is copied in whole, about 16 bytes per entry, so it is
+ * capped and charged to the memcg of the caller.
+ */
+#define MOVE_PAGES_ASYNC_MAX_NR	(64 * MOVE_PAGES_CHUNK_NR)
+#define MOVE_PAGES_ASYNC_GFP	(GFP_KERNEL | __GFP_ACCOUNT | __GFP_NOWARN)
+
+static void move_pages_request_release(struct kref *ref)
 {
-	struct page_to_node *pm;
+	struct move_pages_request *req = container_of(ref,
+				struct move_pages_request, ref);
+
+	if (req->mm)
+		mmput(req->mm);
+	vfree(req->status);
+	vfree(req->nodes);
+	vfree(req->addrs);
+	kfree(req);
+}
+
+static void move_pages_request_put(struct move_pages_request *req)
+{
+	kref_put(&req->ref, move_pages_request_release);
+}
+
+static void move_pages_async_work(struct work_struct *work)
+{
+	struct move_pages_request *req = container_of(work,
+				struct move_pages_request, work);
+	struct page_to_node_map map;
 	unsigned long chunk_nr_pages;
 	unsigned long chunk_start;
 	int err;
 
-	err = -ENOMEM;
-	pm = (struct page_to_node *)__get_free_page(GFP_KERNEL);
-	if (!pm)
+	err = page_to_node_map_alloc(&map, req->nr_pages);
+	if (err)
 		goto out;
 
-	migrate_prep();
+	chunk_nr_pages = min_t(unsigned long, req->nr_pages, MOVE_PAGES_CHUNK_NR);
 
-	/*
-	 * Store a chunk of page_to_node array in a page,
-	 * but keep the last one as a marker
-	 */
-	chunk_nr_pages = (PAGE_SIZE / sizeof(struct page_to_node)) - 1;
+	migrate_prep();
 
 	for (chunk_start = 0;
-	     chunk_start < nr_pages;
+	     chunk_start < req->nr_pages;
 	     chunk_start += chunk_nr_pages) {
 		int j;
 
-		if (chunk_start + chunk_nr_pages > nr_pages)
-			chunk_nr_pages = nr_pages - chunk_start;
-
-		/* fill the chunk pm with addrs and nodes from user-space */
-		for (j = 0; j < chunk_nr_pages; j++) {
-			const void __user *p;
-			int node;
-
-			err = -EFAULT;
-			if (get_user(p, pages + j + chunk_start))
-				goto out_pm;
-			pm[j].addr = (unsigned long) p;
-
-			if (get_user(node, nodes + j + chunk_start))
-				goto out_pm;
-
-			err = -ENODEV;
-			if (node < 0 || node >= MAX_NUMNODES)
-				goto out_pm;
-
-			if (!node_state(node, N_MEMORY))
-				goto out_pm;
+		if (READ_ONCE(req->cancelled)) {
+			err = -ECANCELED;
+			break;
+		}
 
-			err = -EACCES;
-			if (!node_isset(node, task_nodes))
-				goto out_pm;
+		if (chunk_start + chunk_nr_pages > req->nr_pages)
+			chunk_nr_pages = req->nr_pages - chunk_start;
 
-			pm[j].node = node;
+		for (j = 0; j < chunk_nr_pages; j++) {
+			map.pm[j].addr = req->addrs[chunk_start + j];
+			map.pm[j].node = req->nodes[chunk_start + j];
 		}
+		map.pm[chunk_nr_pages].node = MAX_NUMNODES;
 
-		/* End marker for this chunk */
-		pm[chunk_nr_pages].node = MAX_NUMNODES;
-
-		/* Migrate this chunk */
-		err = do_move_page_to_node_array(mm, pm,
-						 flags & MPOL_MF_MOVE_ALL,
-						 flags & MPOL_MF_MOVE_DMA,
-						 flags & MPOL_MF_MOVE_MT,
-						 flags & MPOL_MF_MOVE_CONCUR);
+		err = do_move_page_to_node_array(req->mm, &map,
+						 req->flags & MPOL_MF_MOVE_ALL,
+						 req->flags & MPOL_MF_MOVE_DMA,
+						 req->flags & MPOL_MF_MOVE_MT,
+						 req->flags & MPOL_MF_MOVE_CONCUR);
 		if (err < 0)
-			goto out_pm;
+			break;
+		err = 0;
 
-		/* Return status information */
 		for (j = 0; j < chunk_nr_pages; j++)
-			if (put_user(pm[j].status, status + j + chunk_start)) {
-				err = -EFAULT;
-				goto out_pm;
-			}
+			req->status[chunk_start + j] = map.pm[j].status;
+
+		cond_resched();
 	}
-	err = 0;
 
-out_pm:
-	free_page((unsigned long)pm);
+	page_to_node_map_free(&map);
 out:
-	return err;
+	req->err = err;
+	/* status and err are visible before done */
+	smp_wmb();
+	WRITE_ONCE(req->done, true);
+	wake_up_all(&req->wait);
+
+	move_pages_request_put(req);
 }
 
-/*
- * Determine the nodes of an array of pages and store it in an array of status.
- */
-static void do_pages_stat_array(struct mm_struct *mm, unsigned long nr_pages,
-				const void __user **pages, int *status)
+static unsigned int move_pages_async_poll(struct file *file, poll_table *wait)
 {
-	unsigned long i;
+	struct move_pages_request *req = file->private_data;
 
-	down_read(&mm->mmap_sem);
+	poll_wait(file, &req->wait, wait);
 
-	for (i = 0; i < nr_pages; i++) {
-		unsigned long addr = (unsigned long)(*pages);
-		struct vm_area_struct *vma;
-		struct page *page;
-		int err = -EFAULT;
+	return READ_ONCE(req->done) ? POLLIN | POLLRDNORM : 0;
+}
 
-		vma = find_vma(mm, addr);
-		if (!vma || addr < vma->vm_start)
-			goto set_status;
+static ssize_t move_pages_async_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct move_pages_request *req = file->private_data;
+	size_t size = req->nr_pages * sizeof(int);
+	int err;
 
-		/* FOLL_DUMP to ignore special (like zero) pages */
-		page = follow_page(vma, addr, FOLL_DUMP);
+	if (count < size)
+		return -EINVAL;
 
-		err = PTR_ERR(page);
-		if (IS_ERR(page))
-			goto set_status;
+	if (!READ_ONCE(req->done)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		err = wait_event_interruptible(req->wait, READ_ONCE(req->done));
+		if (err)
+			return err;
+	}
+	smp_rmb();
 
-		err = page ? page_to_nid(page) : -ENOENT;
-set_status:
-		*status = err;
+	if (req->err)
+		return req->err;
 
-		pages++;
-		status++;
-	}
+	if (copy_to_user(buf, req->status, size))
+		return -EFAULT;
 
-	up_read(&mm->mmap_sem);
+	return size;
 }
 
-/*
- * Determine the nodes of a user array of pages and store it in
- * a user array of status.
- */
-static int do_pages_stat(struct mm_struct *mm, unsigned long nr_pages,
-			 const void __user * __user *pages,
-			 int __user *status)
+static int move_pages_async_release(struct inode *inode, struct file *file)
 {
-#define DO_PAGES_STAT_CHUNK_NR 16
-	const void __user *chunk_pages[DO_PAGES_STAT_CHUNK_NR];
-	int chunk_status[DO_PAGES_STAT_CHUNK_NR];
+	struct move_pages_request *req = file->private_data;
 
-	while (nr_pages) {
-		unsigned long chunk_nr;
+	WRITE_ONCE(req->cancelled, true);
+	move_pages_request_put(req);
 
-		chunk_nr = nr_pages;
-		if (chunk_nr > DO_PAGES_STAT_CHUNK_NR)
-			chunk_nr = DO_PAGES_STAT_CHUNK_NR;
+	return 0;
+}
 
-		if (copy_from_user(chunk_pages, pages, chunk_nr * sizeof(*chunk_pages)))
-			break;
+static const struct file_operations move_pages_async_fops = {
+	.poll		= move_pages_async_poll,
+	.read		= move_pages_async_read,
+	.release	= move_pages_async_release,
+	.llseek		= noop_llseek,
+};
 
-		do_pages_stat_array(mm, chunk_nr, chunk_pages, chunk_status);
+static struct move_pages_request *move_pages_request_alloc(
+		unsigned long nr_pages,
+		const void __user * __user *pages,
+		const int __user *nodes,
+		const nodemask_t *task_nodes)
+{
+	struct move_pages_request *req;
+	unsigned long i;
+	int err = -ENOMEM;
+
+	req = kzalloc(sizeof(struct move_pages_request),
+			GFP_KERNEL | __GFP_ACCOUNT);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&req->ref);
+	INIT_WORK(&req->work, move_pages_async_work);
+	init_waitqueue_head(&req->wait);
+	req->nr_pages = nr_pages;
+
+	req->addrs = __vmalloc(nr_pages * sizeof(unsigned long),
+				MOVE_PAGES_ASYNC_GFP, PAGE_KERNEL);
+	req->nodes = __vmalloc(nr_pages * sizeof(int),
+				MOVE_PAGES_ASYNC_GFP, PAGE_KERNEL);
+	req->status = __vmalloc(nr_pages * sizeof(int),
+				MOVE_PAGES_ASYNC_GFP | __GFP_ZERO, PAGE_KERNEL);
+	if (!req->addrs || !req->nodes || !req->status)
+		goto out;
 
-		if (copy_to_user(status, chunk_status, chunk_nr * sizeof(*status)))
-			break;
+	for (i = 0; i < nr_pages; i++) {
+		const void __user *p;
+		int node;
 
-		pages += chunk_nr;
-		status += chunk_nr;
-		nr_pages -= chunk_nr;
+		err = -EFAULT;
+		if (get_user(p, pages + i))
+			goto out;
+		req->addrs[i] = (unsigned long) p;
+
+		if (get_user(node, nodes + i))
+			goto out;
+
+		err = move_pages_check_node(node, task_nodes);
+		if (err)
+			goto out;
+
+		req->nodes[i] = node;
+
+		if (!(i % MOVE_PAGES_CHUNK_NR))
+			cond_resched();
 	}
-	return nr_pages ? -EFAULT : 0;
+
+	return req;
+
+out:
+	move_pages_request_put(req);
+	return ERR_PTR(err);
 }
 
 /*
- * Move a list of pages in the address space of the currently executing
- * process.
+ * move_pages() without waiting for the pages to be moved. Returns a file
+ * descriptor to poll and read the status array from, see above.
  */
-SYSCALL_DEFINE6(move_pages, pid_t, pid, unsigned long, nr_pages,
+SYSCALL_DEFINE5(move_pages_async, pid_t, pid, unsigned long, nr_pages,
 		const void __user * __user *, pages,
-		const int __user *, nodes,
-		int __user *, status, int, flags)
+		const int __user *, nodes, int, flags)
 {
-	const struct cred *cred = current_cred(), *tcred;
-	struct task_struct *task;
+	struct move_pages_request *req;
 	struct mm_struct *mm;
-	int err;
 	nodemask_t task_nodes;
+	int fd;
 
 	/* Check flags */
 	if (flags & ~(MPOL_MF_MOVE|MPOL_MF_MOVE_ALL|
@@ -2109,55 +4292,50 @@ SYSCALL_DEFINE6(move_pages, pid_t, pid, unsigned long, nr_pages,
 	if ((flags & MPOL_MF_MOVE_ALL) && !capable(CAP_SYS_NICE))
 		return -EPERM;
 
-	/* Find the mm_struct */
-	rcu_read_lock();
-	task = pid ? find_task_by_vpid(pid) : current;
-	if (!task) {
-		rcu_read_unlock();
-		return -ESRCH;
+	if (!nr_pages)
+		return -EINVAL;
+	/* larger requests go through move_pages() or several fds */
+	if (nr_pages > MOVE_PAGES_ASYNC_MAX_NR)
+		return -E2BIG;
+
+	mm = find_mm_struct(pid, &task_nodes);
+	if (IS_ERR(mm))
+		return PTR_ERR(mm);
+
+	req = move_pages_request_alloc(nr_pages, pages, nodes, &task_nodes);
+	if (IS_ERR(req)) {
+		mmput(mm);
+		return PTR_ERR(req);
 	}
-	get_task_struct(task);
-
-	/*
-	 * Check if this process has the right to modify the specified
-	 * process. The right exists if the process has administrative
-	 * capabilities, superuser privileges or the same
-	 * userid as the target process.
-	 */
-	tcred = __task_cred(task);
-	if (!uid_eq(cred->euid, tcred->suid) && !uid_eq(cred->euid, tcred->uid) &&
-	    !uid_eq(cred->uid,  tcred->suid) && !uid_eq(cred->uid,  tcred->uid) &&
-	    !capable(CAP_SYS_NICE)) {
-		rcu_read_unlock();
-		err = -EPERM;
-		goto out;
+	req->mm = mm;
+	req->flags = flags;
+
+	/* one reference for the file, one for the work */
+	kref_get(&req->ref);
+
+	fd = anon_inode_getfd("[move_pages]", &move_pages_async_fops, req,
+			O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		move_pages_request_put(req);
+		move_pages_request_put(req);
+		return fd;
 	}
-	rcu_read_unlock();
-
- 	err = security_task_movememory(task);
- 	if (err)
-		goto out;
-
-	task_nodes = cpuset_mems_allowed(task);
-	mm = get_task_mm(task);
-	put_task_struct(task);
 
-	if (!mm)
-		return -EINVAL;
+	queue_work(move_pages_wq, &req->work);
 
-	if (nodes)
-		err = do_pages_move(mm, task_nodes, nr_pages, pages,
-				    nodes, status, flags);
-	else
-		err = do_pages_stat(mm, nr_pages, pages, status);
+	return fd;
+}
 
-	mmput(mm);
-	return err;
+static int __init move_pages_async_init(void)
+{
+	move_pages_wq = alloc_workqueue("move_pages",
+				WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!move_pages_wq)
+		return -ENOMEM;
 
-out:
-	put_task_struct(task);
-	return err;
+	return 0;
 }
+subsys_initcall(move_pages_async_init);
 
 #ifdef CONFIG_NUMA_BALANCING
 /*
@@ -2250,10 +4428,6 @@ static int numamigrate_isolate_page(pg_data_t *pgdat, struct page *page)
 
 	VM_BUG_ON_PAGE(compound_order(page) && !PageTransHuge(page), page);
 
-	/* Avoid migrating to a node that is nearly full */
-	if (!migrate_balanced_pgdat(pgdat, 1UL << compound_order(page)))
-		return 0;
-
 	if (isolate_lru_page(page))
 		return 0;
 
@@ -2297,6 +4471,7 @@ int migrate_misplaced_page(struct page *page, struct vm_area_struct *vma,
 			   int node)
 {
 	pg_data_t *pgdat = NODE_DATA(node);
+	bool balanced;
 	int isolated;
 	int nr_remaining;
 	LIST_HEAD(migratepages);
@@ -2317,14 +4492,36 @@ int migrate_misplaced_page(struct page *page, struct vm_area_struct *vma,
 	if (numamigrate_update_ratelimit(pgdat, 1))
 		goto out;
 
+	/*
+	 * Avoid migrating to a node that is nearly full. With
+	 * numa_exchange_migration set, the page gets there by being exchanged
+	 * with one of its cold pages instead, which is also what is left to
+	 * do when the allocation fails. The cold page moves to the node of
+	 * the page, so it counts against the rate limit of that node.
+	 */
+	balanced = migrate_balanced_pgdat(pgdat, 1);
+	if (!balanced && !numa_exchange_migration)
+		goto out;
+
 	isolated = numamigrate_isolate_page(pgdat, page);
 	if (!isolated)
 		goto out;
 
 	list_add(&page->lru, &migratepages);
-	nr_remaining = migrate_pages(&migratepages, alloc_misplaced_dst_page,
+
+	nr_remaining = 1;
+	if (balanced)
+		nr_remaining = migrate_pages(&migratepages,
+				     alloc_misplaced_dst_page,
 				     NULL, node, MIGRATE_ASYNC,
 				     MR_NUMA_MISPLACED);
+	if (nr_remaining && numa_exchange_migration &&
+		!list_empty(&migratepages) &&
+		!numamigrate_update_ratelimit(NODE_DATA(page_to_nid(page)), 1) &&
+		exchange_page_to_node(page, node, MIGRATE_ASYNC) ==
+			MIGRATEPAGE_SUCCESS)
+		nr_remaining = 0;
+
 	if (nr_remaining) {
 		if (!list_empty(&migratepages)) {
 			list_del(&page->lru);
@@ -2379,7 +4576,9 @@ int migrate_misplaced_transhuge_page(struct mm_struct *mm,
 		goto out_fail;
 	prep_transhuge_page(new_page);
 
-	isolated = numamigrate_isolate_page(pgdat, page);
+	/* Avoid migrating to a node that is nearly full */
+	isolated = migrate_balanced_pgdat(pgdat, HPAGE_PMD_NR) &&
+		numamigrate_isolate_page(pgdat, page);
 	if (!isolated) {
 		put_page(new_page);
 		goto out_fail;
@@ -608,7 +608,7 @@ void try_to_unmap_flush_dirty(void)
 		try_to_unmap_flush();
 }
 
-static void set_tlb_ubc_flush_pending(struct mm_struct *mm,
+void set_tlb_ubc_flush_pending(struct mm_struct *mm,
 		struct page *page, bool writable)
 {
 	struct tlbflush_unmap_batch *tlb_ubc = &current->tlb_ubc;
@@ -629,7 +629,7 @@ static void set_tlb_ubc_flush_pending(struct mm_struct *mm,
  * Returns true if the TLB flush should be deferred to the end of a batch of
  * unmap operations to reduce IPIs.
  */
-static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
+bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
 {
 	bool should_defer = false;
 
@@ -643,16 +643,6 @@ static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
 
 	return should_defer;
 }
-#else
-static void set_tlb_ubc_flush_pending(struct mm_struct *mm,
-		struct page *page, bool writable)
-{
-}
-
-static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
-{
-	return false;
-}
 #endif /* CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH */
 
 /*
@@ -1080,6 +1070,85 @@ int page_mkclean(struct page *page)
 }
 EXPORT_SYMBOL_GPL(page_mkclean);
 
+static int page_wrprotect_one(struct page *page, struct vm_area_struct *vma,
+			    unsigned long address, void *arg)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	bool *locked = arg;
+	pmd_t *pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+	int ret = 0;
+
+	/*
+	 * A write fault on a shared mapping without ->page_mkwrite reuses the
+	 * page without taking its lock, see wp_page_shared().
+	 */
+	if ((vma->vm_flags & VM_SHARED) &&
+		!(vma->vm_ops && vma->vm_ops->page_mkwrite)) {
+		*locked = false;
+		return SWAP_FAIL;
+	}
+
+	if (!page_check_address_transhuge(page, mm, address, &pmd, &pte, &ptl))
+		goto out;
+
+	if (pte) {
+		if (pte_write(*pte)) {
+			pte_t entry;
+
+			flush_cache_page(vma, address, pte_pfn(*pte));
+			entry = ptep_clear_flush(vma, address, pte);
+			entry = pte_wrprotect(entry);
+			set_pte_at(mm, address, pte, entry);
+			ret = 1;
+		}
+		pte_unmap(pte);
+	} else {
+		/*
+		 * do_huge_pmd_wp_page() reuses a THP mapped once without
+		 * taking its lock.
+		 */
+		spin_unlock(ptl);
+		*locked = false;
+		return SWAP_FAIL;
+	}
+
+	spin_unlock(ptl);
+
+	/* as in page_mkclean_one(), so that KVM drops its writable sptes */
+	if (ret)
+		mmu_notifier_invalidate_page(mm, address);
+out:
+	return SWAP_AGAIN;
+}
+
+/*
+ * Used by migration to copy a page while its mappings can still read it.
+ * The page must be locked. A write fault on a private or anonymous PTE
+ * mapping, or on a shared one with ->page_mkwrite, then waits for the page
+ * lock. On any other mapping the walk stops and false is returned: the
+ * page can be written while it is copied. hugetlb pages are not handled.
+ */
+bool page_wrprotect(struct page *page)
+{
+	bool locked = true;
+	struct rmap_walk_control rwc = {
+		.rmap_one = page_wrprotect_one,
+		.arg = &locked,
+	};
+
+	VM_BUG_ON_PAGE(!PageLocked(page), page);
+	VM_BUG_ON_PAGE(PageHuge(page), page);
+
+	if (!page_mapped(page))
+		return true;
+
+	rmap_walk(page, &rwc);
+
+	return locked;
+}
+
 /**
  * page_move_anon_rmap - move a page to our anon_vma
  * @page:	the page to move to our anon_vma
@@ -1414,7 +1483,7 @@ static int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 
 	if (!PageHuge(page) && PageTransHuge(page)) {
 		VM_BUG_ON_PAGE(!(flags & TTU_MIGRATION), page);
-		return set_pmd_migration_entry(page, mm, address);
+		return set_pmd_migration_entry(page, vma, address, flags);
 	}
 
 	/* munlock has nothing to gain from examining un-locked vmas */
@@ -0,0 +1,198 @@
+/*
+ * Exchange a THP with the base pages of another pmd range through
+ * exchange_pages(), then migrate both ranges with move_pages(). Migration
+ * walks the rmap of every page, so it fails or crashes if the exchange
+ * left a page pointing at its old place.
+ *
+ * Run as root: pagemap only shows pfns to CAP_SYS_ADMIN.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "../kselftest.h"
+
+#define PAGE_SHIFT 12
+#define HPAGE_SHIFT 21
+
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define HPAGE_SIZE (1 << HPAGE_SHIFT)
+#define HPAGE_NR (HPAGE_SIZE / PAGE_SIZE)
+
+#define PAGEMAP_PRESENT(ent)	(((ent) & (1ull << 63)) != 0)
+#define PAGEMAP_PFN(ent)	((ent) & ((1ull << 55) - 1))
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE	(1 << 1)
+#endif
+
+/*
+ * The syscall is not wired up in every table: pass its number with
+ * EXTRA_CFLAGS=-D__NR_exchange_pages=<nr> where it is not.
+ */
+#ifndef __NR_exchange_pages
+#define __NR_exchange_pages -1
+#endif
+
+static int pagemap_fd;
+
+static long exchange_pages(unsigned long nr_pages, void **from_pages,
+			   void **to_pages, int *status)
+{
+	return syscall(__NR_exchange_pages, 0, nr_pages, from_pages,
+		       to_pages, status, 0);
+}
+
+static long move_pages(unsigned long nr_pages, void **pages,
+		       const int *nodes, int *status)
+{
+	return syscall(SYS_move_pages, 0, nr_pages, pages, nodes, status,
+		       MPOL_MF_MOVE);
+}
+
+/* 1 if ptr is mapped by a THP, 0 if not, -1 if not present */
+static int is_transhuge(char *ptr)
+{
+	uint64_t ent[2];
+
+	if (pread(pagemap_fd, ent, sizeof(ent),
+			(uintptr_t)ptr >> (PAGE_SHIFT - 3)) != sizeof(ent))
+		err(2, "read pagemap");
+
+	if (!PAGEMAP_PRESENT(ent[0]) || !PAGEMAP_PRESENT(ent[1]))
+		return -1;
+
+	return PAGEMAP_PFN(ent[0]) + 1 == PAGEMAP_PFN(ent[1]) &&
+		!(PAGEMAP_PFN(ent[0]) & (HPAGE_NR - 1));
+}
+
+static void fill(char *ptr, int seed)
+{
+	int i;
+
+	for (i = 0; i < HPAGE_NR; i++)
+		memset(ptr + i * PAGE_SIZE, seed + i, PAGE_SIZE);
+}
+
+static int check(char *ptr, int seed, const char *what)
+{
+	int i, j;
+
+	for (i = 0; i < HPAGE_NR; i++)
+		for (j = 0; j < PAGE_SIZE; j++)
+			if (ptr[i * PAGE_SIZE + j] != (char)(seed + i)) {
+				printf("%s: wrong data in page %d\n", what, i);
+				return 1;
+			}
+
+	return 0;
+}
+
+/* move every page of both ranges to node, 0 if they all got there */
+static int migrate(char *thp, char *base, int node)
+{
+	void *pages[2 * HPAGE_NR];
+	int nodes[2 * HPAGE_NR], status[2 * HPAGE_NR];
+	int i;
+
+	for (i = 0; i < HPAGE_NR; i++) {
+		pages[i] = thp + i * PAGE_SIZE;
+		pages[HPAGE_NR + i] = base + i * PAGE_SIZE;
+	}
+	for (i = 0; i < 2 * HPAGE_NR; i++)
+		nodes[i] = node;
+
+	if (move_pages(2 * HPAGE_NR, pages, nodes, status))
+		return -errno;
+
+	for (i = 0; i < 2 * HPAGE_NR; i++)
+		if (status[i] != node) {
+			printf("page %d not moved to node %d: %d\n",
+			       i, node, status[i]);
+			return 1;
+		}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	void *from, *to;
+	char *area, *thp, *base;
+	int status, ret;
+
+	if (__NR_exchange_pages < 0) {
+		printf("exchange_pages() has no syscall number, skipping\n");
+		return ksft_exit_skip();
+	}
+
+	pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	if (pagemap_fd < 0)
+		err(2, "open pagemap");
+
+	area = mmap(NULL, 3 * HPAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (area == MAP_FAILED)
+		err(2, "mmap");
+
+	thp = (char *)(((uintptr_t)area + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1));
+	base = thp + HPAGE_SIZE;
+
+	/* base pages first, then let the range take THPs again */
+	if (madvise(base, HPAGE_SIZE, MADV_NOHUGEPAGE))
+		err(2, "MADV_NOHUGEPAGE");
+	fill(base, 'b');
+	if (madvise(base, HPAGE_SIZE, MADV_HUGEPAGE))
+		err(2, "MADV_HUGEPAGE");
+
+	if (madvise(thp, HPAGE_SIZE, MADV_HUGEPAGE))
+		err(2, "MADV_HUGEPAGE");
+	fill(thp, 't');
+
+	if (is_transhuge(thp) != 1 || is_transhuge(base) != 0) {
+		printf("no THP to exchange, skipping\n");
+		return ksft_exit_skip();
+	}
+
+	from = thp;
+	to = base;
+	if (exchange_pages(1, &from, &to, &status))
+		err(1, "exchange_pages");
+	if (status) {
+		printf("exchange failed: %d\n", status);
+		return 1;
+	}
+
+	/* the data swapped ranges, and the THP went to the base range */
+	ret = check(thp, 'b', "thp range") | check(base, 't', "base range");
+	if (is_transhuge(base) != 1 || is_transhuge(thp) != 0) {
+		printf("THP not moved to the base range\n");
+		ret = 1;
+	}
+	if (ret)
+		return ret;
+
+	/* migration unmaps every page through its rmap */
+	ret = migrate(thp, base, 1);
+	if (ret == -ENODEV || ret == -EINVAL) {
+		printf("no node 1 to migrate to, skipping migration\n");
+		return 0;
+	}
+	if (!ret)
+		ret = migrate(thp, base, 0);
+	if (ret) {
+		printf("migration failed: %d\n", ret);
+		return 1;
+	}
+
+	return check(thp, 'b', "thp range after migration") |
+		check(base, 't', "base range after migration");
+}